@@ -36,6 +36,8 @@ Please see the file opencl/README.md for technical notes on this code.
 #define MACRO_max_num_SIGNATURES_IN_PARALLEL 1024
 #define MACRO_size_signature_buffer (MACRO_MEMORY_POOL_SIZE_Signature * MACRO_max_num_SIGNATURES_IN_PARALLEL)
 #define MACRO_size_of_signature (33 * 2 + 6)
+//Public keys generated by one work item share a single field inversion.
+#define MACRO_public_keys_per_work_item 8
 
 __global void* checked_malloc(unsigned int size, __global unsigned char* memoryPool);
 void memoryPool_write_uint(unsigned int numberToWrite, __global unsigned char* memoryPoolPointer);
@@ -526,6 +528,8 @@ void memoryPool_read_multiplicationContext_PORTABLE(
 );
 
 //Reads the generator context pointer. NOT PORTABLE: must NOT be called across GPU<->CPU.
+//The table pointer stored in the context is valid only where the pool was computed
+//or relocated, see memoryPool_relocate_generatorContext. Never writes to the pool.
 __global secp256k1_ecmult_gen_context* memoryPool_read_generatorContextPointer_NON_PORTABLE(
   __global const unsigned char* memoryPool
 );
@@ -533,4 +537,15 @@ __global secp256k1_ecmult_gen_context* memoryPool_read_generatorContextPointer_N
 __global secp256k1_ecmult_context* memoryPool_read_multiplicationContextPointer_NON_PORTABLE(
   __global const unsigned char* memoryPool
 );
+
+//Re-derives the table pointer stored in the context from its offset, output 1,
+//so that the pool may be used where it now lives: a pool computed by another
+//device, context or process, for example loaded from a context file.
+//Call once per pool, before any reader: readers run concurrently and never write.
+//If output 1 is 0, the table is outside the pool and the stored pointer is left as is:
+//the C++ build's compiled-in precomputed tables, see secp256k1_precomputed_tables.h.
+void memoryPool_relocate_generatorContext(__global unsigned char* memoryPool);
+
+//As memoryPool_relocate_generatorContext.
+void memoryPool_relocate_multiplicationContext(__global unsigned char* memoryPool);
 #endif //SECP256k1_H_header
@@ -30,31 +30,30 @@ __kernel void secp256k1_opencl_compute_generator_context(
   __global unsigned char* outputMemoryPoolContainingGeneratorContext
 );
 
-__kernel void secp256k1_opencl_sign(
+//The C++ build has no work items: the batched kernels below are
+//run one message at a time through their _one_message bodies.
+void secp256k1_opencl_sign_one_message(
   __global unsigned char* outputSignature,
   __global unsigned char* outputSizes,
   __global unsigned char* outputInputNonce,
   __global unsigned char* inputSecretKey,
   __global unsigned char* inputMessage,
   __global unsigned char* inputMemoryPoolGeneratorContext,
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  unsigned int inputMessageIndex
 );
 
-__kernel void secp256k1_opencl_generate_public_key(
+void secp256k1_opencl_generate_public_keys_range(
   __global unsigned char* outputPublicKey,
   __global unsigned char* outputPublicKeySize,
+  __global unsigned char* outputInversionScratch,
   __global unsigned char* inputSecretKey,
+  __global const unsigned char* inputCompressionFlags,
   __global unsigned char* inputMemoryPoolGeneratorContext,
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  unsigned int firstMessageIndex,
+  unsigned int numberOfMessages
 );
 
-__kernel void secp256k1_opencl_verify_signature(
+void secp256k1_opencl_verify_signature_one_message(
   __global unsigned char *output,
   __global unsigned char *outputMemoryPoolSignature,
   __global const unsigned char* inputSignature,
@@ -63,34 +62,25 @@ __kernel void secp256k1_opencl_verify_signature(
   __global const unsigned char* publicKeySizes,
   __global const unsigned char* message,
   __global const unsigned char* memoryPoolMultiplicationContext,
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  unsigned int messageIndex
 );
 
 __kernel void test_suite_1_basic_operations(
   __global unsigned char* memoryPool
 );
 
-__kernel void sha256GPU(
+void sha256GPU_one_message(
   __global unsigned char* result,
   __global const unsigned char* offsets,
   __global const unsigned char* messageLengths,
   __global const char* plain_key,
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  unsigned int messageIndex
 );
 
-__kernel void sha256_twice_GPU_fetch_best(
+void sha256_twice_GPU_fetch_best_one_message(
   __global unsigned char* result,
   __global const char* messages32bytesLength,
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  unsigned int messageIndex
 );
 #endif //SECP256K1_CPP_H_header
 
@@ -270,6 +270,16 @@ __global secp256k1_ecmult_gen_context* memoryPool_read_generatorContextPointer_N
   return ((__global secp256k1_ecmult_gen_context*) &memoryPool[position]);
 }
 
+void memoryPool_relocate_generatorContext(__global unsigned char* memoryPool) {
+  uint32_t positionContent = memoryPool_read_uint_fromOutput(1, memoryPool);
+  if (positionContent == 0) {
+    return;
+  }
+  uint32_t position = memoryPool_read_uint_fromOutput(0, memoryPool);
+  ((__global secp256k1_ecmult_gen_context*) &memoryPool[position])->prec =
+  (__global secp256k1_ge_storage*) &memoryPool[positionContent];
+}
+
 void memoryPool_read_generatorContext_PORTABLE(
   __global secp256k1_ecmult_gen_context* outputGeneratorContext,
   __global const unsigned char* memoryPool
@@ -282,6 +292,11 @@ void memoryPool_read_generatorContext_PORTABLE(
   ((__global secp256k1_ecmult_gen_context*) &memoryPool[outputPositionGeneratorContextStruct]);
   outputGeneratorContext->blind = pointerToContextAsStoredInPoolMayHaveDifferentPointerSize->blind;
   outputGeneratorContext->initial = pointerToContextAsStoredInPoolMayHaveDifferentPointerSize->initial;
+  if (outputPositionGeneratorContextContent == 0) {
+    //The table is outside the pool: see memoryPool_relocate_generatorContext.
+    outputGeneratorContext->prec = pointerToContextAsStoredInPoolMayHaveDifferentPointerSize->prec;
+    return;
+  }
   outputGeneratorContext->prec = (__global secp256k1_ge_storage*) &memoryPool[outputPositionGeneratorContextContent];
 }
 
@@ -292,12 +307,27 @@ __global secp256k1_ecmult_context* memoryPool_read_multiplicationContextPointer_
   return (__global secp256k1_ecmult_context*) &memoryPool[position];
 }
 
+void memoryPool_relocate_multiplicationContext(__global unsigned char* memoryPool) {
+  uint32_t positionContent = memoryPool_read_uint_fromOutput(1, memoryPool);
+  if (positionContent == 0) {
+    return;
+  }
+  uint32_t position = memoryPool_read_uint_fromOutput(0, memoryPool);
+  ((__global secp256k1_ecmult_context*) &memoryPool[position])->pre_g =
+  (__global secp256k1_ge_storage(*)[]) &memoryPool[positionContent];
+}
+
 void memoryPool_read_multiplicationContext_PORTABLE(
   __global secp256k1_ecmult_context* outputMultiplicationContext,
   __global const unsigned char* memoryPool
 ) {
   outputMultiplicationContext->pre_g = NULL;
   uint32_t position = memoryPool_read_uint_fromOutput(1, memoryPool);
+  if (position == 0) {
+    //The table is outside the pool: see memoryPool_relocate_generatorContext.
+    outputMultiplicationContext->pre_g = memoryPool_read_multiplicationContextPointer_NON_PORTABLE(memoryPool)->pre_g;
+    return;
+  }
   //int sizeOfGeneratorContextLump = (16 * 64 * sizeof(secp256k1_ge_storage));
   //logTest << "Size of generator context lump: " << sizeOfGeneratorContextLump << Logger::endL;
   //for (int i = 0; i < sizeOfGeneratorContextLump; i++)
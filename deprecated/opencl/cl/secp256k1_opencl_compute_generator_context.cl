@@ -32,4 +32,11 @@ __kernel void secp256k1_opencl_compute_generator_context(
   secp256k1_ecmult_gen_context_build(generatorContext, outputMemoryPoolContainingGeneratorContext);
 }
 
+//Run once, by one work item, on a context pool uploaded from a context file.
+__kernel void secp256k1_opencl_relocate_generator_context(
+  __global unsigned char* outputMemoryPoolContainingGeneratorContext
+) {
+  memoryPool_relocate_generatorContext(outputMemoryPoolContainingGeneratorContext);
+}
+
 #include "secp256k1_implementation.h"
@@ -32,4 +32,11 @@ __kernel void secp256k1_opencl_compute_multiplication_context(
   secp256k1_ecmult_context_build(multiplicationContext, outputMemoryPoolContainingMultiplicationContext);
 }
 
+//Run once, by one work item, on a context pool uploaded from a context file.
+__kernel void secp256k1_opencl_relocate_multiplication_context(
+  __global unsigned char* outputMemoryPoolContainingMultiplicationContext
+) {
+  memoryPool_relocate_multiplicationContext(outputMemoryPoolContainingMultiplicationContext);
+}
+
 #include "secp256k1_implementation.h"
@@ -10,40 +10,104 @@
 #include "secp256k1_implementation.h"
 
 
-__kernel void secp256k1_opencl_generate_public_key(
+//Generates the public keys of messages
+//firstMessageIndex, ..., firstMessageIndex + numberOfMessages - 1.
+//The Jacobian coordinates are converted to affine with a single field inversion
+//(see secp256k1_ge_set_all_gej_var), using 2 field elements of
+//outputInversionScratch per message.
+//At most MACRO_public_keys_per_work_item messages are processed.
+void secp256k1_opencl_generate_public_keys_range(
   __global unsigned char* outputPublicKey,
   __global unsigned char* outputPublicKeySize,
+  __global unsigned char* outputInversionScratch,
   __global unsigned char* inputSecretKey,
-  __global unsigned char* inputMemoryPoolGeneratorContext, 
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  __global const unsigned char* inputCompressionFlags,
+  __global unsigned char* inputMemoryPoolGeneratorContext,
+  unsigned int firstMessageIndex,
+  unsigned int numberOfMessages
 ) {
+  secp256k1_gej publicKeysJacobianCoordinates[MACRO_public_keys_per_work_item];
   secp256k1_scalar secretKey;
-  unsigned int inputMessageIndex = memoryPool_read_uint_from_four_bytes(
-    messageIndexByteHighest,
-    messageIndexByteHigher ,
-    messageIndexByteLower  ,
-    messageIndexByteLowest
-  );
-  unsigned int offset = 32 * inputMessageIndex;
-  unsigned int offsetOutput = MACRO_size_of_signature * inputMessageIndex;
-  secp256k1_scalar_set_b32__global(&secretKey, &inputSecretKey[offset], NULL);
+  secp256k1_ge publicKey;
+  secp256k1_fe zInverse;
+  unsigned int i, count, messageIndex;
+  size_t keySize;
+  if (numberOfMessages > MACRO_public_keys_per_work_item) {
+    numberOfMessages = MACRO_public_keys_per_work_item;
+  }
+  __global secp256k1_fe* zCoordinates = &((__global secp256k1_fe*) outputInversionScratch)[2 * firstMessageIndex];
+  __global secp256k1_fe* zInverses = &zCoordinates[numberOfMessages];
 
   __global secp256k1_ecmult_gen_context* generatorContext =
   memoryPool_read_generatorContextPointer_NON_PORTABLE(inputMemoryPoolGeneratorContext);
 
-  secp256k1_ge publicKey;
-  secp256k1_gej publicKeyJacobianCoordinates;
-  secp256k1_ecmult_gen(generatorContext, &publicKeyJacobianCoordinates, &secretKey);
-  secp256k1_ge_set_gej(&publicKey, &publicKeyJacobianCoordinates);
-  size_t keySize;
-  
-  if (secp256k1_eckey_pubkey_serialize(&publicKey, &outputPublicKey[offsetOutput], &keySize, 0) == 1) {
-    memoryPool_write_uint(keySize, &outputPublicKeySize[inputMessageIndex * 4]);
-  } else {
-    memoryPool_write_uint(0, &outputPublicKeySize[inputMessageIndex * 4]);
+  count = 0;
+  for (i = 0; i < numberOfMessages; i ++) {
+    messageIndex = firstMessageIndex + i;
+    secp256k1_scalar_set_b32__global(&secretKey, &inputSecretKey[32 * messageIndex], NULL);
+    secp256k1_ecmult_gen(generatorContext, &publicKeysJacobianCoordinates[i], &secretKey);
+    if (!publicKeysJacobianCoordinates[i].infinity) {
+      secp256k1_fe_copy__to__global(&zCoordinates[count], &publicKeysJacobianCoordinates[i].z);
+      count ++;
+    }
+  }
+  secp256k1_fe_inv_all_var(count, zInverses, zCoordinates);
+
+  count = 0;
+  for (i = 0; i < numberOfMessages; i ++) {
+    messageIndex = firstMessageIndex + i;
+    publicKey.infinity = 1;
+    if (!publicKeysJacobianCoordinates[i].infinity) {
+      secp256k1_fe_copy__from__global(&zInverse, &zInverses[count]);
+      count ++;
+      secp256k1_ge_set_gej_zinv(&publicKey, &publicKeysJacobianCoordinates[i], &zInverse);
+    }
+    if (secp256k1_eckey_pubkey_serialize(
+      &publicKey,
+      &outputPublicKey[MACRO_size_of_signature * messageIndex],
+      &keySize,
+      inputCompressionFlags[messageIndex] != 0
+    ) == 1) {
+      memoryPool_write_uint(keySize, &outputPublicKeySize[messageIndex * 4]);
+    } else {
+      memoryPool_write_uint(0, &outputPublicKeySize[messageIndex * 4]);
+    }
   }
 }
 
+#ifdef MACRO_USE_openCL
+//Each work item handles MACRO_public_keys_per_work_item consecutive messages.
+__kernel void secp256k1_opencl_generate_public_key(
+  __global unsigned char* outputPublicKey,
+  __global unsigned char* outputPublicKeySize,
+  __global unsigned char* outputInversionScratch,
+  __global unsigned char* inputSecretKey,
+  __global unsigned char* inputCompressionFlags,
+  __global unsigned char* inputMemoryPoolGeneratorContext,
+  unsigned char messageCountByteHighest,
+  unsigned char messageCountByteHigher ,
+  unsigned char messageCountByteLower  ,
+  unsigned char messageCountByteLowest
+) {
+  unsigned int messageCount = memoryPool_read_uint_from_four_bytes(
+    messageCountByteHighest,
+    messageCountByteHigher ,
+    messageCountByteLower  ,
+    messageCountByteLowest
+  );
+  unsigned int firstMessageIndex = ((unsigned int) get_global_id(0)) * MACRO_public_keys_per_work_item;
+  if (firstMessageIndex >= messageCount) {
+    return;
+  }
+  secp256k1_opencl_generate_public_keys_range(
+    outputPublicKey,
+    outputPublicKeySize,
+    outputInversionScratch,
+    inputSecretKey,
+    inputCompressionFlags,
+    inputMemoryPoolGeneratorContext,
+    firstMessageIndex,
+    messageCount - firstMessageIndex
+  );
+}
+#endif
@@ -8,37 +8,63 @@
 #endif
 #include "secp256k1_implementation.h"
 
-__kernel void secp256k1_opencl_sign(
+void secp256k1_opencl_sign_one_message(
   __global unsigned char* outputSignature,
   __global unsigned char* outputSizes,
   __global unsigned char* outputInputNonce,
   __global unsigned char* inputSecretKey,
   __global unsigned char* inputMessage,
   __global unsigned char* inputMemoryPoolGeneratorContext,
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  unsigned int inputMessageIndex
 ) {
   secp256k1_scalar secretKey, outputSignatureR, outputSignatureS, message, nonce;
-  unsigned int inputMessageIndex = memoryPool_read_uint_from_four_bytes(
-    messageIndexByteHighest,
-    messageIndexByteHigher ,
-    messageIndexByteLower  ,
-    messageIndexByteLowest
-  );
   unsigned int offset = inputMessageIndex * 32;
   secp256k1_scalar_set_b32__global(&secretKey, &inputSecretKey[offset], NULL);
   secp256k1_scalar_set_b32__global(&message, &inputMessage[offset], NULL);
   secp256k1_scalar_set_b32__global(&nonce, &outputInputNonce[offset], NULL);
- 
+
   __global secp256k1_ecmult_gen_context* generatorContext =
   memoryPool_read_generatorContextPointer_NON_PORTABLE(inputMemoryPoolGeneratorContext);
 
   secp256k1_ecdsa_sig_sign(generatorContext, &outputSignatureR, &outputSignatureS, &secretKey, &message, &nonce, NULL);
-  size_t outputSizeBuffer;
+  //Space available at the output: serialization writes nothing if it does not fit.
+  size_t outputSizeBuffer = MACRO_size_of_signature;
   unsigned int offsetSignature = MACRO_size_of_signature * inputMessageIndex;
   secp256k1_ecdsa_sig_serialize__global(&outputSignature[offsetSignature], &outputSizeBuffer, &outputSignatureR, &outputSignatureS);
   memoryPool_write_uint(outputSizeBuffer, &outputSizes[inputMessageIndex * 4]);
 }
 
+#ifdef MACRO_USE_openCL
+__kernel void secp256k1_opencl_sign(
+  __global unsigned char* outputSignature,
+  __global unsigned char* outputSizes,
+  __global unsigned char* outputInputNonce,
+  __global unsigned char* inputSecretKey,
+  __global unsigned char* inputMessage,
+  __global unsigned char* inputMemoryPoolGeneratorContext,
+  unsigned char messageCountByteHighest,
+  unsigned char messageCountByteHigher ,
+  unsigned char messageCountByteLower  ,
+  unsigned char messageCountByteLowest
+) {
+  unsigned int messageCount = memoryPool_read_uint_from_four_bytes(
+    messageCountByteHighest,
+    messageCountByteHigher ,
+    messageCountByteLower  ,
+    messageCountByteLowest
+  );
+  unsigned int inputMessageIndex = (unsigned int) get_global_id(0);
+  if (inputMessageIndex >= messageCount) {
+    return;
+  }
+  secp256k1_opencl_sign_one_message(
+    outputSignature,
+    outputSizes,
+    outputInputNonce,
+    inputSecretKey,
+    inputMessage,
+    inputMemoryPoolGeneratorContext,
+    inputMessageIndex
+  );
+}
+#endif
@@ -7,7 +7,7 @@
 //To do: make the header file structure more intuitive.
 #endif
 
-__kernel void secp256k1_opencl_verify_signature(
+void secp256k1_opencl_verify_signature_one_message(
   __global unsigned char *output,
   __global unsigned char *outputMemoryPoolSignatureBuffer,
   __global const unsigned char* inputSignature,
@@ -16,19 +16,10 @@ __kernel void secp256k1_opencl_verify_signature(
   __global const unsigned char* publicKeySizes,
   __global const unsigned char* message,
   __global const unsigned char* memoryPoolMultiplicationContext,
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  unsigned int messageIndex
 ) {
   unsigned char result;
   unsigned int publicKeySize, signatureSize;
-  unsigned int messageIndex = memoryPool_read_uint_from_four_bytes(
-    messageIndexByteHighest,
-    messageIndexByteHigher,
-    messageIndexByteLower,
-    messageIndexByteLowest
-  );
   publicKeySize = memoryPool_read_uint(&publicKeySizes[messageIndex * 4]);
   signatureSize = memoryPool_read_uint(&signatureSizes[messageIndex * 4]);
   unsigned int indexMemPoolSignature;
@@ -75,4 +66,46 @@ __kernel void secp256k1_opencl_verify_signature(
   output[messageIndex] = result;
 }
 
+#ifdef MACRO_USE_openCL
+//Messages share the signature memory pool slots modulo MACRO_max_num_SIGNATURES_IN_PARALLEL.
+//The host must therefore never launch more than
+//MACRO_max_num_SIGNATURES_IN_PARALLEL work items at once.
+__kernel void secp256k1_opencl_verify_signature(
+  __global unsigned char *output,
+  __global unsigned char *outputMemoryPoolSignatureBuffer,
+  __global const unsigned char* inputSignature,
+  __global const unsigned char* signatureSizes,
+  __global const unsigned char* publicKey,
+  __global const unsigned char* publicKeySizes,
+  __global const unsigned char* message,
+  __global const unsigned char* memoryPoolMultiplicationContext,
+  unsigned char messageCountByteHighest,
+  unsigned char messageCountByteHigher ,
+  unsigned char messageCountByteLower  ,
+  unsigned char messageCountByteLowest
+) {
+  unsigned int messageCount = memoryPool_read_uint_from_four_bytes(
+    messageCountByteHighest,
+    messageCountByteHigher ,
+    messageCountByteLower  ,
+    messageCountByteLowest
+  );
+  unsigned int messageIndex = (unsigned int) get_global_id(0);
+  if (messageIndex >= messageCount) {
+    return;
+  }
+  secp256k1_opencl_verify_signature_one_message(
+    output,
+    outputMemoryPoolSignatureBuffer,
+    inputSignature,
+    signatureSizes,
+    publicKey,
+    publicKeySizes,
+    message,
+    memoryPoolMultiplicationContext,
+    messageIndex
+  );
+}
+#endif
+
 #include "secp256k1_implementation.h"
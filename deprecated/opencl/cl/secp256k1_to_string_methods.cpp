@@ -114,7 +114,7 @@ std::string toStringOutputObject(int argumentIndex, const unsigned char* memoryP
   secp256k1_fe readerFieldElement1;
   std::stringstream out;
   if (argumentIndex > MACRO_numberOfOutputs || argumentIndex < 0) {
-    logGPU << "Memory pool output index " << argumentIndex << " out of bounds. ";
+    logGPU << "Memory pool output index " << argumentIndex << " out of bounds. " << Logger::endL;
     assert(false);
   }
   unsigned int position = memoryPool_read_uint_fromOutput(argumentIndex, memoryPool);
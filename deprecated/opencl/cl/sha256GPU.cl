@@ -15,25 +15,44 @@
 #endif
 
 
-__kernel void sha256GPU(
-  __global unsigned char* result, 
-  __global const unsigned char* offsets, 
-  __global const unsigned char* messageLengths, 
+void sha256GPU_one_message(
+  __global unsigned char* result,
+  __global const unsigned char* offsets,
+  __global const unsigned char* messageLengths,
   __global const char* plain_key,
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  unsigned int messageIndex
 ) {
-  unsigned int messageIndex = memoryPool_read_uint_from_four_bytes(
-    messageIndexByteHighest,
-    messageIndexByteHigher ,
-    messageIndexByteLower  ,
-    messageIndexByteLowest
-  );
   uint32_t resultOffset = messageIndex * 32;
   uint32_t offset = memoryPool_read_uint(& (offsets[4 * messageIndex]));
   uint32_t theLength = memoryPool_read_uint(&(messageLengths[4 * messageIndex]));
 
   sha256GPU_inner__global(&result[resultOffset], theLength, &plain_key[offset]);
-}
\ No newline at end of file
+}
+
+#ifdef MACRO_USE_openCL
+//One work item per message: the message index is the global id.
+//Work items with index at or above the message count exit right away;
+//they exist only because the global size is rounded up to the local size.
+__kernel void sha256GPU(
+  __global unsigned char* result,
+  __global const unsigned char* offsets,
+  __global const unsigned char* messageLengths,
+  __global const char* plain_key,
+  unsigned char messageCountByteHighest,
+  unsigned char messageCountByteHigher ,
+  unsigned char messageCountByteLower  ,
+  unsigned char messageCountByteLowest
+) {
+  unsigned int messageCount = memoryPool_read_uint_from_four_bytes(
+    messageCountByteHighest,
+    messageCountByteHigher ,
+    messageCountByteLower  ,
+    messageCountByteLowest
+  );
+  unsigned int messageIndex = (unsigned int) get_global_id(0);
+  if (messageIndex >= messageCount) {
+    return;
+  }
+  sha256GPU_one_message(result, offsets, messageLengths, plain_key, messageIndex);
+}
+#endif
@@ -45,20 +45,11 @@ void sha256GPU_first_2_bytes_output_lastSHA(unsigned char* resulT, char* input)
 	} 
 }
  
-__kernel void sha256_twice_GPU_fetch_best(
-  __global unsigned char* result, 
+void sha256_twice_GPU_fetch_best_one_message(
+  __global unsigned char* result,
   __global const char* messages32bytesLength,
-  unsigned char messageIndexByteHighest,
-  unsigned char messageIndexByteHigher ,
-  unsigned char messageIndexByteLower  ,
-  unsigned char messageIndexByteLowest
+  unsigned int messageIndex
 ) {
-  unsigned int messageIndex = memoryPool_read_uint_from_four_bytes(
-    messageIndexByteHighest,
-    messageIndexByteHigher ,
-    messageIndexByteLower  ,
-    messageIndexByteLowest
-  );
   uint32_t resultOffset = messageIndex * 32;
   uint32_t offset = resultOffset;
 
@@ -74,3 +65,26 @@ __kernel void sha256_twice_GPU_fetch_best(
 		result[i + resultOffset] = resultFinal[i]; 
 	}  
 }
+
+#ifdef MACRO_USE_openCL
+__kernel void sha256_twice_GPU_fetch_best(
+  __global unsigned char* result,
+  __global const char* messages32bytesLength,
+  unsigned char messageCountByteHighest,
+  unsigned char messageCountByteHigher ,
+  unsigned char messageCountByteLower  ,
+  unsigned char messageCountByteLowest
+) {
+  unsigned int messageCount = memoryPool_read_uint_from_four_bytes(
+    messageCountByteHighest,
+    messageCountByteHigher ,
+    messageCountByteLower  ,
+    messageCountByteLowest
+  );
+  unsigned int messageIndex = (unsigned int) get_global_id(0);
+  if (messageIndex >= messageCount) {
+    return;
+  }
+  sha256_twice_GPU_fetch_best_one_message(result, messages32bytesLength, messageIndex);
+}
+#endif
@@ -1,3 +1,10 @@
-__kernel void testBuffer(__global char* buffer, __global unsigned char* offsets, unsigned int messageIndex) {
- 
+__kernel void testBuffer(
+  __global char* buffer,
+  __global unsigned char* offsets,
+  unsigned char messageCountByteHighest,
+  unsigned char messageCountByteHigher ,
+  unsigned char messageCountByteLower  ,
+  unsigned char messageCountByteLowest
+) {
+
 }
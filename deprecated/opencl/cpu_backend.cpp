@@ -0,0 +1,299 @@
+#include "cpu_backend.h"
+#include "server.h"
+#include "secp256k1_interface.h"
+#include "cl/secp256k1_cpp.h"
+#include "logging.h"
+#include <algorithm>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+extern Logger logServer;
+
+WorkStealingPool::WorkStealingPool() {
+  this->numberOfPendingTasks = 0;
+  this->nextWorker = 0;
+  this->flagStop = false;
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  this->stop();
+}
+
+unsigned int WorkStealingPool::size() {
+  return this->workers.size();
+}
+
+bool WorkStealingPool::start(unsigned int numberOfThreads) {
+  if (!this->workers.empty()) {
+    return true;
+  }
+  unsigned int numberOfCores = std::max(std::thread::hardware_concurrency(), 1u);
+  if (numberOfThreads == 0) {
+    numberOfThreads = numberOfCores;
+  }
+  this->flagStop = false;
+  for (unsigned i = 0; i < numberOfThreads; i ++) {
+    this->workers.push_back(std::unique_ptr<Worker>(new Worker));
+  }
+  for (unsigned i = 0; i < numberOfThreads; i ++) {
+    this->workers[i]->theThread = std::thread(&WorkStealingPool::run, this, i);
+    //Pinning is best-effort: a worker that stays unpinned only loses its cache locality.
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(i % numberOfCores, &cores);
+    if (pthread_setaffinity_np(this->workers[i]->theThread.native_handle(), sizeof(cpu_set_t), &cores) != 0) {
+      logServer << "Failed to pin CPU worker " << i << " to core " << i % numberOfCores << ". " << Logger::endL;
+    }
+  }
+  return true;
+}
+
+void WorkStealingPool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(this->sleepLock);
+    this->flagStop = true;
+  }
+  this->wakeUp.notify_all();
+  for (unsigned i = 0; i < this->workers.size(); i ++) {
+    if (this->workers[i]->theThread.joinable()) {
+      this->workers[i]->theThread.join();
+    }
+  }
+  this->workers.clear();
+}
+
+bool WorkStealingPool::submit(Task task) {
+  if (this->workers.empty()) {
+    return false;
+  }
+  unsigned int workerIndex = this->nextWorker.fetch_add(1) % this->workers.size();
+  {
+    //Counted before it is pushed, so that the count never drops below zero once the task is taken,
+    //and under the sleep lock, so that a worker about to sleep cannot miss the notification.
+    std::lock_guard<std::mutex> lock(this->sleepLock);
+    this->numberOfPendingTasks ++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(this->workers[workerIndex]->lock);
+    this->workers[workerIndex]->tasks.push_back(std::move(task));
+  }
+  this->wakeUp.notify_one();
+  return true;
+}
+
+bool WorkStealingPool::take(unsigned int workerIndex, Task& output) {
+  for (unsigned i = 0; i < this->workers.size(); i ++) {
+    Worker& current = *this->workers[(workerIndex + i) % this->workers.size()];
+    std::lock_guard<std::mutex> lock(current.lock);
+    if (current.tasks.empty()) {
+      continue;
+    }
+    if (i == 0) {
+      output = std::move(current.tasks.back());
+      current.tasks.pop_back();
+    } else {
+      output = std::move(current.tasks.front());
+      current.tasks.pop_front();
+    }
+    this->numberOfPendingTasks --;
+    return true;
+  }
+  return false;
+}
+
+void WorkStealingPool::run(unsigned int workerIndex) {
+  Task current;
+  while (true) {
+    if (this->take(workerIndex, current)) {
+      current(workerIndex);
+      current = nullptr;
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(this->sleepLock);
+    this->wakeUp.wait(lock, [this]() {
+      return this->flagStop.load() || this->numberOfPendingTasks.load() > 0;
+    });
+    if (this->flagStop.load()) {
+      return;
+    }
+  }
+}
+
+unsigned int CPUBackend::messagesPerTask(const std::string& command) {
+  if (command == "generatePublicKey") {
+    return MACRO_public_keys_per_work_item;
+  }
+  if (command == "SHA256") {
+    return 64;
+  }
+  return 1;
+}
+
+CPUBackend::CPUBackend() {
+  this->flagInitialized = false;
+}
+
+bool CPUBackend::initialize(unsigned int numberOfThreads) {
+  if (this->flagInitialized) {
+    return true;
+  }
+  if (
+    !CryptoEC256k1::computeGeneratorContextDefaultBuffers() ||
+    !CryptoEC256k1::computeMultiplicationContextDefaultBuffers()
+  ) {
+    logServer << "Failed to compute the secp256k1 contexts of the CPU backend. " << Logger::endL;
+    return false;
+  }
+  CryptoEC256k1::flagGeneratorContextComputed = true;
+  CryptoEC256k1::flagMultiplicationContextComputed = true;
+  if (!this->pool.start(numberOfThreads)) {
+    return false;
+  }
+  this->signaturePools.resize(this->pool.size());
+  for (unsigned i = 0; i < this->signaturePools.size(); i ++) {
+    this->signaturePools[i].resize(MACRO_MEMORY_POOL_SIZE_Signature);
+  }
+  logServer << "CPU backend: " << this->pool.size() << " worker thread(s). " << Logger::endL;
+  this->flagInitialized = true;
+  return true;
+}
+
+//Computes messages [first, first + count) of the batch, each written at its own offset of the outputs.
+//Inputs are copied out of the requests, as laid out by the Server::Queue* functions.
+static void computeRange(
+  CPUBackend& backend,
+  const std::string& command,
+  const std::vector<std::string>& requests,
+  InFlightBatch& batch,
+  unsigned int first,
+  unsigned int count,
+  unsigned int workerIndex
+) {
+  if (command == "SHA256") {
+    for (unsigned i = first; i < first + count; i ++) {
+      unsigned char offset[4], length[4];
+      memoryPool_write_uint(0, offset);
+      memoryPool_write_uint(requests[i].size(), length);
+      sha256GPU_one_message(&batch.data[i * 32], offset, length, requests[i].data(), 0);
+    }
+    return;
+  }
+  if (command == "signOneMessage") {
+    for (unsigned i = first; i < first + count; i ++) {
+      unsigned char nonce[32], secretKey[32], message[32];
+      memcpy(nonce, requests[i].data(), 32);
+      memcpy(secretKey, requests[i].data() + 32, 32);
+      memcpy(message, requests[i].data() + 64, 32);
+      secp256k1_opencl_sign_one_message(
+        &batch.data[i * MACRO_size_of_signature],
+        &batch.dataSecond[i * 4],
+        nonce,
+        secretKey,
+        message,
+        CryptoEC256k1::bufferGeneratorContext,
+        0
+      );
+    }
+    return;
+  }
+  if (command == "verifySignature") {
+    for (unsigned i = first; i < first + count; i ++) {
+      const std::string& request = requests[i];
+      unsigned int signatureSize = (unsigned char) request[0];
+      unsigned int publicKeySize = (unsigned char) request[1 + signatureSize];
+      unsigned char signature[MACRO_size_of_signature], publicKey[MACRO_size_of_signature];
+      unsigned char signatureSizeBytes[4], publicKeySizeBytes[4];
+      memcpy(signature, request.data() + 1, signatureSize);
+      memcpy(publicKey, request.data() + 2 + signatureSize, publicKeySize);
+      memoryPool_write_uint(signatureSize, signatureSizeBytes);
+      memoryPool_write_uint(publicKeySize, publicKeySizeBytes);
+      //Message index 0: every worker verifies in slot 0 of its own signature memory pool.
+      secp256k1_opencl_verify_signature_one_message(
+        &batch.data[i],
+        backend.signaturePools[workerIndex].data(),
+        signature,
+        signatureSizeBytes,
+        publicKey,
+        publicKeySizeBytes,
+        (const unsigned char*) request.data() + request.size() - 32,
+        CryptoEC256k1::bufferMultiplicationContext,
+        0
+      );
+    }
+    return;
+  }
+  if (command == "generatePublicKey") {
+    //One field inversion for the whole range, as in a work item of the kernel.
+    unsigned char secretKeys[MACRO_public_keys_per_work_item * 32];
+    unsigned char compressionFlags[MACRO_public_keys_per_work_item];
+    secp256k1_fe inversionScratch[2 * MACRO_public_keys_per_work_item];
+    for (unsigned i = 0; i < count; i ++) {
+      const std::string& request = requests[first + i];
+      memcpy(&secretKeys[i * 32], request.data(), 32);
+      compressionFlags[i] = request.size() == 33 && request[32] != 0 ? 1 : 0;
+    }
+    secp256k1_opencl_generate_public_keys_range(
+      &batch.data[first * MACRO_size_of_signature],
+      &batch.dataSecond[first * 4],
+      (unsigned char*) inversionScratch,
+      secretKeys,
+      compressionFlags,
+      CryptoEC256k1::bufferGeneratorContext,
+      0,
+      count
+    );
+    return;
+  }
+}
+
+void CPUBackend::execute(
+  const std::string& command, std::shared_ptr<std::vector<std::string> > requests, std::shared_ptr<InFlightBatch> batch
+) {
+  unsigned int numberOfMessages = requests->size();
+  batch->timeLaunched = std::chrono::steady_clock::now();
+  if (command == "testBuffer") {
+    //No work performed: the payloads are echoed at their offsets, as read back from the kernel.
+    batch->dataSecond.resize(numberOfMessages * 4);
+    for (unsigned i = 0; i < numberOfMessages; i ++) {
+      memoryPool_write_uint(batch->data.size(), &batch->dataSecond[i * 4]);
+      batch->data.insert(batch->data.end(), (*requests)[i].begin(), (*requests)[i].end());
+    }
+    batch->timeCompleted = std::chrono::steady_clock::now();
+    batch->completionStatus.store(CL_COMPLETE);
+    return;
+  }
+  if (command == "SHA256") {
+    batch->data.resize(numberOfMessages * 32);
+  } else if (command == "verifySignature") {
+    batch->data.resize(numberOfMessages);
+  } else {
+    batch->data.resize(numberOfMessages * MACRO_size_of_signature);
+    batch->dataSecond.resize(numberOfMessages * 4);
+  }
+  unsigned int messagesPerTask = CPUBackend::messagesPerTask(command);
+  unsigned int numberOfTasks = (numberOfMessages + messagesPerTask - 1) / messagesPerTask;
+  if (numberOfTasks == 0) {
+    batch->timeCompleted = std::chrono::steady_clock::now();
+    batch->completionStatus.store(CL_COMPLETE);
+    return;
+  }
+  std::shared_ptr<std::atomic<unsigned int> > tasksLeft = std::make_shared<std::atomic<unsigned int> >(numberOfTasks);
+  for (unsigned i = 0; i < numberOfTasks; i ++) {
+    unsigned int first = i * messagesPerTask;
+    unsigned int count = std::min(messagesPerTask, numberOfMessages - first);
+    bool submitted = this->pool.submit([this, command, requests, batch, tasksLeft, first, count](unsigned int workerIndex) {
+      computeRange(*this, command, *requests, *batch, first, count, workerIndex);
+      if (tasksLeft->fetch_sub(1) == 1) {
+        //The dispatch thread reads the outputs only after it sees CL_COMPLETE.
+        batch->timeCompleted = std::chrono::steady_clock::now();
+        batch->completionStatus.store(CL_COMPLETE);
+      }
+    });
+    if (!submitted) {
+      logServer << "The CPU backend has no worker threads: " << command << " batch not run. " << Logger::endL;
+      batch->completionStatus.store(CL_OUT_OF_RESOURCES);
+      return;
+    }
+  }
+}
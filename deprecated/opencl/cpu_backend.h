@@ -0,0 +1,75 @@
+#ifndef CPU_BACKEND_H_header
+#define CPU_BACKEND_H_header
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Fixed set of worker threads, each pinned to its own core.
+//Every worker owns a deque of tasks: it runs its newest task first
+//and, once its deque is empty, steals the oldest task of another worker.
+//Tasks are chunks of a batch, so one lock per deque is cheap.
+class WorkStealingPool {
+public:
+  //A task gets the index of the worker that runs it, for per-worker scratch memory.
+  typedef std::function<void(unsigned int workerIndex)> Task;
+private:
+  class Worker {
+  public:
+    std::mutex lock;
+    std::deque<Task> tasks;
+    std::thread theThread;
+  };
+  std::vector<std::unique_ptr<Worker> > workers;
+  std::atomic<unsigned int> numberOfPendingTasks;
+  std::atomic<unsigned int> nextWorker;
+  std::atomic<bool> flagStop;
+  std::mutex sleepLock;
+  std::condition_variable wakeUp;
+  void run(unsigned int workerIndex);
+  bool take(unsigned int workerIndex, Task& output);
+public:
+  //0 threads: one per core.
+  bool start(unsigned int numberOfThreads);
+  //False, and the task dropped, if the pool has no workers: it was never started, or was stopped.
+  bool submit(Task task);
+  void stop();
+  unsigned int size();
+  WorkStealingPool();
+  ~WorkStealingPool();
+};
+
+class InFlightBatch;
+
+//Runs the server commands with the C++ build of the kernels (see cl/secp256k1_cpp.h)
+//directly on host memory, with no OpenCL.
+//Serves boxes without a usable OpenCL device and batches too small to be worth a device round trip.
+class CPUBackend {
+public:
+  //One signature verification memory pool per worker.
+  std::vector<std::vector<unsigned char> > signaturePools;
+  //Declared after the memory it uses: its workers are joined first.
+  WorkStealingPool pool;
+  //Set by the warm-up thread, see Server::RunWarmUp.
+  std::atomic<bool> flagInitialized;
+  //Messages computed by one task: a whole group of batched public key inversions,
+  //a single signature, or a run of hashes.
+  static unsigned int messagesPerTask(const std::string& command);
+  //Computes the secp256k1 contexts and starts the pool.
+  bool initialize(unsigned int numberOfThreads);
+  //Computes the requests of a command into batch.data and batch.dataSecond, in the layouts
+  //read back from the corresponding kernel, see Server::ProcessResultsOfKernel.
+  //Returns at once; the last task stores batch.timeCompleted and then CL_COMPLETE in batch.completionStatus.
+  //The requests must have passed Server::CheckSignOneMessage, CheckVerifySignature or CheckGeneratePublicKey.
+  void execute(
+    const std::string& command, std::shared_ptr<std::vector<std::string> > requests, std::shared_ptr<InFlightBatch> batch
+  );
+  CPUBackend();
+};
+
+#endif // CPU_BACKEND_H_header
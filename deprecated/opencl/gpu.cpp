@@ -1,11 +1,17 @@
 #include "gpu.h"
 #include "logging.h"
 #include "miscellaneous.h"
+#ifdef MACRO_USE_EMBEDDED_KERNEL_SOURCES
+#include "kernel_sources.h"
+#endif
 #include <fstream>
 #include <iostream>
 #include <iomanip>
 #include <assert.h>
 #include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <stdlib.h>
 
 #define MAX_SOURCE_SIZE (0x100000)
 
@@ -23,6 +29,41 @@ std::string OpenCLFunctions::getDeviceInfo(cl_device_id deviceId, cl_device_info
   return result;
 }
 
+bool OpenCLFunctions::getDevices(cl_device_type deviceType, std::vector<cl_device_id>& output) {
+  output.clear();
+  cl_uint numberOfPlatforms = 0;
+  cl_int ret = clGetPlatformIDs(0, NULL, &numberOfPlatforms);
+  if (ret != CL_SUCCESS || numberOfPlatforms == 0) {
+    logGPU << "Failed to get platforms. Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  std::vector<cl_platform_id> platforms(numberOfPlatforms);
+  ret = clGetPlatformIDs(numberOfPlatforms, platforms.data(), NULL);
+  if (ret != CL_SUCCESS) {
+    logGPU << "Failed to get platforms. Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  for (unsigned i = 0; i < platforms.size(); i ++) {
+    cl_uint numberOfDevices = 0;
+    //CL_DEVICE_NOT_FOUND: the platform has no device of the type.
+    if (clGetDeviceIDs(platforms[i], deviceType, 0, NULL, &numberOfDevices) != CL_SUCCESS || numberOfDevices == 0) {
+      continue;
+    }
+    std::vector<cl_device_id> devices(numberOfDevices);
+    if (clGetDeviceIDs(platforms[i], deviceType, numberOfDevices, devices.data(), NULL) != CL_SUCCESS) {
+      continue;
+    }
+    output.insert(output.end(), devices.begin(), devices.end());
+  }
+  return !output.empty();
+}
+
+cl_device_type OpenCLFunctions::getDeviceType(cl_device_id deviceId) {
+  cl_device_type result = 0;
+  clGetDeviceInfo(deviceId, CL_DEVICE_TYPE, sizeof(result), &result, NULL);
+  return result;
+}
+
 std::string OpenCLFunctions::getDriverVersion(cl_device_id deviceId) {
   return getDeviceInfo(deviceId, CL_DRIVER_VERSION);
 }
@@ -48,20 +89,65 @@ long long OpenCLFunctions::getGlobalMemorySize(cl_device_id deviceId) {
   return result;
 }
 
+unsigned int OpenCLFunctions::getMaximumComputeUnits(cl_device_id deviceId) {
+  cl_uint result = 0;
+  clGetDeviceInfo(deviceId, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(result), &result, NULL);
+  return result;
+}
+
 std::string OpenCLFunctions::getDeviceName(cl_device_id deviceId) {
   return (std::string) getDeviceInfo(deviceId, CL_DEVICE_NAME);
 }
 
+bool OpenCLFunctions::getSharesHostMemory(cl_device_id deviceId) {
+  cl_device_type deviceType = 0;
+  clGetDeviceInfo(deviceId, CL_DEVICE_TYPE, sizeof(deviceType), &deviceType, NULL);
+  if ((deviceType & CL_DEVICE_TYPE_CPU) != 0) {
+    return true;
+  }
+  cl_bool hostUnifiedMemory = CL_FALSE;
+  clGetDeviceInfo(deviceId, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(hostUnifiedMemory), &hostUnifiedMemory, NULL);
+  return hostUnifiedMemory == CL_TRUE;
+}
+
 SharedMemory::SharedMemory() {
   this->name = "";
   this->theMemory = 0;
   this->typE = this->typeVoidPointer;
   this->uintValue = 0;
   this->memoryExternallyOwned = 0;
+  this->bytesPerMessage = 0;
+  this->maximumSize = 0;
+  this->memoryFlags = CL_MEM_READ_WRITE;
+}
+
+ArgumentSize::ArgumentSize() {
+  this->bytesPerMessage = 0;
+  this->initialSize = GPU::defaultBufferSize;
+  this->maximumSize = GPU::defaultBufferSize;
 }
 
 void SharedMemory::ReleaseMe() {
-  clReleaseMemObject(this->theMemory);
+  if (this->ring.empty()) {
+    clReleaseMemObject(this->theMemory);
+  }
+  //theMemory is one of the ring buffers.
+  for (unsigned i = 0; i < this->ring.size(); i ++) {
+    clReleaseMemObject(this->ring[i]);
+  }
+  this->ring.clear();
+  this->ringSizes.clear();
+  this->hostRing.clear();
+  //Releasing a buffer also drops its mapping.
+  for (unsigned i = 0; i < this->pinnedRing.size(); i ++) {
+    if (this->pinnedRing[i] != 0) {
+      clReleaseMemObject(this->pinnedRing[i]);
+    }
+  }
+  this->pinnedRing.clear();
+  this->pinnedRingPointers.clear();
+  this->pinnedRingSizes.clear();
+  this->mappedRing.clear();
   this->theMemory = 0;
   this->memoryExternallyOwned = 0;
   this->name = "";
@@ -71,6 +157,135 @@ SharedMemory::~SharedMemory() {
   this->ReleaseMe();
 }
 
+KernelTuning::KernelTuning() {
+  this->localSize = 32;
+  this->messagesPerLaunch = 0;
+  this->batchSize = 0;
+}
+
+DurationHistogram::DurationHistogram() {
+  for (unsigned i = 0; i < DurationHistogram::numberOfBuckets; i ++) {
+    this->buckets[i] = 0;
+  }
+  this->count = 0;
+  this->totalSeconds = 0;
+  this->maximumSeconds = 0;
+}
+
+void DurationHistogram::add(double seconds) {
+  seconds = std::max(seconds, 0.0);
+  unsigned int bucket = 0;
+  for (double microseconds = seconds * 1000000; microseconds >= 1 && bucket + 1 < DurationHistogram::numberOfBuckets; microseconds /= 2) {
+    bucket ++;
+  }
+  this->buckets[bucket] ++;
+  this->count ++;
+  this->totalSeconds += seconds;
+  this->maximumSeconds = std::max(this->maximumSeconds, seconds);
+}
+
+double DurationHistogram::percentile(double fraction) const {
+  if (this->count == 0) {
+    return 0;
+  }
+  unsigned long long wanted = (unsigned long long) (fraction * this->count);
+  unsigned long long seen = 0;
+  for (unsigned i = 0; i < DurationHistogram::numberOfBuckets; i ++) {
+    seen += this->buckets[i];
+    if (seen > wanted) {
+      return std::min(std::ldexp(1.0, i) / 1000000, this->maximumSeconds);
+    }
+  }
+  return this->maximumSeconds;
+}
+
+void DurationHistogram::toJSON(std::ostream& output) const {
+  output << "{\"count\":" << this->count << ",\"totalSeconds\":" << this->totalSeconds
+  << ",\"p50\":" << this->percentile(0.5) << ",\"p99\":" << this->percentile(0.99)
+  << ",\"maximum\":" << this->maximumSeconds << ",\"bucketsMicroseconds\":[";
+  unsigned int numberOfUsedBuckets = DurationHistogram::numberOfBuckets;
+  while (numberOfUsedBuckets > 0 && this->buckets[numberOfUsedBuckets - 1] == 0) {
+    numberOfUsedBuckets --;
+  }
+  for (unsigned i = 0; i < numberOfUsedBuckets; i ++) {
+    output << (i == 0 ? "" : ",") << this->buckets[i];
+  }
+  output << "]}";
+}
+
+KernelStatistics::KernelStatistics() {
+  this->numberOfWrites = 0;
+  this->numberOfLaunches = 0;
+  this->numberOfReads = 0;
+  this->bytesWritten = 0;
+  this->bytesRead = 0;
+  this->submitSeconds = 0;
+}
+
+void KernelStatistics::record(
+  KernelStatistics::CommandKind kind,
+  cl_ulong queued,
+  cl_ulong submitted,
+  cl_ulong dependenciesEnded,
+  cl_ulong started,
+  cl_ulong ended,
+  size_t bytes
+) {
+  //Timestamps are in nanoseconds of the device's clock; some drivers leave a stage unset.
+  cl_ulong ready = std::min(std::max(queued, dependenciesEnded), std::max(queued, started));
+  double runSeconds = ended > started ? (ended - started) / 1e9 : 0;
+  this->dependencyWait.add((ready - queued) / 1e9);
+  this->queueWait.add(started > ready ? (started - ready) / 1e9 : 0);
+  this->submitSeconds += submitted > queued ? (submitted - queued) / 1e9 : 0;
+  if (kind == KernelStatistics::commandLaunch) {
+    this->numberOfLaunches ++;
+    this->execute.add(runSeconds);
+    return;
+  }
+  this->transfer.add(runSeconds);
+  if (kind == KernelStatistics::commandWrite) {
+    this->numberOfWrites ++;
+    this->bytesWritten += bytes;
+  } else {
+    this->numberOfReads ++;
+    this->bytesRead += bytes;
+  }
+}
+
+std::string KernelStatistics::bound() const {
+  if (this->transfer.count == 0 && this->execute.count == 0) {
+    return "idle";
+  }
+  return this->transfer.totalSeconds > this->execute.totalSeconds ? "transfer" : "compute";
+}
+
+void KernelStatistics::toJSON(std::ostream& output) const {
+  output << "{\"writes\":" << this->numberOfWrites << ",\"launches\":" << this->numberOfLaunches
+  << ",\"reads\":" << this->numberOfReads << ",\"bytesWritten\":" << this->bytesWritten
+  << ",\"bytesRead\":" << this->bytesRead << ",\"submitSeconds\":" << this->submitSeconds
+  << ",\"dependencyWait\":";
+  this->dependencyWait.toJSON(output);
+  output << ",\"queueWait\":";
+  this->queueWait.toJSON(output);
+  output << ",\"transfer\":";
+  this->transfer.toJSON(output);
+  output << ",\"execute\":";
+  this->execute.toJSON(output);
+  output << ",\"bound\":\"" << this->bound() << "\"}";
+}
+
+std::string KernelStatistics::toStringSummary() const {
+  std::stringstream out;
+  out << this->numberOfLaunches << " launch(es), execute " << this->execute.totalSeconds * 1000
+  << " ms (p50 " << this->execute.percentile(0.5) * 1000 << " ms, p99 " << this->execute.percentile(0.99) * 1000
+  << " ms); " << this->numberOfWrites + this->numberOfReads << " transfer(s) of " << this->bytesWritten
+  << " + " << this->bytesRead << " bytes, " << this->transfer.totalSeconds * 1000
+  << " ms; dependency wait p50 " << this->dependencyWait.percentile(0.5) * 1000 << " ms, p99 "
+  << this->dependencyWait.percentile(0.99) * 1000 << " ms; queue wait p50 " << this->queueWait.percentile(0.5) * 1000
+  << " ms, p99 " << this->queueWait.percentile(0.99) * 1000 << " ms: " << this->bound() << " bound. ";
+  return out.str();
+}
+
 GPUKernel::GPUKernel() {
   this->local_item_size[0] = 32;
   this->global_item_size[0] = 32;
@@ -78,14 +293,24 @@ GPUKernel::GPUKernel() {
   this->global_item_size[1] = 1;
   this->local_item_size[2] = 1;
   this->global_item_size[2] = 1;
+  this->messagesPerWorkItem = 1;
+  this->bufferRingDepth = 1;
+  this->currentSlot = 0;
+  this->messagesPerLaunchLimit = 0;
+  this->maximumMessages = GPUKernel::defaultMaximumMessages;
   this->numInitializedExternallyOwnedBuffers = 0;
   this->program = NULL;
   this->kernel = NULL;
+  this->flagIsCompiled = false;
   this->flagIsBuilt = false;
+  this->profileOfCommands = std::make_shared<GPUKernel::Profile>();
 }
 
 GPUKernel::~GPUKernel() {
   //logGPU << "Kernel " << this->name << " destruction started. " << Logger::endL;
+  for (unsigned i = 0; i < this->pendingUnmaps.size(); i ++) {
+    GPU::releaseEvents(this->pendingUnmaps[i]);
+  }
   for (unsigned i = 0; i < this->inputs.size(); i ++) {
     this->inputs[i]->ReleaseMe();
   }
@@ -119,6 +344,8 @@ GPUKernel::~GPUKernel() {
 
 GPU::GPU() {
   this->flagVerbose = false;
+  this->flagZeroCopy = false;
+  this->flagSubDevice = false;
   this->flagInitializedPlatform = false;
   this->flagInitializedKernelsFull = false;
   this->flagInitializedKernelsNoBuild = false;
@@ -126,14 +353,13 @@ GPU::GPU() {
   this->context = NULL;
   this->flagMultiplicationContextComputed = false;
   this->flagGeneratorContextComputed = false;
-  this->flagMultiplicationContextComputationSTARTED = false;
-  this->flagGeneratorContextComputationSTARTED = false;
 
   this->bufferMultiplicationContext = new unsigned char [GPU::memoryMultiplicationContext];
   this->bufferTestSuite1BasicOperations = new unsigned char [GPU::memoryMultiplicationContext];
   this->bufferGeneratorContext = new unsigned char [GPU::memoryGeneratorContext];
   this->bufferSignature = new unsigned char [GPU::memorySignature];
   this->theDesiredDeviceType = CL_DEVICE_TYPE_GPU;
+  this->desiredDeviceId = NULL;
 }
 
 bool GPU::initializeAllFull() {
@@ -159,10 +385,12 @@ std::shared_ptr<GPUKernel> GPU::getKernel(const std::string& kernelName) {
 
 std::string GPU::getId() {
   std::stringstream out;
-  if (this->theDesiredDeviceType == CL_DEVICE_TYPE_GPU) {
-    out << "Graphics PU";
-  } else {
+  if (this->theDesiredDeviceType == CL_DEVICE_TYPE_CPU) {
     out << "OpenCL CPU";
+  } else if (this->theDesiredDeviceType == CL_DEVICE_TYPE_ACCELERATOR) {
+    out << "OpenCL accelerator";
+  } else {
+    out << "Graphics PU";
   }
   if (this->deviceInfo != "") {
     out << ", " << this->deviceInfo;
@@ -170,6 +398,15 @@ std::string GPU::getId() {
   return out.str();
 }
 
+bool GPU::servesKernel(const std::string& kernelName) {
+  if (std::find(this->kernelsNotServed.begin(), this->kernelsNotServed.end(), kernelName) != this->kernelsNotServed.end()) {
+    return false;
+  }
+  return
+    this->kernelsServed.empty() ||
+    std::find(this->kernelsServed.begin(), this->kernelsServed.end(), kernelName) != this->kernelsServed.end();
+}
+
 bool GPU::finish() {
   cl_int ret = clFinish(this->commandQueue);
   if (ret != CL_SUCCESS) {
@@ -199,38 +436,37 @@ bool GPU::initializePlatform() {
   //setenv("CUDA_CACHE_DISABLE", "1", 1);
   this->context = 0;
   cl_int ret = 0;
-  ret = clGetPlatformIDs(2, this->platformIds, &this->numberOfPlatforms);
-  if (ret != CL_SUCCESS) {
-    logGPU << "Failed to get platforms." << Logger::endL;
-    return false;
-  }
-  if (this->flagVerbose) {
-    logGPU << "Number of platforms: " << this->numberOfPlatforms << "\n";
-  }
   std::string deviceDescription = this->theDesiredDeviceType == CL_DEVICE_TYPE_CPU ? "CPU" : "GPU";
-  for (unsigned i = 0; i < this->numberOfPlatforms; i ++) {
-    ret = clGetDeviceIDs(this->platformIds[i], this->theDesiredDeviceType, 2, this->allDevices, &this->numberOfDevices);
-    if (ret == CL_SUCCESS)
-      break;
-  }
-  if (ret != CL_SUCCESS) {
+  if (!OpenCLFunctions::getDevices(this->theDesiredDeviceType, this->allDevices)) {
     logGPU << "Failed to get device of type: " << deviceDescription << Logger::endL;
     return false;
   }
   if (this->flagVerbose) {
-    logGPU << "Number of devices of type: " << deviceDescription << ": " << this->numberOfDevices << "\n";
+    logGPU << "Number of devices of type: " << deviceDescription << ": " << this->allDevices.size() << Logger::endL;
   }
-  this->currentDeviceId = this->allDevices[0];
+  this->currentDeviceId = this->desiredDeviceId != NULL ? this->desiredDeviceId : this->allDevices[0];
   this->deviceInfo = OpenCLFunctions::getDeviceName(this->currentDeviceId);
+  this->flagZeroCopy = OpenCLFunctions::getSharesHostMemory(this->currentDeviceId);
+  if (this->flagZeroCopy) {
+    logGPU << "Device shares host memory: staging buffers are used in place. " << Logger::endL;
+  } else {
+    logGPU << "Device has its own memory: staging buffers are copied asynchronously. " << Logger::endL;
+  }
   if (this->flagVerbose) {
-    logGPU << "Device name: " << OpenCLFunctions::getDeviceName(this->currentDeviceId) << "\n";
-    logGPU << "Driver version: " << OpenCLFunctions::getDriverVersion(this->currentDeviceId) << "\n";
-    logGPU << "Is little endian: " << OpenCLFunctions::getIsLittleEndian(this->currentDeviceId) << "\n";
-    logGPU << "Memory: " << OpenCLFunctions::getGlobalMemorySize(this->currentDeviceId) << "\n";
+    logGPU << "Device name: " << OpenCLFunctions::getDeviceName(this->currentDeviceId) << Logger::endL;
+    logGPU << "Driver version: " << OpenCLFunctions::getDriverVersion(this->currentDeviceId) << Logger::endL;
+    logGPU << "Is little endian: " << OpenCLFunctions::getIsLittleEndian(this->currentDeviceId) << Logger::endL;
+    logGPU << "Memory: " << OpenCLFunctions::getGlobalMemorySize(this->currentDeviceId) << Logger::endL;
   }
   // Create an OpenCL context
   logGPU << "About to create GPU context ..." << Logger::endL;
-  this->context = clCreateContext(NULL, 1, &this->currentDeviceId, NULL, NULL, &ret);
+  //The device may belong to any platform, not only the default one.
+  cl_platform_id platform = NULL;
+  clGetDeviceInfo(this->currentDeviceId, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+  cl_context_properties contextProperties[] = {CL_CONTEXT_PLATFORM, (cl_context_properties) platform, 0};
+  this->context = clCreateContext(
+    platform != NULL ? contextProperties : NULL, 1, &this->currentDeviceId, NULL, NULL, &ret
+  );
   logGPU << "Context created." << Logger::endL;
   if (ret != CL_SUCCESS) {
     logGPU << "Failed to create context." << Logger::endL;
@@ -240,7 +476,8 @@ bool GPU::initializePlatform() {
   this->commandQueue = clCreateCommandQueue(
     this->context,
     this->currentDeviceId,
-    CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+    //Profiling timestamps feed the statistics of the kernels, see GPUKernel::profile.
+    CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE,
     &ret
   );
   logGPU << "GPU queue created." << Logger::endL;
@@ -261,29 +498,48 @@ bool GPU::initializeKernelsNoBuild() {
     return true;
   if (!this->initializePlatform())
     return false;
+  this->kernelFolder = OSWrapper::canonicalPath("../opencl/cl");
+  if (this->kernelFolder == "") {
+    this->kernelFolder = OSWrapper::getCurrentPath();
+    logGPU << Logger::colorYellow << "Failed to find folder: " << "../opencl/cl" << Logger::colorNormal << Logger::endL;
+    logGPU << "This may be OK if current folder is already correct: " << Logger::colorBlue
+    << this->kernelFolder << Logger::colorNormal << Logger::endL;
+  }
+  this->cacheRoot = GPU::resolveCacheRoot();
+  if (this->cacheRoot == "") {
+    return false;
+  }
 
   if (!this->createKernelNoBuild(
     this->kernelSHA256,
     {"result"},
     {SharedMemory::typeVoidPointer},
-    {"offsets", "lengths", "message", "messageIndex"},
-    {SharedMemory::typeVoidPointer, SharedMemory::typeVoidPointer, SharedMemory::typeVoidPointer, SharedMemory::typeMessageIndex},
+    {"offsets", "lengths", "message", "messageCount"},
+    {SharedMemory::typeVoidPointer, SharedMemory::typeVoidPointer, SharedMemory::typeVoidPointer, SharedMemory::typeMessageCount},
     {},
     {}
   )) {
     return false;
   }
+  GPUKernel& sha256 = *this->theKernels[this->kernelSHA256];
+  sha256.setArgumentSize("result", 32);
+  sha256.setArgumentSize("offsets", 4);
+  sha256.setArgumentSize("lengths", 4);
+  //Messages of any length, a batch at most defaultBufferSize bytes in all.
+  sha256.setArgumentSize("message", GPUKernel::initialMessages * 64, GPU::defaultBufferSize);
   if (!this->createKernelNoBuild(
     this->kernelSHA256TwiceFetchBest,
     {"result"},
     {SharedMemory::typeVoidPointer},
-    {"message", "messageIndex"},
-    {SharedMemory::typeVoidPointer, SharedMemory::typeMessageIndex},
+    {"message", "messageCount"},
+    {SharedMemory::typeVoidPointer, SharedMemory::typeMessageCount},
     {},
     {}
   )) {
     return false;
   }
+  this->theKernels[this->kernelSHA256TwiceFetchBest]->setArgumentSize("result", 32);
+  this->theKernels[this->kernelSHA256TwiceFetchBest]->setArgumentSize("message", 32);
   if (!this->createKernelNoBuild(
     this->kernelInitializeMultiplicationContext,
     {"outputMultiplicationContext"},
@@ -297,6 +553,9 @@ bool GPU::initializeKernelsNoBuild() {
   )) {
     return false;
   }
+  this->theKernels[this->kernelInitializeMultiplicationContext]->setArgumentSize(
+    "outputMultiplicationContext", GPU::memoryMultiplicationContext, GPU::memoryMultiplicationContext
+  );
   if (!this->createKernelNoBuild(
     this->kernelInitializeGeneratorContext,
     {"outputGeneratorContext"},
@@ -310,6 +569,9 @@ bool GPU::initializeKernelsNoBuild() {
   )) {
     return false;
   }
+  this->theKernels[this->kernelInitializeGeneratorContext]->setArgumentSize(
+    "outputGeneratorContext", GPU::memoryGeneratorContext, GPU::memoryGeneratorContext
+  );
   //openCL function arguments:
   //__global unsigned char *output,
   //__global unsigned char *outputMemoryPoolSignature,
@@ -319,7 +581,7 @@ bool GPU::initializeKernelsNoBuild() {
   //__global const unsigned char* publicKeySizes,
   //__global const unsigned char* message,
   //__global const unsigned char* memoryPoolMultiplicationContext,
-  //unsigned int messageIndex
+  //unsigned int messageCount
 
   if (!this->createKernelNoBuild(
     this->kernelVerifySignature,
@@ -338,7 +600,7 @@ bool GPU::initializeKernelsNoBuild() {
       "publicKeySize",
       "message",
       "memoryPoolMultiplicationContext",
-      "messageIndex"
+      "messageCount"
     },
     {
       SharedMemory::typeVoidPointer,
@@ -347,7 +609,7 @@ bool GPU::initializeKernelsNoBuild() {
       SharedMemory::typeVoidPointer,
       SharedMemory::typeVoidPointer,
       SharedMemory::typeVoidPointerExternalOwnership,
-      SharedMemory::typeMessageIndex
+      SharedMemory::typeMessageCount
     },
     {
       "outputMultiplicationContext"
@@ -358,25 +620,40 @@ bool GPU::initializeKernelsNoBuild() {
   )) {
     return false;
   }
+  GPUKernel& verify = *this->theKernels[this->kernelVerifySignature];
+  verify.setArgumentSize("output", 1);
+  //Messages share the memory pools modulo MACRO_max_num_SIGNATURES_IN_PARALLEL.
+  verify.setArgumentSize("outputMemoryPoolSignature", MACRO_size_signature_buffer, MACRO_size_signature_buffer);
+  verify.setArgumentSize("inputSignature", MACRO_size_of_signature);
+  verify.setArgumentSize("signatureSize", 4);
+  verify.setArgumentSize("publicKey", MACRO_size_of_signature);
+  verify.setArgumentSize("publicKeySize", 4);
+  verify.setArgumentSize("message", 32);
+  //Each work item of a launch needs its own signature memory pool slot.
+  verify.messagesPerLaunchLimit = MACRO_max_num_SIGNATURES_IN_PARALLEL;
   if (!this->createKernelNoBuild(
     this->kernelGeneratePublicKey,
     {
       "outputPublicKey",
-      "outputPublicKeySize"
+      "outputPublicKeySize",
+      "outputInversionScratch"
     },
     {
       SharedMemory::typeVoidPointer,
       SharedMemory::typeVoidPointer,
+      SharedMemory::typeVoidPointer
     },
     {
       "inputSecretKey",
+      "inputCompressionFlags",
       "inputMemoryPoolGeneratorContext",
-      "inputMessageIndex"
+      "inputMessageCount"
     },
     {
+      SharedMemory::typeVoidPointer,
       SharedMemory::typeVoidPointer,
       SharedMemory::typeVoidPointerExternalOwnership,
-      SharedMemory::typeMessageIndex
+      SharedMemory::typeMessageCount
     },
     {
       "outputGeneratorContext"
@@ -387,6 +664,13 @@ bool GPU::initializeKernelsNoBuild() {
   )) {
     return false;
   }
+  GPUKernel& publicKeys = *this->theKernels[this->kernelGeneratePublicKey];
+  publicKeys.setArgumentSize("outputPublicKey", MACRO_size_of_signature);
+  publicKeys.setArgumentSize("outputPublicKeySize", 4);
+  publicKeys.setArgumentSize("outputInversionScratch", 2 * sizeof(secp256k1_fe));
+  publicKeys.setArgumentSize("inputSecretKey", 32);
+  publicKeys.setArgumentSize("inputCompressionFlags", 1);
+  this->theKernels[this->kernelGeneratePublicKey]->messagesPerWorkItem = MACRO_public_keys_per_work_item;
   if (!this->createKernelNoBuild(
     this->kernelSign,
     {
@@ -403,13 +687,13 @@ bool GPU::initializeKernelsNoBuild() {
       "inputSecretKey",
       "inputMessage",
       "inputMemoryPoolGeneratorContext",
-      "inputMessageIndex"
+      "inputMessageCount"
     },
     {
       SharedMemory::typeVoidPointer,
       SharedMemory::typeVoidPointer,
       SharedMemory::typeVoidPointerExternalOwnership,
-      SharedMemory::typeMessageIndex,
+      SharedMemory::typeMessageCount,
     },
     {
       "outputGeneratorContext"
@@ -420,17 +704,27 @@ bool GPU::initializeKernelsNoBuild() {
   )) {
     return false;
   }
+  GPUKernel& sign = *this->theKernels[this->kernelSign];
+  sign.setArgumentSize("outputSignature", MACRO_size_of_signature);
+  sign.setArgumentSize("outputSize", 4);
+  sign.setArgumentSize("outputInputNonce", 32);
+  sign.setArgumentSize("inputSecretKey", 32);
+  sign.setArgumentSize("inputMessage", 32);
   if (!this->createKernelNoBuild(
     this->kernelTestBuffer,
     {"buffer"},
     {SharedMemory::typeVoidPointer},
-    {"offsets", "messageIndex"},
-    {SharedMemory::typeVoidPointer, SharedMemory::typeMessageIndex},
+    {"offsets", "messageCount"},
+    {SharedMemory::typeVoidPointer, SharedMemory::typeMessageCount},
     {},
     {}
   )) {
     return false;
   }
+  this->theKernels[this->kernelTestBuffer]->setArgumentSize(
+    "buffer", GPUKernel::initialMessages * 64, GPU::defaultBufferSize
+  );
+  this->theKernels[this->kernelTestBuffer]->setArgumentSize("offsets", 4);
   if (!this->createKernelNoBuild(
     this->kernelTestSuite1BasicOperations,
     {"outputMemoryPool"},
@@ -445,6 +739,8 @@ bool GPU::initializeKernelsNoBuild() {
     return false;
   }
   this->flagInitializedKernelsNoBuild = true;
+  //Without a tuning file the kernels keep their defaults.
+  this->loadTunings();
   return true;
 }
 
@@ -458,15 +754,279 @@ bool GPU::initializeKernelsFull() {
   if (!this->initializeKernelsNoBuild()) {
     return false;
   }
+  std::vector<std::string> kernelNames;
   for (
     std::unordered_map<std::string, std::shared_ptr<GPUKernel> >::iterator kernelIterator = this->theKernels.begin();
     kernelIterator != this->theKernels.end();
     ++kernelIterator
   ) {
-    if (!kernelIterator->second.get()->build()) {
+    kernelNames.push_back(kernelIterator->first);
+  }
+  if (!this->buildKernels(kernelNames)) {
+    return false;
+  }
+  this->flagInitializedKernelsFull = true;
+  return true;
+}
+
+/* Builds the given kernels, and the kernels owning their external buffers, each on its own thread.
+ * The compilations are independent of one another;
+ * binding the arguments of a kernel waits for the kernels owning its external buffers.
+ * So the whole takes about as long as the slowest compilation.
+ */
+bool GPU::buildKernels(const std::vector<std::string>& kernelNames) {
+  if (!this->initializeKernelsNoBuild()) {
+    return false;
+  }
+  auto timeStart = std::chrono::system_clock::now();
+  std::unordered_map<std::string, std::shared_future<bool> > builds;
+  for (unsigned i = 0; i < kernelNames.size(); i ++) {
+    this->scheduleBuild(kernelNames[i], builds);
+  }
+  bool result = true;
+  for (
+    std::unordered_map<std::string, std::shared_future<bool> >::iterator current = builds.begin();
+    current != builds.end();
+    current ++
+  ) {
+    if (!current->second.get()) {
+      logGPU << "Failed to build kernel " << current->first << ". " << Logger::endL;
+      result = false;
+    }
+  }
+  std::chrono::duration<double> elapsedSeconds = std::chrono::system_clock::now() - timeStart;
+  logGPU << builds.size() << " kernel(s) built in " << elapsedSeconds.count() << " second(s). " << Logger::endL;
+  return result;
+}
+
+//Schedules the builds of the kernels owning the external buffers of kernelName first: they are its dependencies.
+//An unknown kernel gets a build that has already failed.
+void GPU::scheduleBuild(
+  const std::string& kernelName, std::unordered_map<std::string, std::shared_future<bool> >& builds
+) {
+  if (builds.find(kernelName) != builds.end()) {
+    return;
+  }
+  std::unordered_map<std::string, std::shared_ptr<GPUKernel> >::iterator found = this->theKernels.find(kernelName);
+  if (found == this->theKernels.end()) {
+    logGPU << "Kernel " << kernelName << " does not exist. " << Logger::endL;
+    std::promise<bool> unknownKernel;
+    unknownKernel.set_value(false);
+    builds[kernelName] = unknownKernel.get_future().share();
+    return;
+  }
+  GPUKernel* theKernel = found->second.get();
+  std::vector<std::shared_future<bool> > dependencies;
+  for (unsigned i = 0; i < theKernel->desiredExternalBufferKernelOwners.size(); i ++) {
+    const std::string& otherKernelName = theKernel->desiredExternalBufferKernelOwners[i];
+    this->scheduleBuild(otherKernelName, builds);
+    dependencies.push_back(builds[otherKernelName]);
+  }
+  builds[kernelName] = std::async(std::launch::async, [theKernel, dependencies]() {
+    if (!theKernel->compile()) {
       return false;
     }
+    for (unsigned i = 0; i < dependencies.size(); i ++) {
+      if (!dependencies[i].get()) {
+        return false;
+      }
+    }
+    return theKernel->build();
+  }).share();
+}
+
+std::string GPU::cacheRootConfigured = "";
+
+std::string GPU::resolveCacheRoot() {
+  std::string result = GPU::cacheRootConfigured;
+  if (result == "") {
+    const char* cacheHome = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (cacheHome != nullptr && cacheHome[0] == '/') {
+      result = std::string(cacheHome) + "/kanban-gpu";
+    } else if (home != nullptr && home[0] == '/') {
+      result = std::string(home) + "/.cache/kanban-gpu";
+    } else {
+      logGPU << Logger::colorRed << "No cache folder: set HOME or XDG_CACHE_HOME, or pass cache=<folder>. "
+      << Logger::colorNormal << Logger::endL;
+      return "";
+    }
+  }
+  if (!OSWrapper::createDirectories(result)) {
+    logGPU << Logger::colorRed << "Failed to create the cache folder " << result << ". "
+    << Logger::colorNormal << Logger::endL;
+    return "";
+  }
+  return OSWrapper::canonicalPath(result);
+}
+
+std::string GPU::tuningFolder = "tuning";
+
+//Keyed like the program binaries, by device and driver: a driver update may change the best configuration.
+std::string GPU::tuningFileName() {
+  std::string keyMaterial = "device: " + OpenCLFunctions::getDeviceName(this->currentDeviceId) + "\n";
+  keyMaterial += "driver: " + OpenCLFunctions::getDriverVersion(this->currentDeviceId) + "\n";
+  if (this->flagSubDevice) {
+    //Sub-devices of different sizes tune differently.
+    std::stringstream computeUnits;
+    computeUnits << "compute units: " << OpenCLFunctions::getMaximumComputeUnits(this->currentDeviceId) << "\n";
+    keyMaterial += computeUnits.str();
+  }
+  return this->cacheRoot + "/" + GPU::tuningFolder + "/" + Miscellaneous::hashFNV1a64Hex(keyMaterial) + ".txt";
+}
+
+/* Tuning file format: the device and driver lines the file name is keyed by, then one line per kernel:
+ * kernelName localSize messagesPerLaunch batchSize
+ */
+bool GPU::loadTunings() {
+  std::string fileName = this->tuningFileName();
+  std::ifstream theFile(fileName);
+  if (!theFile.is_open()) {
+    logGPU << "No tuning file " << fileName << ": kernels run with their default configuration. " << Logger::endL;
+    return false;
+  }
+  std::string deviceLine, driverLine;
+  std::getline(theFile, deviceLine);
+  std::getline(theFile, driverLine);
+  if (
+    deviceLine != "device: " + OpenCLFunctions::getDeviceName(this->currentDeviceId) ||
+    driverLine != "driver: " + OpenCLFunctions::getDriverVersion(this->currentDeviceId)
+  ) {
+    logGPU << Logger::colorYellow << "Tuning file " << fileName << " belongs to another device or driver: ignored. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  std::string kernelName;
+  KernelTuning current;
+  while (theFile >> kernelName >> current.localSize >> current.messagesPerLaunch >> current.batchSize) {
+    if (this->theKernels.find(kernelName) == this->theKernels.end()) {
+      continue;
+    }
+    GPUKernel& kernel = *this->theKernels[kernelName];
+    if (current.localSize == 0 || current.messagesPerLaunch % kernel.messagesPerWorkItem != 0) {
+      logGPU << "Ignoring invalid tuning of kernel " << kernelName << " in " << fileName << ". " << Logger::endL;
+      continue;
+    }
+    kernel.applyTuning(current);
+    this->tunings[kernelName] = current;
+    logGPU << "Kernel " << kernelName << ": local size " << current.localSize
+    << ", messages per launch " << current.messagesPerLaunch << ", batch size " << current.batchSize << ". " << Logger::endL;
+  }
+  return true;
+}
+
+bool GPU::storeTunings() {
+  std::stringstream out;
+  out << "device: " << OpenCLFunctions::getDeviceName(this->currentDeviceId) << "\n";
+  out << "driver: " << OpenCLFunctions::getDriverVersion(this->currentDeviceId) << "\n";
+  for (
+    std::unordered_map<std::string, KernelTuning>::iterator current = this->tunings.begin();
+    current != this->tunings.end();
+    current ++
+  ) {
+    out << current->first << " " << current->second.localSize << " "
+    << current->second.messagesPerLaunch << " " << current->second.batchSize << "\n";
+  }
+  std::string contents = out.str();
+  std::string fileName = this->tuningFileName();
+  if (
+    !OSWrapper::createDirectories(this->cacheRoot + "/" + GPU::tuningFolder) ||
+    !OSWrapper::writeFileAtomically(fileName, (const unsigned char*) contents.data(), contents.size())
+  ) {
+    logGPU << "Failed to write tuning file " << fileName << ". " << Logger::endL;
+    return false;
+  }
+  logGPU << "Tunings written to " << fileName << ". " << Logger::endL;
+  return true;
+}
+
+/* Every batch size is timed with every work group size up to the kernel's maximum
+ * and with launches of a few sizes, the fastest of several runs counting.
+ * Larger batches always compute more messages per second, but each message waits longer,
+ * so the batch size chosen is the smallest one within 10% of the best throughput.
+ */
+bool GPU::autotune(
+  const std::string& kernelName,
+  const std::function<bool(unsigned int numberOfMessages, double& outputSeconds)>& runBatch
+) {
+  std::shared_ptr<GPUKernel> kernel = this->getKernel(kernelName);
+  if (!kernel->build()) {
+    return false;
+  }
+  const unsigned int batchSizes[] = {64, 256, 1024, 4096};
+  const unsigned int launchSizes[] = {0, 64, 256, 1024}; //<- 0: the whole batch in one launch
+  const unsigned int repetitions = 3; //<- after one warm-up run
+  size_t maximumLocalSize = std::min((size_t) 1024, kernel->getMaximumWorkGroupSize());
+  KernelTuning original = kernel->tuning;
+  std::vector<KernelTuning> bestPerBatchSize;
+  std::vector<double> throughputPerBatchSize;
+  for (unsigned i = 0; i < sizeof(batchSizes) / sizeof(batchSizes[0]); i ++) {
+    unsigned int batchSize = batchSizes[i];
+    if (batchSize > kernel->maximumMessages) {
+      break;
+    }
+    unsigned int workItems = (batchSize + kernel->messagesPerWorkItem - 1) / kernel->messagesPerWorkItem;
+    KernelTuning best;
+    double bestThroughput = 0;
+    for (size_t localSize = 1; localSize <= maximumLocalSize && (localSize == 1 || localSize <= workItems); localSize *= 2) {
+      for (unsigned j = 0; j < sizeof(launchSizes) / sizeof(launchSizes[0]); j ++) {
+        KernelTuning candidate;
+        candidate.localSize = localSize;
+        candidate.messagesPerLaunch = launchSizes[j];
+        candidate.batchSize = batchSize;
+        if (candidate.messagesPerLaunch != 0 && (
+          candidate.messagesPerLaunch >= batchSize ||
+          candidate.messagesPerLaunch % kernel->messagesPerWorkItem != 0 ||
+          (kernel->messagesPerLaunchLimit != 0 && candidate.messagesPerLaunch >= kernel->messagesPerLaunchLimit)
+        )) {
+          continue;
+        }
+        kernel->applyTuning(candidate);
+        double fastest = 0;
+        bool success = true;
+        for (unsigned run = 0; run <= repetitions && success; run ++) {
+          double seconds = 0;
+          success = runBatch(batchSize, seconds);
+          if (run > 0 && (run == 1 || seconds < fastest)) {
+            fastest = seconds;
+          }
+        }
+        if (!success) {
+          //For example, the work group does not fit the device's resources.
+          logGPU << Logger::colorYellow << kernelName << ": local size " << localSize
+          << ", messages per launch " << candidate.messagesPerLaunch << ", batch size " << batchSize
+          << ": failed, skipped. " << Logger::colorNormal << Logger::endL;
+          continue;
+        }
+        double throughput = batchSize / std::max(fastest, 1e-9);
+        logGPU << kernelName << ": local size " << localSize << ", messages per launch " << candidate.messagesPerLaunch
+        << ", batch size " << batchSize << ": " << (long long) throughput << " messages per second. " << Logger::endL;
+        if (throughput > bestThroughput) {
+          bestThroughput = throughput;
+          best = candidate;
+        }
+      }
+    }
+    if (bestThroughput > 0) {
+      bestPerBatchSize.push_back(best);
+      throughputPerBatchSize.push_back(bestThroughput);
+    }
   }
+  if (bestPerBatchSize.empty()) {
+    logGPU << "Autotuning of kernel " << kernelName << " failed: no configuration ran. " << Logger::endL;
+    kernel->applyTuning(original);
+    return false;
+  }
+  double bestThroughput = *std::max_element(throughputPerBatchSize.begin(), throughputPerBatchSize.end());
+  unsigned int chosen = 0;
+  while (throughputPerBatchSize[chosen] < 0.9 * bestThroughput) {
+    chosen ++;
+  }
+  kernel->applyTuning(bestPerBatchSize[chosen]);
+  this->tunings[kernelName] = bestPerBatchSize[chosen];
+  logGPU << Logger::colorGreen << kernelName << " tuned: local size " << kernel->tuning.localSize
+  << ", messages per launch " << kernel->tuning.messagesPerLaunch << ", batch size " << kernel->tuning.batchSize
+  << ", " << (long long) throughputPerBatchSize[chosen] << " messages per second. " << Logger::colorNormal << Logger::endL;
   return true;
 }
 
@@ -532,6 +1092,10 @@ GPU::~GPU() {
   }
   //logGPU << "GPU destruction: released context. " << Logger::endL;
   this->context = NULL;
+  if (this->flagSubDevice && this->desiredDeviceId != NULL) {
+    clReleaseDevice(this->desiredDeviceId);
+  }
+  this->desiredDeviceId = NULL;
   delete [] this->bufferMultiplicationContext;
   this->bufferMultiplicationContext = 0;
   delete [] this->bufferTestSuite1BasicOperations;
@@ -548,13 +1112,74 @@ std::string GPU::kernelSHA256TwiceFetchBest = "sha256_twice_GPU_fetch_best";
 std::string GPU::kernelTestBuffer = "testBuffer";
 std::string GPU::kernelInitializeMultiplicationContext = "secp256k1_opencl_compute_multiplication_context";
 std::string GPU::kernelInitializeGeneratorContext = "secp256k1_opencl_compute_generator_context";
+std::string GPU::kernelRelocateMultiplicationContext = "secp256k1_opencl_relocate_multiplication_context";
+std::string GPU::kernelRelocateGeneratorContext = "secp256k1_opencl_relocate_generator_context";
 std::string GPU::kernelVerifySignature = "secp256k1_opencl_verify_signature";
 std::string GPU::kernelTestSuite1BasicOperations = "test_suite_1_basic_operations";
 std::string GPU::kernelSign = "secp256k1_opencl_sign";
 std::string GPU::kernelGeneratePublicKey = "secp256k1_opencl_generate_public_key";
 
-const int maxProgramBuildBufferSize = 10000000;
-char programBuildBuffer[maxProgramBuildBufferSize];
+void GPUKernel::setArgumentSize(const std::string& argumentName, unsigned int bytesPerMessage) {
+  ArgumentSize& size = this->desiredArgumentSizes[argumentName];
+  size.bytesPerMessage = bytesPerMessage;
+}
+
+void GPUKernel::setArgumentSize(const std::string& argumentName, size_t initialSize, size_t maximumSize) {
+  ArgumentSize& size = this->desiredArgumentSizes[argumentName];
+  size.bytesPerMessage = 0;
+  size.initialSize = initialSize;
+  size.maximumSize = maximumSize;
+}
+
+/* Makes the current slot's buffer of an argument hold at least size bytes.
+ * A buffer too small is replaced by one twice as large, or larger if needed, up to the argument's maximumSize.
+ * The contents are not carried over: call before writing the argument or launching the kernel.
+ * Buffers still used by enqueued commands are freed once those complete.
+ */
+bool GPUKernel::reserveArgument(unsigned argumentNumber, size_t size) {
+  SharedMemory& argument = this->getArgument(argumentNumber);
+  if (argument.typE != SharedMemory::typeVoidPointer) {
+    return true;
+  }
+  size_t& currentSize = argument.ringSizes[this->currentSlot];
+  if (size <= currentSize) {
+    return true;
+  }
+  if (size > argument.maximumSize) {
+    logGPU << "Argument " << argument.name << " of kernel " << this->name << " needs " << size
+    << " bytes, more than its maximum of " << argument.maximumSize << ". " << Logger::endL;
+    return false;
+  }
+  size_t newSize = std::min(std::max(size, 2 * currentSize), argument.maximumSize);
+  cl_int ret = CL_SUCCESS;
+  cl_mem grown = clCreateBuffer(this->owner->context, argument.memoryFlags, newSize, NULL, &ret);
+  if (ret != CL_SUCCESS || grown == NULL) {
+    logGPU << "Failed to grow buffer " << argument.name << " of kernel " << this->name << " to "
+    << newSize << " bytes. Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  clReleaseMemObject(argument.ring[this->currentSlot]);
+  argument.ring[this->currentSlot] = grown;
+  argument.theMemory = grown;
+  currentSize = newSize;
+  ret = clSetKernelArg(this->kernel, argumentNumber, sizeof(cl_mem), (void*) &argument.theMemory);
+  if (ret != CL_SUCCESS) {
+    logGPU << "Failed to rebind grown argument " << argument.name << " of kernel " << this->name
+    << ". Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  return true;
+}
+
+//Grows the outputs sized per message to hold numberOfMessages messages.
+bool GPUKernel::reserveOutputs(unsigned int numberOfMessages) {
+  for (unsigned i = 0; i < this->outputs.size(); i ++) {
+    if (!this->reserveArgument(i, (size_t) this->outputs[i]->bytesPerMessage * numberOfMessages)) {
+      return false;
+    }
+  }
+  return true;
+}
 
 bool GPUKernel::hasArgumentName(const std::string& desiredArgumentName) {
   for (int k = 0; k < 2; k ++) {
@@ -607,7 +1232,7 @@ bool GPUKernel::constructFromFileNameNoBuild(
 ) {
   this->owner = &ownerGPU;
   this->name = fileNameNoExtension;
-  std::string fileName = "../opencl/cl/" + fileNameNoExtension + ".cl";
+  std::string fileName = ownerGPU.kernelFolder + "/" + fileNameNoExtension + ".cl";
 
   this->desiredOutputNames = outputNames;
   this->desiredOutputTypes = outputTypes;
@@ -636,18 +1261,49 @@ bool GPUKernel::constructFromFileNameNoBuild(
     }
   }
 
+#ifdef MACRO_USE_EMBEDDED_KERNEL_SOURCES
+  if (!this->loadEmbeddedSource()) {
+    return false;
+  }
+#else
   std::ifstream theFile(fileName);
   if (!theFile.is_open()) {
-    logGPU << "Failed to open " << fileName << "\n";
+    logGPU << "Failed to open " << fileName << Logger::endL;
     return false;
   }
-  std::string source_str((std::istreambuf_iterator<char>(theFile)), std::istreambuf_iterator<char>());
+  this->source = std::string((std::istreambuf_iterator<char>(theFile)), std::istreambuf_iterator<char>());
   if (this->owner->flagVerbose) {
-    logGPU << "Program file name: " << fileName << "\n";
+    logGPU << "Program file name: " << fileName << Logger::endL;
   }
   logGPU << "Source file read: " << fileName << Logger::endL;
-  size_t sourceSize = source_str.size();
-  const char* sourceCString = source_str.c_str();
+#endif
+  //std::string programOptions = "-cl-opt-disable";
+
+  //std::string programOptions = "-cl-std=CL2.0";
+  return this->createProgramFromSource();
+}
+
+#ifdef MACRO_USE_EMBEDDED_KERNEL_SOURCES
+bool GPUKernel::loadEmbeddedSource() {
+  for (unsigned i = 0; i < numberOfEmbeddedKernelSources; i ++) {
+    if (this->name == embeddedKernelSources[i].name) {
+      this->source.assign(embeddedKernelSources[i].source, embeddedKernelSources[i].size);
+      logGPU << "Embedded source loaded: " << this->name << Logger::endL;
+      return true;
+    }
+  }
+  logGPU << "Kernel " << this->name << " has no embedded source: is cl/" << this->name << ".cl missing? " << Logger::endL;
+  return false;
+}
+#endif
+
+bool GPUKernel::createProgramFromSource() {
+  if (this->program != NULL) {
+    clReleaseProgram(this->program);
+    this->program = NULL;
+  }
+  size_t sourceSize = this->source.size();
+  const char* sourceCString = this->source.c_str();
   cl_int ret;
   this->program = clCreateProgramWithSource(
     this->owner->context, 1,
@@ -656,11 +1312,129 @@ bool GPUKernel::constructFromFileNameNoBuild(
   );
   if (ret != CL_SUCCESS) {
     logGPU << "Failed to create program from source. " << Logger::endL;
+    this->program = NULL;
     return false;
   }
-  //std::string programOptions = "-cl-opt-disable";
+  return true;
+}
 
-  //std::string programOptions = "-cl-std=CL2.0";
+std::string GPUKernel::programBinaryCacheFolder = "binary_cache";
+const unsigned int GPUKernel::initialMessages;
+const unsigned int GPUKernel::defaultMaximumMessages;
+
+//Appends contents to output with the files of its #include "..." lines
+//spliced in, recursively, each file once. Include files are looked up in folder.
+//The OpenCL compiler does the actual preprocessing:
+//this only needs to see every byte the compiler will read.
+void GPUKernel::appendSourceWithIncludes(
+  const std::string& folder,
+  const std::string& fileName,
+  const std::string& contents,
+  std::vector<std::string>& visited,
+  std::string& output
+) {
+  visited.push_back(fileName);
+  output += "\n//file: " + fileName + "\n";
+  std::stringstream lines(contents);
+  std::string line;
+  while (std::getline(lines, line)) {
+    output += line;
+    output += "\n";
+    size_t start = line.find_first_not_of(" \t");
+    if (start == std::string::npos || line.compare(start, 8, "#include") != 0) {
+      continue;
+    }
+    size_t openQuote = line.find('"', start + 8);
+    size_t closeQuote = openQuote == std::string::npos ? std::string::npos : line.find('"', openQuote + 1);
+    if (closeQuote == std::string::npos) {
+      continue;
+    }
+    std::string includedName = line.substr(openQuote + 1, closeQuote - openQuote - 1);
+    if (std::find(visited.begin(), visited.end(), includedName) != visited.end()) {
+      continue;
+    }
+    std::ifstream includedFile(folder + "/" + includedName);
+    if (!includedFile.is_open()) {
+      //Let the compiler report it; the key still changes if the file shows up later.
+      visited.push_back(includedName);
+      continue;
+    }
+    std::string includedContents((std::istreambuf_iterator<char>(includedFile)), std::istreambuf_iterator<char>());
+    GPUKernel::appendSourceWithIncludes(folder, includedName, includedContents, visited, output);
+  }
+}
+
+std::string GPUKernel::computeProgramBinaryKey(const std::string& buildOptions) {
+  std::string keyMaterial;
+  std::vector<std::string> visited;
+  GPUKernel::appendSourceWithIncludes(this->owner->kernelFolder, this->name + ".cl", this->source, visited, keyMaterial);
+  keyMaterial += "\n//options: " + buildOptions;
+  keyMaterial += "\n//device: " + OpenCLFunctions::getDeviceName(this->owner->currentDeviceId);
+  keyMaterial += "\n//driver: " + OpenCLFunctions::getDriverVersion(this->owner->currentDeviceId);
+  std::stringstream out;
+  out << Miscellaneous::hashFNV1a64Hex(keyMaterial) << "_" << keyMaterial.size();
+  return out.str();
+}
+
+//Returns false on a cache miss or an unusable cached binary; the source program is then left in place.
+bool GPUKernel::createProgramFromCachedBinary(const std::string& fileName) {
+  std::ifstream theFile(fileName, std::ios::binary);
+  if (!theFile.is_open()) {
+    return false;
+  }
+  std::vector<unsigned char> binary(
+    (std::istreambuf_iterator<char>(theFile)), std::istreambuf_iterator<char>()
+  );
+  if (binary.empty()) {
+    return false;
+  }
+  size_t binarySize = binary.size();
+  const unsigned char* binaryPointer = binary.data();
+  cl_int binaryStatus = CL_SUCCESS;
+  cl_int ret = CL_SUCCESS;
+  cl_program fromBinary = clCreateProgramWithBinary(
+    this->owner->context, 1, &this->owner->currentDeviceId, &binarySize, &binaryPointer, &binaryStatus, &ret
+  );
+  if (ret != CL_SUCCESS || binaryStatus != CL_SUCCESS || fromBinary == NULL) {
+    logGPU << Logger::colorYellow << "Cached binary " << fileName << " rejected with return code: " << ret
+    << ", binary status: " << binaryStatus << ". Building from source. " << Logger::colorNormal << Logger::endL;
+    if (fromBinary != NULL) {
+      clReleaseProgram(fromBinary);
+    }
+    return false;
+  }
+  if (this->program != NULL) {
+    clReleaseProgram(this->program);
+  }
+  this->program = fromBinary;
+  return true;
+}
+
+bool GPUKernel::storeProgramBinary(const std::string& fileName) {
+  size_t binarySize = 0;
+  cl_int ret = clGetProgramInfo(this->program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL);
+  if (ret != CL_SUCCESS || binarySize == 0) {
+    logGPU << "Program " << this->name << " has no binary to cache. Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  std::vector<unsigned char> binary(binarySize);
+  unsigned char* binaryPointer = binary.data();
+  ret = clGetProgramInfo(this->program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binaryPointer, NULL);
+  if (ret != CL_SUCCESS) {
+    logGPU << "Failed to fetch the binary of program " << this->name << ". Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  std::string cacheFolder = this->owner->cacheRoot + "/" + GPUKernel::programBinaryCacheFolder;
+  if (!OSWrapper::createDirectories(cacheFolder)) {
+    logGPU << "Failed to create the program binary cache folder " << cacheFolder << ". " << Logger::endL;
+    return false;
+  }
+  //A concurrent start never reads a partial binary.
+  if (!OSWrapper::writeFileAtomically(fileName, binary.data(), binary.size())) {
+    logGPU << "Failed to write program binary " << fileName << ". " << Logger::endL;
+    return false;
+  }
+  logGPU << "Program binary cached: " << fileName << Logger::endL;
   return true;
 }
 
@@ -700,25 +1474,24 @@ std::shared_ptr<SharedMemory>& GPUKernel::getInput(int inputIndex) {
   return theInputs[inputIndex];
 }
 
-bool GPUKernel::build() {
-  if (this->flagIsBuilt){
+bool GPUKernel::compile() {
+  if (this->flagIsCompiled) {
     return true;
   }
-  StateMaintainerFolderLocation preserveCurrentFolder(logGPU);
   logGPU << this->owner->getId() << ": building program: " << this->name << "..." << Logger::endL;
-  try {
-    OSWrapper::setCurrentPath("../opencl/cl");
-  } catch (...) {
-    logGPU << Logger::colorYellow << "Failed to set folder: " << "../opencl/cl" << Logger::colorNormal << Logger::endL;
-    logGPU << "This may be OK if current folder is already correct: " << Logger::colorBlue
-    << OSWrapper::getCurrentPath() << Logger::colorNormal << Logger::endL;
-  }
   auto timeStart = std::chrono::system_clock::now();
-  std::string currentFolder = OSWrapper::getCurrentPath();
-  logGPU << Logger::colorYellow << "Build base folder: " << currentFolder << Logger::colorNormal << Logger::endL;
+  const std::string& kernelFolder = this->owner->kernelFolder;
+  logGPU << Logger::colorYellow << "Build base folder: " << kernelFolder << Logger::colorNormal << Logger::endL;
   cl_int ret;
   std::stringstream programOptions;
-  programOptions << "-I " << currentFolder;
+#ifndef MACRO_USE_EMBEDDED_KERNEL_SOURCES
+  //Embedded sources have their includes expanded already.
+  programOptions << "-I " << kernelFolder;
+#endif
+  std::string binaryFileName = this->owner->cacheRoot + "/" + GPUKernel::programBinaryCacheFolder + "/" + this->name + "_"
+  + this->computeProgramBinaryKey(programOptions.str()) + ".bin";
+  this->programBinaryFileName = binaryFileName;
+  bool fromCache = this->createProgramFromCachedBinary(binaryFileName);
   ret = clBuildProgram(
     this->program,
     1,
@@ -728,27 +1501,50 @@ bool GPUKernel::build() {
     NULL,
     NULL
   );
+  if (ret != CL_SUCCESS && fromCache) {
+    logGPU << Logger::colorYellow << "Cached binary " << binaryFileName << " failed to build. Return code: "
+    << ret << ". Building from source. " << Logger::colorNormal << Logger::endL;
+    fromCache = false;
+    if (!this->createProgramFromSource()) {
+      return false;
+    }
+    ret = clBuildProgram(
+      this->program, 1, &this->owner->currentDeviceId, programOptions.str().c_str(), NULL, NULL
+    );
+  }
   if (ret != CL_SUCCESS) {
     logGPU << "Failed to build program: " << this->name << ". Return code: " << ret << Logger::endL;
-    size_t logSize;
-    ret = clGetProgramBuildInfo(
-      this->program, this->owner->currentDeviceId,
-      CL_PROGRAM_BUILD_LOG, maxProgramBuildBufferSize,
-      &programBuildBuffer, &logSize
-    );
+    size_t logSize = 0;
+    ret = clGetProgramBuildInfo(this->program, this->owner->currentDeviceId, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+    std::vector<char> programBuildBuffer(logSize + 1, 0);
+    if (ret == CL_SUCCESS) {
+      ret = clGetProgramBuildInfo(
+        this->program, this->owner->currentDeviceId,
+        CL_PROGRAM_BUILD_LOG, programBuildBuffer.size(),
+        programBuildBuffer.data(), &logSize
+      );
+    }
     if (ret != CL_SUCCESS) {
       logGPU << "Failed to fetch the build info for program: " << this->name << ". Return code: " << ret << Logger::endL;
       return false;
     }
     if (logSize > 0)
       logSize --;
-    std::string theLog(programBuildBuffer, logSize);
-    logGPU << theLog;
+    std::string theLog(programBuildBuffer.data(), logSize);
+    logGPU << theLog << Logger::endL;
     return false;
   }
   auto timeAfterBuild = std::chrono::system_clock::now();
   std::chrono::duration<double> elapsed_seconds = timeAfterBuild - timeStart;
-  logGPU << "Program built in " << elapsed_seconds.count() << " second(s)."  << Logger::endL;
+  logGPU << "Program built in " << elapsed_seconds.count() << " second(s)";
+  if (fromCache) {
+    logGPU << " from cached binary " << binaryFileName;
+  }
+  logGPU << "."  << Logger::endL;
+  if (!fromCache) {
+    //A failure to cache costs the next start a source build, nothing more.
+    this->storeProgramBinary(binaryFileName);
+  }
   logGPU << "Creating openCL kernel..." << Logger::endL;
   this->kernel = clCreateKernel(this->program, this->name.c_str(), &ret);
   if (ret != CL_SUCCESS) {
@@ -757,8 +1553,32 @@ bool GPUKernel::build() {
            << this->name << "\e[39m." << Logger::endL;
     return false;
   }
-  logGPU << "Kernel: " << this->name << " created, allocating buffers..." << Logger::endL;
-  this->buffersExternallyOwned.clear();
+  this->flagIsCompiled = true;
+  //A tuning of another kernel build, or the default, may not fit this one's register usage.
+  size_t maximumWorkGroupSize = this->getMaximumWorkGroupSize();
+  if (maximumWorkGroupSize != 0 && this->local_item_size[0] > maximumWorkGroupSize) {
+    KernelTuning clamped = this->tuning;
+    clamped.localSize = 1;
+    while (clamped.localSize * 2 <= maximumWorkGroupSize) {
+      clamped.localSize *= 2;
+    }
+    logGPU << Logger::colorYellow << "Kernel " << this->name << " runs work groups of at most " << maximumWorkGroupSize
+    << " work items: local size " << this->local_item_size[0] << " lowered to " << clamped.localSize << ". "
+    << Logger::colorNormal << Logger::endL;
+    this->applyTuning(clamped);
+  }
+  return true;
+}
+
+bool GPUKernel::build() {
+  if (this->flagIsBuilt){
+    return true;
+  }
+  if (!this->compile()) {
+    return false;
+  }
+  logGPU << "Kernel: " << this->name << " created, allocating buffers..." << Logger::endL;
+  this->buffersExternallyOwned.clear();
   for (unsigned i = 0; i < this->desiredExternalBufferNames.size(); i ++) {
     const std::string& otherKernelName = this->desiredExternalBufferKernelOwners[i];
     GPUKernel& other = *this->owner->theKernels[otherKernelName].get();
@@ -804,7 +1624,11 @@ bool GPUKernel::constructArguments(
     logGPU << "GPU kernel arguments are neither input nor output" << Logger::endL;
     return false;
   }
-  //bufferFlag |= CL_MEM_ALLOC_HOST_PTR;
+  if (this->owner->flagZeroCopy) {
+    //The device then reads and writes host memory directly, and read-backs map it in place.
+    bufferFlag |= CL_MEM_ALLOC_HOST_PTR;
+  }
+  this->pendingUnmaps.resize(this->bufferRingDepth);
   if (theArgs.size() != 0) {
     logGPU << "Fatal error: arguments not empty. " << Logger::endL;
     return false;
@@ -817,18 +1641,64 @@ bool GPUKernel::constructArguments(
     if (current->typE != current->typeVoidPointer) {
       continue;
     }
-    int PleaseRefactor;
-    int bufferSize = GPU::defaultBufferSize;
-    if (current->name == "outputMemoryPoolSignature") {
-      bufferSize = MACRO_size_signature_buffer;
+    ArgumentSize size;
+    if (this->desiredArgumentSizes.find(current->name) != this->desiredArgumentSizes.end()) {
+      size = this->desiredArgumentSizes[current->name];
     }
-    current->theMemory = clCreateBuffer(this->owner->context, bufferFlag, bufferSize, NULL, &ret);
-    current->buffer.resize(GPU::defaultBufferSize);
-    if (ret != CL_SUCCESS || current->theMemory == NULL) {
-      logGPU << "Failed to create buffer \e[31m" << current->name << "\e[39m. Return code: " << ret << Logger::endL;
-      return false;
+    size_t bufferSize = size.initialSize;
+    current->bytesPerMessage = size.bytesPerMessage;
+    current->maximumSize = size.maximumSize;
+    if (size.bytesPerMessage > 0) {
+      bufferSize = (size_t) size.bytesPerMessage * std::min(GPUKernel::initialMessages, this->maximumMessages);
+      current->maximumSize = (size_t) size.bytesPerMessage * this->maximumMessages;
+    }
+    current->memoryFlags = bufferFlag;
+    for (unsigned j = 0; j < this->bufferRingDepth; j ++) {
+      cl_mem slotMemory = clCreateBuffer(this->owner->context, bufferFlag, bufferSize, NULL, &ret);
+      if (ret != CL_SUCCESS || slotMemory == NULL) {
+        logGPU << "Failed to create buffer \e[31m" << current->name << "\e[39m. Return code: " << ret << Logger::endL;
+        return false;
+      }
+      current->ring.push_back(slotMemory);
+      current->ringSizes.push_back(bufferSize);
+    }
+    current->hostRing.resize(this->bufferRingDepth);
+    current->mappedRing.resize(this->bufferRingDepth, NULL);
+    current->pinnedRing.resize(this->bufferRingDepth, 0);
+    current->pinnedRingPointers.resize(this->bufferRingDepth, NULL);
+    current->pinnedRingSizes.resize(this->bufferRingDepth, 0);
+    current->theMemory = current->ring[this->currentSlot];
+  }
+  return true;
+}
+
+bool GPUKernel::rotateBuffers() {
+  std::vector<std::shared_ptr<SharedMemory> >* collections[2] = {&this->outputs, &this->inputs};
+  unsigned int nextSlot = (this->currentSlot + 1) % this->bufferRingDepth;
+  unsigned int argumentNumber = 0;
+  //The commands of the batch just launched wait for these already.
+  GPU::releaseEvents(this->pendingUnmaps[this->currentSlot]);
+  for (int i = 0; i < 2; i ++) {
+    std::vector<std::shared_ptr<SharedMemory> >& theArgs = *collections[i];
+    for (unsigned j = 0; j < theArgs.size(); j ++, argumentNumber ++) {
+      SharedMemory& current = *theArgs[j];
+      if (current.typE != SharedMemory::typeVoidPointer) {
+        continue;
+      }
+      //Park the staging data of the batch just launched; take back the data
+      //parked by the previous batch in this slot, whose transfers are complete.
+      current.buffer.swap(current.hostRing[this->currentSlot]);
+      current.buffer.clear();
+      current.theMemory = current.ring[nextSlot];
+      cl_int ret = clSetKernelArg(this->kernel, argumentNumber, sizeof(cl_mem), (void*) &current.theMemory);
+      if (ret != CL_SUCCESS) {
+        logGPU << "Failed to rebind argument " << current.name << " of kernel " << this->name
+        << " to slot " << nextSlot << ". Return code: " << ret << ". " << Logger::endL;
+        return false;
+      }
     }
   }
+  this->currentSlot = nextSlot;
   return true;
 }
 
@@ -849,7 +1719,7 @@ bool GPUKernel::SetArguments(std::vector<std::shared_ptr<SharedMemory> >& theArg
       if (this->numInitializedExternallyOwnedBuffers >= this->buffersExternallyOwned.size()) {
         logGPU << "Argument " << current->name << " is set to have externally owned buffer but the index of next external buffer,"
         << this->numInitializedExternallyOwnedBuffers << ", is out of bounds: total: "
-        << this->buffersExternallyOwned.size() << " external buffers. ";
+        << this->buffersExternallyOwned.size() << " external buffers. " << Logger::endL;
         return false;
       }
       current->memoryExternallyOwned = this->buffersExternallyOwned[this->numInitializedExternallyOwnedBuffers];
@@ -861,8 +1731,8 @@ bool GPUKernel::SetArguments(std::vector<std::shared_ptr<SharedMemory> >& theArg
         this->kernel, i + offset, sizeof(cl_mem), (void *)& current->theMemory
       );
     }
-    if (current->typE == SharedMemory::typeMessageIndex) {
-      if (! this->writeMessageIndex(current->uintValue)) {
+    if (current->typE == SharedMemory::typeMessageCount) {
+      if (! this->writeMessageCount(current->uintValue)) {
         return false;
       }
     }
@@ -903,10 +1773,10 @@ bool GPUKernel::writeToBuffer(unsigned argumentNumber, const std::string& input)
 bool GPUKernel::writeToBuffer(unsigned argumentNumber, const void* inputBuffer, size_t size) {
   std::cout << std::dec << "DEBUG: writing VOID POINTER " << inputBuffer << ", size: " << size << std::endl;
   //std::cout << " in buffeR: " << &bufferToWriteInto << std::endl;
-  cl_mem& bufferToWriteInto =
-    argumentNumber < this->outputs.size() ?
-    this->outputs[argumentNumber]->theMemory :
-    this->inputs[argumentNumber - this->outputs.size()]->theMemory;
+  if (!this->reserveArgument(argumentNumber, size)) {
+    return false;
+  }
+  cl_mem& bufferToWriteInto = this->getArgumentMemory(argumentNumber);
   cl_int ret = clEnqueueWriteBuffer(
     this->owner->commandQueue,
     bufferToWriteInto,
@@ -925,6 +1795,362 @@ bool GPUKernel::writeToBuffer(unsigned argumentNumber, const void* inputBuffer,
   return true;
 }
 
+SharedMemory& GPUKernel::getArgument(unsigned argumentNumber) {
+  return
+    argumentNumber < this->outputs.size() ?
+    *this->outputs[argumentNumber] :
+    *this->inputs[argumentNumber - this->outputs.size()];
+}
+
+cl_mem& GPUKernel::getArgumentMemory(unsigned argumentNumber) {
+  return this->getArgument(argumentNumber).theMemory;
+}
+
+bool GPUKernel::writeToBufferAsync(
+  unsigned argumentNumber,
+  const HostBuffer& input,
+  const std::vector<cl_event>& waitList,
+  std::vector<cl_event>& outputEvents
+) {
+  if (this->owner->flagZeroCopy && !input.empty()) {
+    return this->shareHostBuffer(argumentNumber, input, waitList, outputEvents);
+  }
+  return this->writeToBufferAsync(argumentNumber, input.data(), input.size(), waitList, outputEvents);
+}
+
+/* Zero-copy counterpart of writeToBufferAsync:
+ * the argument's buffer in the current slot becomes a new CL_MEM_USE_HOST_PTR buffer over input,
+ * so the device reads the staging data where it is.
+ * input must stay unchanged until the commands using the argument complete:
+ * the server parks it in the slot's hostRing until then, see rotateBuffers.
+ */
+bool GPUKernel::shareHostBuffer(
+  unsigned argumentNumber,
+  const HostBuffer& input,
+  const std::vector<cl_event>& waitList,
+  std::vector<cl_event>& outputEvents
+) {
+  SharedMemory& argument = this->getArgument(argumentNumber);
+  if (argument.typE != SharedMemory::typeVoidPointer || input.size() > argument.maximumSize) {
+    logGPU << "Argument " << argument.name << " of kernel " << this->name << " cannot share "
+    << input.size() << " bytes of host memory. " << Logger::endL;
+    return false;
+  }
+  //The whole pages of the allocation belong to input, see PageAlignedAllocator.
+  size_t size = PageAlignedAllocator<unsigned char>::roundUpToPage(input.capacity());
+  cl_mem_flags flags = (argument.memoryFlags & ~((cl_mem_flags) CL_MEM_ALLOC_HOST_PTR)) | CL_MEM_USE_HOST_PTR;
+  cl_int ret = CL_SUCCESS;
+  cl_mem shared = clCreateBuffer(this->owner->context, flags, size, (void*) input.data(), &ret);
+  if (ret != CL_SUCCESS || shared == NULL) {
+    logGPU << "Failed to share " << size << " bytes of host memory with argument " << argument.name
+    << " of kernel " << this->name << ". Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  clReleaseMemObject(argument.ring[this->currentSlot]);
+  argument.ring[this->currentSlot] = shared;
+  argument.ringSizes[this->currentSlot] = size;
+  argument.theMemory = shared;
+  ret = clSetKernelArg(this->kernel, argumentNumber, sizeof(cl_mem), (void*) &argument.theMemory);
+  if (ret != CL_SUCCESS) {
+    logGPU << "Failed to bind shared argument " << argument.name << " of kernel " << this->name
+    << ". Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  //Nothing to transfer: the event only keeps the caller's ordering.
+  cl_event written = NULL;
+  ret = GPU::enqueueMarker(this->owner->commandQueue, this->withPendingUnmaps(waitList), written);
+  if (ret != CL_SUCCESS) {
+    logGPU << "Enqueueing marker for argument " << argument.name << " of kernel " << this->name
+    << " failed. Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  outputEvents.push_back(written);
+  return true;
+}
+
+bool GPUKernel::writeToBufferAsync(
+  unsigned argumentNumber,
+  const void* input,
+  size_t size,
+  const std::vector<cl_event>& waitList,
+  std::vector<cl_event>& outputEvents
+) {
+  cl_event written = NULL;
+  cl_int ret = CL_SUCCESS;
+  if (!this->reserveArgument(argumentNumber, size)) {
+    return false;
+  }
+  std::vector<cl_event> slotWaitList = this->withPendingUnmaps(waitList);
+  if (size == 0) {
+    ret = GPU::enqueueMarker(this->owner->commandQueue, slotWaitList, written);
+  } else {
+    ret = clEnqueueWriteBuffer(
+      this->owner->commandQueue,
+      this->getArgumentMemory(argumentNumber),
+      CL_FALSE,
+      0,
+      size,
+      input,
+      slotWaitList.size(),
+      slotWaitList.empty() ? NULL : slotWaitList.data(),
+      &written
+    );
+    if (ret == CL_SUCCESS) {
+      this->profile(written, KernelStatistics::commandWrite, size, slotWaitList);
+    }
+  }
+  if (ret != CL_SUCCESS) {
+    logGPU << "Enqueueing write to argument " << argumentNumber << " of kernel " << this->name
+    << " failed. Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  outputEvents.push_back(written);
+  return true;
+}
+
+/* On devices with GPU::flagZeroCopy, the argument's buffer is mapped where it is: nothing is copied.
+ * On other devices, the bytes are copied into pinned host memory of the slot,
+ * which the driver transfers to directly rather than through a staging copy of its own.
+ */
+bool GPUKernel::readBackAsync(
+  unsigned argumentNumber,
+  size_t size,
+  const std::vector<cl_event>& waitList,
+  const unsigned char*& output,
+  cl_event& outputEvent
+) {
+  output = NULL;
+  SharedMemory& argument = this->getArgument(argumentNumber);
+  cl_int ret = CL_SUCCESS;
+  if (size == 0) {
+    ret = GPU::enqueueMarker(this->owner->commandQueue, waitList, outputEvent);
+  } else if (argument.typE != SharedMemory::typeVoidPointer || size > argument.ringSizes[this->currentSlot]) {
+    logGPU << "Cannot read back " << size << " bytes of argument " << argument.name
+    << " of kernel " << this->name << ". " << Logger::endL;
+    return false;
+  } else if (this->owner->flagZeroCopy) {
+    if (argument.mappedRing[this->currentSlot] != NULL) {
+      logGPU << "Argument " << argument.name << " of kernel " << this->name
+      << " is still mapped by an earlier read-back of slot " << this->currentSlot << ". " << Logger::endL;
+      return false;
+    }
+    void* mapped = clEnqueueMapBuffer(
+      this->owner->commandQueue,
+      argument.theMemory,
+      CL_FALSE,
+      CL_MAP_READ,
+      0,
+      size,
+      waitList.size(),
+      waitList.empty() ? NULL : waitList.data(),
+      &outputEvent,
+      &ret
+    );
+    if (ret == CL_SUCCESS) {
+      argument.mappedRing[this->currentSlot] = mapped;
+      output = (const unsigned char*) mapped;
+      this->profile(outputEvent, KernelStatistics::commandRead, size, waitList);
+    }
+  } else {
+    if (!this->reservePinned(argument, size)) {
+      return false;
+    }
+    unsigned char* pinned = argument.pinnedRingPointers[this->currentSlot];
+    ret = clEnqueueReadBuffer(
+      this->owner->commandQueue,
+      argument.theMemory,
+      CL_FALSE,
+      0,
+      size,
+      pinned,
+      waitList.size(),
+      waitList.empty() ? NULL : waitList.data(),
+      &outputEvent
+    );
+    if (ret == CL_SUCCESS) {
+      output = pinned;
+      this->profile(outputEvent, KernelStatistics::commandRead, size, waitList);
+    }
+  }
+  if (ret != CL_SUCCESS) {
+    logGPU << "Enqueueing read back of argument " << argumentNumber << " of kernel " << this->name
+    << " failed. Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  return true;
+}
+
+//Grows the pinned host memory the current slot's read-backs of the argument land in.
+//The previous read-back of the slot has completed: see Server::WaitForSlot.
+bool GPUKernel::reservePinned(SharedMemory& argument, size_t size) {
+  unsigned int slot = this->currentSlot;
+  if (size <= argument.pinnedRingSizes[slot]) {
+    return true;
+  }
+  cl_command_queue queue = this->owner->commandQueue;
+  if (argument.pinnedRing[slot] != 0) {
+    clEnqueueUnmapMemObject(queue, argument.pinnedRing[slot], argument.pinnedRingPointers[slot], 0, NULL, NULL);
+    clReleaseMemObject(argument.pinnedRing[slot]);
+    argument.pinnedRing[slot] = 0;
+    argument.pinnedRingPointers[slot] = NULL;
+    argument.pinnedRingSizes[slot] = 0;
+  }
+  //As large as the device buffer: the pinned memory grows with it, not with every batch.
+  size_t newSize = std::max(size, argument.ringSizes[slot]);
+  cl_int ret = CL_SUCCESS;
+  cl_mem pinned = clCreateBuffer(this->owner->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, newSize, NULL, &ret);
+  if (ret != CL_SUCCESS || pinned == NULL) {
+    logGPU << "Failed to allocate " << newSize << " bytes of pinned memory for argument " << argument.name
+    << " of kernel " << this->name << ". Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  void* pointer = clEnqueueMapBuffer(
+    queue, pinned, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, newSize, 0, NULL, NULL, &ret
+  );
+  if (ret != CL_SUCCESS || pointer == NULL) {
+    logGPU << "Failed to map the pinned memory of argument " << argument.name
+    << " of kernel " << this->name << ". Return code: " << ret << ". " << Logger::endL;
+    clReleaseMemObject(pinned);
+    return false;
+  }
+  argument.pinnedRing[slot] = pinned;
+  argument.pinnedRingPointers[slot] = (unsigned char*) pointer;
+  argument.pinnedRingSizes[slot] = newSize;
+  return true;
+}
+
+//A kernel must not use a buffer while it is mapped:
+//the slot's next writes and launches wait for the unmaps, see withPendingUnmaps.
+bool GPUKernel::releaseReadBacks(unsigned int slot) {
+  std::vector<std::shared_ptr<SharedMemory> >* collections[2] = {&this->outputs, &this->inputs};
+  bool result = true;
+  for (int i = 0; i < 2; i ++) {
+    std::vector<std::shared_ptr<SharedMemory> >& theArgs = *collections[i];
+    for (unsigned j = 0; j < theArgs.size(); j ++) {
+      SharedMemory& current = *theArgs[j];
+      if (current.typE != SharedMemory::typeVoidPointer || current.mappedRing[slot] == NULL) {
+        continue;
+      }
+      cl_event unmapped = NULL;
+      cl_int ret = clEnqueueUnmapMemObject(
+        this->owner->commandQueue, current.ring[slot], current.mappedRing[slot], 0, NULL, &unmapped
+      );
+      current.mappedRing[slot] = NULL;
+      if (ret != CL_SUCCESS) {
+        logGPU << "Failed to unmap argument " << current.name << " of kernel " << this->name
+        << ". Return code: " << ret << ". " << Logger::endL;
+        result = false;
+        continue;
+      }
+      this->pendingUnmaps[slot].push_back(unmapped);
+    }
+  }
+  return result;
+}
+
+std::vector<cl_event> GPUKernel::withPendingUnmaps(const std::vector<cl_event>& waitList) {
+  std::vector<cl_event> result = waitList;
+  const std::vector<cl_event>& unmaps = this->pendingUnmaps[this->currentSlot];
+  result.insert(result.end(), unmaps.begin(), unmaps.end());
+  return result;
+}
+
+class ProfiledCommand {
+public:
+  std::shared_ptr<GPUKernel::Profile> owner;
+  KernelStatistics::CommandKind kind;
+  size_t bytes;
+  std::vector<cl_event> waitList; //<- retained until the command completes
+};
+
+void CL_CALLBACK GPUKernel::profilingTrampoline(cl_event theEvent, cl_int status, void* userData) {
+  ProfiledCommand* command = static_cast<ProfiledCommand*>(userData);
+  cl_ulong queued = 0, submitted = 0, started = 0, ended = 0;
+  //User events and events of other devices have no timestamps on this device's clock: they are left out.
+  cl_ulong dependenciesEnded = 0;
+  for (unsigned i = 0; i < command->waitList.size(); i ++) {
+    cl_ulong dependencyEnded = 0;
+    if (
+      clGetEventProfilingInfo(
+        command->waitList[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &dependencyEnded, NULL
+      ) == CL_SUCCESS
+    ) {
+      dependenciesEnded = std::max(dependenciesEnded, dependencyEnded);
+    }
+  }
+  GPU::releaseEvents(command->waitList);
+  //CL_PROFILING_INFO_NOT_AVAILABLE when the queue does not profile: nothing is recorded.
+  if (
+    status == CL_COMPLETE &&
+    clGetEventProfilingInfo(theEvent, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL) == CL_SUCCESS &&
+    clGetEventProfilingInfo(theEvent, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &submitted, NULL) == CL_SUCCESS &&
+    clGetEventProfilingInfo(theEvent, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &started, NULL) == CL_SUCCESS &&
+    clGetEventProfilingInfo(theEvent, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &ended, NULL) == CL_SUCCESS
+  ) {
+    std::lock_guard<std::mutex> lock(command->owner->lock);
+    command->owner->statistics.record(
+      command->kind, queued, submitted, dependenciesEnded, started, ended, command->bytes
+    );
+  }
+  delete command;
+}
+
+void GPUKernel::profile(
+  cl_event theEvent, KernelStatistics::CommandKind kind, size_t bytes, const std::vector<cl_event>& waitList
+) {
+  ProfiledCommand* command = new ProfiledCommand;
+  command->owner = this->profileOfCommands;
+  command->kind = kind;
+  command->bytes = bytes;
+  for (unsigned i = 0; i < waitList.size(); i ++) {
+    if (waitList[i] != NULL && clRetainEvent(waitList[i]) == CL_SUCCESS) {
+      command->waitList.push_back(waitList[i]);
+    }
+  }
+  if (clSetEventCallback(theEvent, CL_COMPLETE, &GPUKernel::profilingTrampoline, command) != CL_SUCCESS) {
+    GPU::releaseEvents(command->waitList);
+    delete command;
+  }
+}
+
+KernelStatistics GPUKernel::getStatistics() {
+  std::lock_guard<std::mutex> lock(this->profileOfCommands->lock);
+  return this->profileOfCommands->statistics;
+}
+
+cl_int GPU::enqueueMarker(cl_command_queue queue, const std::vector<cl_event>& waitList, cl_event& outputEvent) {
+  return clEnqueueMarkerWithWaitList(
+    queue, waitList.size(), waitList.empty() ? NULL : waitList.data(), &outputEvent
+  );
+}
+
+void GPU::releaseEvents(std::vector<cl_event>& events) {
+  for (unsigned i = 0; i < events.size(); i ++) {
+    if (events[i] != NULL) {
+      clReleaseEvent(events[i]);
+    }
+  }
+  events.clear();
+}
+
+void CL_CALLBACK GPU::completionTrampoline(cl_event theEvent, cl_int status, void* userData) {
+  (void) theEvent;
+  std::function<void(cl_int)>* callback = static_cast<std::function<void(cl_int)>*>(userData);
+  (*callback)(status);
+  delete callback;
+}
+
+bool GPU::onCompletion(cl_event theEvent, const std::function<void(cl_int)>& callback) {
+  std::function<void(cl_int)>* heapCallback = new std::function<void(cl_int)>(callback);
+  cl_int ret = clSetEventCallback(theEvent, CL_COMPLETE, &GPU::completionTrampoline, heapCallback);
+  if (ret != CL_SUCCESS) {
+    delete heapCallback;
+    logGPU << "Failed to set event callback. Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  return true;
+}
+
 std::vector<unsigned char> GPU::getUintBytesBigEndian(uint32_t input){
   std::vector<unsigned char> result;
   result.resize(4);
@@ -935,10 +2161,8 @@ std::vector<unsigned char> GPU::getUintBytesBigEndian(uint32_t input){
   return result;
 }
 
-bool GPUKernel::writeMessageIndex(uint inputArgument) {
-  //std::cout << "DEBUG: writing " << input;
-  //std::cout << "Setting: argument number: " << argumentNumber << ", input: " << input << std::endl;
-  //The message index is always the last argument!
+bool GPUKernel::writeMessageCount(uint inputArgument) {
+  //The message count is always the last argument!
   int argumentNumber = this->outputs.size() + this->inputs.size() - 1;
   std::shared_ptr<SharedMemory>& currentArgument = this->inputs[this->inputs.size() - 1];
   //little/big endian agnostic:
@@ -963,3 +2187,512 @@ bool GPUKernel::writeMessageIndex(uint inputArgument) {
   }
   return true;
 }
+
+bool GPUKernel::enqueueBatch(
+  unsigned int firstMessageIndex, unsigned int numberOfMessages, unsigned int maxMessagesPerLaunch
+) {
+  if (numberOfMessages == 0) {
+    return true;
+  }
+  cl_event lastLaunch = NULL;
+  if (!this->enqueueBatchAsync(firstMessageIndex, numberOfMessages, maxMessagesPerLaunch, std::vector<cl_event>(), lastLaunch)) {
+    return false;
+  }
+  clReleaseEvent(lastLaunch);
+  return true;
+}
+
+void GPUKernel::applyTuning(const KernelTuning& input) {
+  this->tuning = input;
+  this->local_item_size[0] = input.localSize;
+}
+
+unsigned int GPUKernel::getMessagesPerLaunch() {
+  unsigned int result = this->tuning.messagesPerLaunch;
+  if (this->messagesPerLaunchLimit != 0 && (result == 0 || result > this->messagesPerLaunchLimit)) {
+    result = this->messagesPerLaunchLimit;
+  }
+  return result;
+}
+
+size_t GPUKernel::getMaximumWorkGroupSize() {
+  size_t result = 0;
+  cl_int ret = clGetKernelWorkGroupInfo(
+    this->kernel, this->owner->currentDeviceId, CL_KERNEL_WORK_GROUP_SIZE, sizeof(result), &result, NULL
+  );
+  if (ret != CL_SUCCESS) {
+    return 0;
+  }
+  return result;
+}
+
+bool GPUKernel::enqueueBatchAsync(
+  unsigned int firstMessageIndex,
+  unsigned int numberOfMessages,
+  unsigned int maxMessagesPerLaunch,
+  const std::vector<cl_event>& waitList,
+  cl_event& outputEvent
+) {
+  outputEvent = NULL;
+  if (firstMessageIndex % this->messagesPerWorkItem != 0 || maxMessagesPerLaunch % this->messagesPerWorkItem != 0) {
+    logGPU << "Kernel " << this->name << " processes " << this->messagesPerWorkItem
+    << " messages per work item: the first message index " << firstMessageIndex
+    << " and the launch size " << maxMessagesPerLaunch << " must be multiples of that. " << Logger::endL;
+    return false;
+  }
+  if (numberOfMessages == 0) {
+    cl_int ret = GPU::enqueueMarker(this->owner->commandQueue, this->withPendingUnmaps(waitList), outputEvent);
+    return ret == CL_SUCCESS;
+  }
+  if (maxMessagesPerLaunch == 0) {
+    maxMessagesPerLaunch = numberOfMessages;
+  }
+  unsigned int lastMessageIndexPlusOne = firstMessageIndex + numberOfMessages;
+  if (!this->reserveOutputs(lastMessageIndexPlusOne)) {
+    return false;
+  }
+  //The first launch waits for waitList, every further launch for the previous one.
+  std::vector<cl_event> currentWaitList = this->withPendingUnmaps(waitList);
+  cl_event previousLaunch = NULL;
+  bool result = true;
+  for (unsigned int launchStart = firstMessageIndex; launchStart < lastMessageIndexPlusOne; launchStart += maxMessagesPerLaunch) {
+    unsigned int launchSize = std::min(maxMessagesPerLaunch, lastMessageIndexPlusOne - launchStart);
+    //Work items past the end of the launch exit immediately, see the __kernel functions.
+    //Kernel arguments are captured at enqueue time, so the count may change between launches.
+    if (!this->writeMessageCount(launchStart + launchSize)) {
+      result = false;
+      break;
+    }
+    size_t globalOffset[3] = {launchStart / this->messagesPerWorkItem, 0, 0};
+    size_t globalSize[3] = {(launchSize + this->messagesPerWorkItem - 1) / this->messagesPerWorkItem, 1, 1};
+    if (globalSize[0] % this->local_item_size[0] != 0) {
+      globalSize[0] += this->local_item_size[0] - globalSize[0] % this->local_item_size[0];
+    }
+    cl_event currentLaunch = NULL;
+    cl_int ret = clEnqueueNDRangeKernel(
+      this->owner->commandQueue,
+      this->kernel,
+      1,
+      globalOffset,
+      globalSize,
+      this->local_item_size,
+      currentWaitList.size(),
+      currentWaitList.empty() ? NULL : currentWaitList.data(),
+      &currentLaunch
+    );
+    //Before the previous launch is released: the wait list holds it.
+    if (ret == CL_SUCCESS) {
+      this->profile(currentLaunch, KernelStatistics::commandLaunch, 0, currentWaitList);
+    }
+    if (previousLaunch != NULL) {
+      clReleaseEvent(previousLaunch);
+      previousLaunch = NULL;
+    }
+    if (ret != CL_SUCCESS) {
+      logGPU << "Failed to enqueue kernel " << this->name << " over messages " << launchStart
+      << " to " << launchStart + launchSize - 1 << ". Return code: " << ret << ". " << Logger::endL;
+      result = false;
+      break;
+    }
+    previousLaunch = currentLaunch;
+    currentWaitList.assign(1, currentLaunch);
+  }
+  if (!result) {
+    if (previousLaunch != NULL) {
+      clReleaseEvent(previousLaunch);
+    }
+    return false;
+  }
+  outputEvent = previousLaunch;
+  return true;
+}
+
+DeviceManager::DeviceManager() {
+  this->theDesiredDeviceType = CL_DEVICE_TYPE_ALL;
+  this->partitionAffinityDomain = 0;
+}
+
+const std::vector<std::string>& DeviceManager::routableKernels() {
+  static std::vector<std::string> result = {
+    GPU::kernelSHA256, GPU::kernelTestBuffer, GPU::kernelGeneratePublicKey, GPU::kernelSign, GPU::kernelVerifySignature
+  };
+  return result;
+}
+
+bool DeviceManager::parsePartition(const std::string& description) {
+  this->partitionComputeUnits.clear();
+  this->partitionKernels.clear();
+  this->partitionAffinityDomain = 0;
+  std::string domainNames[] = {"numa", "l3", "l2", "l1", "next"};
+  cl_device_affinity_domain domains[] = {
+    CL_DEVICE_AFFINITY_DOMAIN_NUMA,
+    CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE,
+    CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE,
+    CL_DEVICE_AFFINITY_DOMAIN_L1_CACHE,
+    CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE
+  };
+  for (unsigned i = 0; i < sizeof(domains) / sizeof(domains[0]); i ++) {
+    if (description == domainNames[i]) {
+      this->partitionAffinityDomain = domains[i];
+      return true;
+    }
+  }
+  unsigned int numberOfRemainders = 0;
+  std::stringstream entries(description);
+  std::string entry;
+  while (std::getline(entries, entry, ',')) {
+    size_t colon = entry.find(':');
+    std::string computeUnits = entry.substr(0, colon);
+    if (computeUnits.empty() || computeUnits.find_first_not_of("0123456789") != std::string::npos) {
+      logGPU << Logger::colorRed << "Bad sub-device in partition " << description << ": " << entry << ". "
+      << Logger::colorNormal << Logger::endL;
+      this->partitionComputeUnits.clear();
+      this->partitionKernels.clear();
+      return false;
+    }
+    this->partitionComputeUnits.push_back(std::stoul(computeUnits));
+    if (this->partitionComputeUnits.back() == 0) {
+      numberOfRemainders ++;
+    }
+    std::vector<std::string> kernels;
+    if (colon != std::string::npos) {
+      std::stringstream kernelNames(entry.substr(colon + 1));
+      std::string kernelName;
+      while (std::getline(kernelNames, kernelName, '+')) {
+        if (kernelName == "") {
+          continue;
+        }
+        const std::vector<std::string>& routable = DeviceManager::routableKernels();
+        if (std::find(routable.begin(), routable.end(), kernelName) == routable.end()) {
+          logGPU << Logger::colorRed << "Unknown kernel in partition " << description << ": " << kernelName
+          << ". The kernels that can be routed are: ";
+          for (unsigned i = 0; i < routable.size(); i ++) {
+            logGPU << routable[i] << " ";
+          }
+          logGPU << Logger::colorNormal << Logger::endL;
+          this->partitionComputeUnits.clear();
+          this->partitionKernels.clear();
+          return false;
+        }
+        kernels.push_back(kernelName);
+      }
+    }
+    this->partitionKernels.push_back(kernels);
+  }
+  if (this->partitionComputeUnits.empty() || numberOfRemainders > 1) {
+    logGPU << Logger::colorRed << "Bad partition: " << description << ". At least one sub-device is needed, "
+    << "and at most one of them may take the remaining compute units. " << Logger::colorNormal << Logger::endL;
+    this->partitionComputeUnits.clear();
+    this->partitionKernels.clear();
+    return false;
+  }
+  bool everySubDeviceHasRules = true;
+  std::vector<std::string> claimed;
+  for (unsigned i = 0; i < this->partitionKernels.size(); i ++) {
+    everySubDeviceHasRules = everySubDeviceHasRules && !this->partitionKernels[i].empty();
+    claimed.insert(claimed.end(), this->partitionKernels[i].begin(), this->partitionKernels[i].end());
+  }
+  const std::vector<std::string>& routable = DeviceManager::routableKernels();
+  for (unsigned i = 0; everySubDeviceHasRules && i < routable.size(); i ++) {
+    if (std::find(claimed.begin(), claimed.end(), routable[i]) == claimed.end()) {
+      logGPU << Logger::colorRed << "Bad partition: " << description << ". No sub-device serves " << routable[i]
+      << ": leave one sub-device without rules to serve the kernels the others do not. "
+      << Logger::colorNormal << Logger::endL;
+      this->partitionComputeUnits.clear();
+      this->partitionKernels.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DeviceManager::partition(cl_device_id device, std::vector<cl_device_id>& output) {
+  output.clear();
+  std::vector<cl_device_partition_property> properties;
+  if (this->partitionAffinityDomain != 0) {
+    properties.push_back(CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN);
+    properties.push_back((cl_device_partition_property) this->partitionAffinityDomain);
+  } else if (!this->partitionComputeUnits.empty()) {
+    unsigned int totalComputeUnits = OpenCLFunctions::getMaximumComputeUnits(device);
+    unsigned int used = 0;
+    for (unsigned i = 0; i < this->partitionComputeUnits.size(); i ++) {
+      used += this->partitionComputeUnits[i];
+    }
+    properties.push_back(CL_DEVICE_PARTITION_BY_COUNTS);
+    for (unsigned i = 0; i < this->partitionComputeUnits.size(); i ++) {
+      unsigned int computeUnits = this->partitionComputeUnits[i];
+      if (computeUnits == 0) {
+        computeUnits = totalComputeUnits > used ? totalComputeUnits - used : 0;
+      }
+      if (computeUnits == 0 || used > totalComputeUnits) {
+        logGPU << "Device " << OpenCLFunctions::getDeviceName(device) << " has " << totalComputeUnits
+        << " compute unit(s), too few for the partition: the device is used whole. " << Logger::endL;
+        return false;
+      }
+      properties.push_back(computeUnits);
+    }
+    properties.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+  } else {
+    return false;
+  }
+  properties.push_back(0);
+  cl_uint numberOfSubDevices = 0;
+  cl_int ret = clCreateSubDevices(device, properties.data(), 0, NULL, &numberOfSubDevices);
+  if (ret == CL_SUCCESS && numberOfSubDevices > 0) {
+    output.resize(numberOfSubDevices);
+    ret = clCreateSubDevices(device, properties.data(), numberOfSubDevices, output.data(), NULL);
+  }
+  if (ret != CL_SUCCESS || numberOfSubDevices == 0) {
+    output.clear();
+    logGPU << "Device " << OpenCLFunctions::getDeviceName(device) << " cannot be partitioned. Return code: "
+    << ret << ". The device is used whole. " << Logger::endL;
+    return false;
+  }
+  return true;
+}
+
+/* A partitioned device gets a GPU per sub-device, each with its own context, queue and kernels.
+ * A sub-device with a routing rule serves only the kernels of its rule;
+ * the other sub-devices of the device serve every kernel no rule names.
+ * For example, 4:secp256k1_opencl_sign,0 signs on 4 compute units and verifies on the rest,
+ * so that signatures never wait behind verifications.
+ */
+bool DeviceManager::initialize() {
+  if (!this->theGPUs.empty()) {
+    return true;
+  }
+  std::vector<cl_device_id> devices;
+  if (!OpenCLFunctions::getDevices(this->theDesiredDeviceType, devices)) {
+    logGPU << "No OpenCL device found. " << Logger::endL;
+    return false;
+  }
+  for (unsigned i = 0; i < devices.size(); i ++) {
+    std::vector<cl_device_id> subDevices;
+    bool partitioned = this->partition(devices[i], subDevices);
+    if (!partitioned) {
+      subDevices.assign(1, devices[i]);
+    }
+    for (unsigned j = 0; j < subDevices.size(); j ++) {
+      std::shared_ptr<GPU> current = std::make_shared<GPU>();
+      current->desiredDeviceId = subDevices[j];
+      current->flagSubDevice = partitioned;
+      cl_device_type deviceType = OpenCLFunctions::getDeviceType(subDevices[j]);
+      current->theDesiredDeviceType =
+        (deviceType & CL_DEVICE_TYPE_CPU) != 0 ? CL_DEVICE_TYPE_CPU :
+        (deviceType & CL_DEVICE_TYPE_ACCELERATOR) != 0 ? CL_DEVICE_TYPE_ACCELERATOR :
+        CL_DEVICE_TYPE_GPU;
+      if (partitioned) {
+        if (j < this->partitionKernels.size() && !this->partitionKernels[j].empty()) {
+          current->kernelsServed = this->partitionKernels[j];
+        } else {
+          for (unsigned k = 0; k < this->partitionKernels.size(); k ++) {
+            current->kernelsNotServed.insert(
+              current->kernelsNotServed.end(), this->partitionKernels[k].begin(), this->partitionKernels[k].end()
+            );
+          }
+        }
+      }
+      if (!current->initializeKernelsNoBuild()) {
+        //The other devices carry the load.
+        logGPU << Logger::colorRed << "Failed to initialize device " << i << ": "
+        << OpenCLFunctions::getDeviceName(devices[i]) << ". " << Logger::colorNormal << Logger::endL;
+        continue;
+      }
+      logGPU << "Device " << this->theGPUs.size() << ": " << current->getId() << ". " << Logger::endL;
+      if (partitioned) {
+        logGPU << "Sub-device " << j << " of device " << i << ", "
+        << OpenCLFunctions::getMaximumComputeUnits(subDevices[j]) << " compute unit(s), serving: ";
+        if (!current->kernelsServed.empty()) {
+          for (unsigned k = 0; k < current->kernelsServed.size(); k ++) {
+            logGPU << current->kernelsServed[k] << " ";
+          }
+        } else {
+          logGPU << "all kernels ";
+          for (unsigned k = 0; k < current->kernelsNotServed.size(); k ++) {
+            logGPU << (k == 0 ? "but " : "") << current->kernelsNotServed[k] << " ";
+          }
+        }
+        logGPU << Logger::endL;
+      }
+      this->theGPUs.push_back(current);
+    }
+  }
+  return !this->theGPUs.empty();
+}
+
+CostModel::CostModel() {
+  this->weight = 0;
+  this->sumMessages = 0;
+  this->sumSeconds = 0;
+  this->sumMessagesSquared = 0;
+  this->sumMessagesSeconds = 0;
+  this->fixedSeconds = 0;
+  this->secondsPerMessage = 0;
+  this->numberOfSamples = 0;
+}
+
+void CostModel::record(unsigned int numberOfMessages, double seconds) {
+  if (numberOfMessages == 0) {
+    return;
+  }
+  double decay = 1 - CostModel::smoothing;
+  double messages = numberOfMessages;
+  this->weight = this->weight * decay + 1;
+  this->sumMessages = this->sumMessages * decay + messages;
+  this->sumSeconds = this->sumSeconds * decay + seconds;
+  this->sumMessagesSquared = this->sumMessagesSquared * decay + messages * messages;
+  this->sumMessagesSeconds = this->sumMessagesSeconds * decay + messages * seconds;
+  this->numberOfSamples ++;
+  double variance = this->weight * this->sumMessagesSquared - this->sumMessages * this->sumMessages;
+  if (variance > 1e-6 * this->weight * this->sumMessagesSquared) {
+    this->secondsPerMessage = (this->weight * this->sumMessagesSeconds - this->sumMessages * this->sumSeconds) / variance;
+    this->fixedSeconds = (this->sumSeconds - this->secondsPerMessage * this->sumMessages) / this->weight;
+    if (this->secondsPerMessage > 0 && this->fixedSeconds >= 0) {
+      return;
+    }
+  }
+  //Batches of a single size, or a fit with no meaning: the cost is taken as proportional.
+  this->fixedSeconds = 0;
+  this->secondsPerMessage = this->sumSeconds / this->sumMessages;
+}
+
+double CostModel::predict(unsigned int numberOfMessages) const {
+  if (numberOfMessages == 0) {
+    return 0;
+  }
+  return this->fixedSeconds + this->secondsPerMessage * numberOfMessages;
+}
+
+/* Only the backends that serve the kernel take part, see GPU::servesKernel.
+ * Backends not yet measured for the kernel get equal shares, so that all of them get measured;
+ * the rounding remainder goes to the unmeasured ones first.
+ * Otherwise backend i, free in outstandingSeconds[i], finishes n_i messages at
+ * outstandingSeconds[i] + fixedSeconds + secondsPerMessage * n_i.
+ * The backends that can start earliest are given shares that make them finish at the same time,
+ * as early as possible; a backend is left out when the others finish before it could start.
+ */
+void DeviceManager::split(
+  const std::string& kernelName,
+  unsigned int numberOfMessages,
+  unsigned int numberOfBackends,
+  std::vector<unsigned int>& outputCounts
+) {
+  outputCounts.assign(numberOfBackends, 0);
+  if (numberOfBackends == 0) {
+    return;
+  }
+  std::vector<CostModel>& models = this->costs[kernelName];
+  models.resize(numberOfBackends);
+  this->outstandingSeconds.resize(numberOfBackends, 0);
+  this->lastCompletion.resize(numberOfBackends);
+  std::vector<unsigned int> backends;
+  for (unsigned i = 0; i < numberOfBackends; i ++) {
+    if (i >= this->theGPUs.size() || this->theGPUs[i]->servesKernel(kernelName)) {
+      backends.push_back(i);
+    }
+  }
+  if (backends.empty()) {
+    //parsePartition leaves every kernel a sub-device, so this happens only when the sub-devices serving the kernel
+    //failed to initialize: the requests then go to, and fail on, devices that did not build the kernel.
+    for (unsigned i = 0; i < numberOfBackends; i ++) {
+      backends.push_back(i);
+    }
+  }
+  std::vector<unsigned int> order;
+  for (unsigned i = 0; i < backends.size(); i ++) {
+    if (models[backends[i]].numberOfSamples == 0) {
+      order.push_back(backends[i]);
+    }
+  }
+  if (!order.empty()) {
+    for (unsigned i = 0; i < backends.size(); i ++) {
+      outputCounts[backends[i]] = numberOfMessages / backends.size();
+      if (models[backends[i]].numberOfSamples != 0) {
+        order.push_back(backends[i]);
+      }
+    }
+    for (unsigned i = 0; i < numberOfMessages % backends.size(); i ++) {
+      outputCounts[order[i]] ++;
+    }
+  } else {
+    std::vector<double> start(numberOfBackends), rate(numberOfBackends);
+    for (unsigned i = 0; i < backends.size(); i ++) {
+      unsigned int current = backends[i];
+      start[current] = this->outstandingSeconds[current] + models[current].fixedSeconds;
+      rate[current] = std::max(models[current].secondsPerMessage, 1e-12);
+      order.push_back(current);
+    }
+    std::sort(order.begin(), order.end(), [&start](unsigned int left, unsigned int right) {
+      return start[left] < start[right];
+    });
+    double finish = 0, sumStartOverRate = 0, sumInverseRate = 0;
+    unsigned int numberUsed = 0;
+    while (numberUsed < order.size()) {
+      unsigned int current = order[numberUsed];
+      sumStartOverRate += start[current] / rate[current];
+      sumInverseRate += 1 / rate[current];
+      finish = (numberOfMessages + sumStartOverRate) / sumInverseRate;
+      numberUsed ++;
+      if (numberUsed < order.size() && start[order[numberUsed]] >= finish) {
+        break;
+      }
+    }
+    unsigned int assigned = 0;
+    for (unsigned i = 0; i < numberUsed; i ++) {
+      unsigned int current = order[i];
+      outputCounts[current] = (unsigned int) std::max((finish - start[current]) / rate[current], 0.0);
+      outputCounts[current] = std::min(outputCounts[current], numberOfMessages - assigned);
+      assigned += outputCounts[current];
+    }
+    //The rounding remainder, one message at a time, to the backend that then finishes first.
+    for (; assigned < numberOfMessages; assigned ++) {
+      unsigned int best = order[0];
+      for (unsigned i = 1; i < numberUsed; i ++) {
+        unsigned int current = order[i];
+        if (start[current] + rate[current] * (outputCounts[current] + 1) < start[best] + rate[best] * (outputCounts[best] + 1)) {
+          best = current;
+        }
+      }
+      outputCounts[best] ++;
+    }
+  }
+}
+
+double DeviceManager::charge(unsigned int backendIndex, const std::string& kernelName, unsigned int numberOfMessages) {
+  std::vector<CostModel>& models = this->costs[kernelName];
+  if (backendIndex >= models.size()) {
+    models.resize(backendIndex + 1);
+  }
+  if (backendIndex >= this->outstandingSeconds.size()) {
+    this->outstandingSeconds.resize(backendIndex + 1, 0);
+    this->lastCompletion.resize(backendIndex + 1);
+  }
+  double result = models[backendIndex].predict(numberOfMessages);
+  this->outstandingSeconds[backendIndex] += result;
+  return result;
+}
+
+//A batch is timed from when its backend could start it, after its launch and the completion before it,
+//so that the time it waited behind other batches is not counted as its own.
+void DeviceManager::recordBatch(
+  unsigned int backendIndex,
+  const std::string& kernelName,
+  unsigned int numberOfMessages,
+  double predictedSeconds,
+  std::chrono::steady_clock::time_point timeLaunched,
+  std::chrono::steady_clock::time_point timeCompleted
+) {
+  std::vector<CostModel>& models = this->costs[kernelName];
+  if (backendIndex >= models.size() || backendIndex >= this->outstandingSeconds.size()) {
+    return;
+  }
+  //The max only absorbs floating point rounding.
+  this->outstandingSeconds[backendIndex] = std::max(this->outstandingSeconds[backendIndex] - predictedSeconds, 0.0);
+  if (numberOfMessages == 0) {
+    return;
+  }
+  std::chrono::steady_clock::time_point timeStarted = std::max(timeLaunched, this->lastCompletion[backendIndex]);
+  this->lastCompletion[backendIndex] = std::max(timeCompleted, this->lastCompletion[backendIndex]);
+  double seconds = std::max(std::chrono::duration<double>(timeCompleted - timeStarted).count(), 0.0);
+  models[backendIndex].record(numberOfMessages, seconds);
+}
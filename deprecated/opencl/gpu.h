@@ -7,6 +7,13 @@
 #include <unordered_map>
 #include <fstream>
 #include <iostream>
+#include <functional>
+#include <future>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <new>
+#include <stdlib.h>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 //<- use opencl 1.1 instead of older versions.
@@ -21,23 +28,90 @@
 class OpenCLFunctions {
 public:
   static std::string getDeviceInfo(cl_device_id deviceId, cl_device_info informationRequested);
+  //All devices of the given type on all platforms, in platform order.
+  static bool getDevices(cl_device_type deviceType, std::vector<cl_device_id>& output);
+  static cl_device_type getDeviceType(cl_device_id deviceId);
   static std::string getDriverVersion(cl_device_id deviceId);
   static bool getIsLittleEndian(cl_device_id deviceId);
   static long long getGlobalMemorySize(cl_device_id deviceId);
   static std::string getDeviceName(cl_device_id deviceId);
+  //True for CPU devices and for GPUs that share the host's memory, such as integrated GPUs.
+  static bool getSharesHostMemory(cl_device_id deviceId);
+  static unsigned int getMaximumComputeUnits(cl_device_id deviceId);
 };
 
+//Page-aligned host memory, allocated in whole pages:
+//a device that shares the host's memory uses such memory in place
+//(CL_MEM_USE_HOST_PTR), see GPU::flagZeroCopy.
+template <typename Element>
+class PageAlignedAllocator {
+public:
+  typedef Element value_type;
+  static const size_t pageSize = 4096;
+  PageAlignedAllocator() {
+  }
+  template <typename Other>
+  PageAlignedAllocator(const PageAlignedAllocator<Other>& other) {
+    (void) other;
+  }
+  static size_t roundUpToPage(size_t size) {
+    return (size + pageSize - 1) / pageSize * pageSize;
+  }
+  Element* allocate(size_t count) {
+    void* result = NULL;
+    if (posix_memalign(&result, pageSize, PageAlignedAllocator::roundUpToPage(count * sizeof(Element))) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<Element*>(result);
+  }
+  void deallocate(Element* pointer, size_t count) {
+    (void) count;
+    free(pointer);
+  }
+};
+
+template <typename Left, typename Right>
+bool operator==(const PageAlignedAllocator<Left>& left, const PageAlignedAllocator<Right>& right) {
+  (void) left;
+  (void) right;
+  return true;
+}
+
+template <typename Left, typename Right>
+bool operator!=(const PageAlignedAllocator<Left>& left, const PageAlignedAllocator<Right>& right) {
+  return !(left == right);
+}
+
+//Host staging data of a kernel argument.
+typedef std::vector<unsigned char, PageAlignedAllocator<unsigned char> > HostBuffer;
+
 class SharedMemory {
 public:
   enum {
     typeVoidPointer,
     typeVoidPointerExternalOwnership,
-    typeMessageIndex
+    typeMessageCount
   };
   std::string name;
-  cl_mem theMemory;
+  cl_mem theMemory; //<- the ring buffer of the kernel's current slot
   cl_mem* memoryExternallyOwned;
-  std::vector<unsigned char> buffer;
+  HostBuffer buffer;
+  //One device buffer per slot, see GPUKernel::bufferRingDepth.
+  std::vector<cl_mem> ring;
+  //Host staging data of batches still in flight, by slot.
+  std::vector<HostBuffer> hostRing;
+  //Bytes allocated to each ring buffer; a buffer grows when its slot needs more, see GPUKernel::reserveArgument.
+  std::vector<size_t> ringSizes;
+  //Read-backs of batches still in flight, by slot, see GPUKernel::readBackAsync.
+  //With GPU::flagZeroCopy: the ring buffer as mapped, NULL once unmapped.
+  std::vector<void*> mappedRing;
+  //Otherwise: pinned host memory (CL_MEM_ALLOC_HOST_PTR), mapped once when allocated.
+  std::vector<cl_mem> pinnedRing;
+  std::vector<unsigned char*> pinnedRingPointers;
+  std::vector<size_t> pinnedRingSizes;
+  unsigned int bytesPerMessage; //<- 0 if the size does not follow the number of messages
+  size_t maximumSize; //<- no ring buffer, and no batch's staging data, grows past this
+  cl_mem_flags memoryFlags;
   int typE;
   unsigned int uintValue;
   SharedMemory();
@@ -47,6 +121,82 @@ public:
 
 class GPU;
 
+//Device memory of one kernel argument, declared with GPUKernel::setArgumentSize before the kernel is built.
+//An argument holds either bytesPerMessage bytes per message,
+//for up to the kernel's maximumMessages messages,
+//or, if bytesPerMessage is 0, anywhere from initialSize up to maximumSize bytes.
+class ArgumentSize {
+public:
+  unsigned int bytesPerMessage;
+  size_t initialSize;
+  size_t maximumSize;
+  ArgumentSize();
+};
+
+//Launch configuration of one kernel on one device, found by GPU::autotune
+//and stored in the tuning file of the device, see GPU::tuningFolder.
+class KernelTuning {
+public:
+  size_t localSize; //<- work items per work group
+  unsigned int messagesPerLaunch; //<- 0: one launch per batch
+  unsigned int batchSize; //<- messages per batch the server starts from; 0: the server's default
+  KernelTuning();
+};
+
+//Distribution of durations in powers of two of microseconds:
+//bucket 0 counts the durations under 1 microsecond, bucket i > 0 those in [2^(i - 1), 2^i) microseconds.
+class DurationHistogram {
+public:
+  static const unsigned int numberOfBuckets = 32;
+  unsigned long long buckets[numberOfBuckets];
+  unsigned long long count;
+  double totalSeconds;
+  double maximumSeconds;
+  void add(double seconds);
+  //Upper bound, in seconds, of the bucket holding the given fraction of the durations.
+  double percentile(double fraction) const;
+  void toJSON(std::ostream& output) const;
+  DurationHistogram();
+};
+
+//Profile of the commands of one kernel on one device, from the timestamps of their events,
+//see GPUKernel::profile: the writes of its inputs, its launches and the reads of its results.
+//Recorded by OpenCL completion callbacks: read it through a copy, see GPUKernel::getStatistics.
+class KernelStatistics {
+public:
+  enum CommandKind {commandWrite, commandLaunch, commandRead};
+  unsigned long long numberOfWrites;
+  unsigned long long numberOfLaunches;
+  unsigned long long numberOfReads;
+  unsigned long long bytesWritten;
+  unsigned long long bytesRead;
+  //Commands of all kinds, from CL_PROFILING_COMMAND_QUEUED to the end of the last event they wait for:
+  //on the out-of-order queue, the time spent behind the commands they depend on.
+  DurationHistogram dependencyWait;
+  //Commands of all kinds, from the end of dependencyWait to CL_PROFILING_COMMAND_START: the wait for the device.
+  DurationHistogram queueWait;
+  //From CL_PROFILING_COMMAND_QUEUED to CL_PROFILING_COMMAND_SUBMIT: spent on the host, before the queue is flushed.
+  double submitSeconds;
+  DurationHistogram transfer; //<- writes and reads, from start to end
+  DurationHistogram execute; //<- launches, from start to end
+  //dependenciesEnded: the latest CL_PROFILING_COMMAND_END of the events the command waited for, 0 when none is known.
+  void record(
+    CommandKind kind,
+    cl_ulong queued,
+    cl_ulong submitted,
+    cl_ulong dependenciesEnded,
+    cl_ulong started,
+    cl_ulong ended,
+    size_t bytes
+  );
+  //"transfer" or "compute", whichever took the device longer; "idle" before any command completed.
+  std::string bound() const;
+  void toJSON(std::ostream& output) const;
+  //One line: commands, bytes, total and percentile times.
+  std::string toStringSummary() const;
+  KernelStatistics();
+};
+
 ///
 /// In the class to follow, we make the following assumptions on the code given in the
 /// .cl file that corresponds to the kernel.
@@ -69,15 +219,41 @@ public:
   std::vector<int> desiredInputTypes;
   std::vector<std::string> desiredExternalBufferNames;
   std::vector<std::string> desiredExternalBufferKernelOwners;
+  //Arguments not listed get a fixed GPU::defaultBufferSize.
+  std::unordered_map<std::string, ArgumentSize> desiredArgumentSizes;
 
   std::vector<cl_mem*> buffersExternallyOwned;
   cl_program program;
+  std::string source; //<- contents of the .cl file, before preprocessing
   cl_kernel kernel;
   std::string name;
   unsigned numInitializedExternallyOwnedBuffers;
+  bool flagIsCompiled; //<- program built and cl_kernel created; the arguments may still be missing
   bool flagIsBuilt;
-  size_t local_item_size[3]; // Divide work items into groups of this size, initialized to 32
+  size_t local_item_size[3]; // Divide work items into groups of this size, initialized to 32; see applyTuning
   size_t global_item_size[3]; // Divide work items into groups of this size, initialized to 32
+  unsigned int messagesPerWorkItem; // Consecutive messages handled by one work item, initialized to 1
+  //Number of device buffers per argument, initialized to 1; set before build.
+  //With depth N, the transfers of up to N batches in different slots may overlap
+  //one another's kernel executions.
+  unsigned int bufferRingDepth;
+  unsigned int currentSlot;
+  //Most messages a single launch may cover, 0 for no limit; a property of the kernel's code.
+  unsigned int messagesPerLaunchLimit;
+  //Launch configuration on the current device, applied by applyTuning.
+  KernelTuning tuning;
+  class Profile {
+  public:
+    std::mutex lock;
+    KernelStatistics statistics;
+  };
+  //Shared with the completion callbacks of the kernel's commands, which may outlive the kernel.
+  std::shared_ptr<Profile> profileOfCommands;
+  //Most messages a batch may hold; bounds the arguments sized per message.
+  unsigned int maximumMessages;
+  //Buffers sized per message start with room for this many messages and double as needed.
+  static const unsigned int initialMessages = 256;
+  static const unsigned int defaultMaximumMessages = 131072;
 
   std::vector<std::string> computationIds; // <- used to pipeline messages.
   std::vector<std::shared_ptr<SharedMemory> >& getOutputCollection();
@@ -95,8 +271,36 @@ public:
     const std::vector<std::string>& inputExternalBufferKernelOwners,
     GPU& ownerGPU
   );
+  //compile touches only this kernel and may run concurrently with the compilation of other kernels.
+  bool compile();
+  //Compiles if needed, then binds the arguments, building the kernels owning the external buffers first.
   bool build();
+  bool createProgramFromSource();
+#ifdef MACRO_USE_EMBEDDED_KERNEL_SOURCES
+  bool loadEmbeddedSource();
+#endif
+  //Program binaries are cached in this folder, relative to the cache root, see GPU::cacheRoot,
+  //under a key of the source with its #include "..." files expanded,
+  //the build options, the device name and the driver version.
+  static std::string programBinaryCacheFolder;
+  std::string computeProgramBinaryKey(const std::string& buildOptions);
+  static void appendSourceWithIncludes(
+    const std::string& folder,
+    const std::string& fileName,
+    const std::string& contents,
+    std::vector<std::string>& visited,
+    std::string& output
+  );
+  //Set by compile: absolute path of the program's cache entry, whether or not it was written.
+  std::string programBinaryFileName;
+  bool createProgramFromCachedBinary(const std::string& fileName);
+  bool storeProgramBinary(const std::string& fileName);
   bool hasArgumentName(const std::string& desiredArgumentName);
+  void setArgumentSize(const std::string& argumentName, unsigned int bytesPerMessage);
+  void setArgumentSize(const std::string& argumentName, size_t initialSize, size_t maximumSize);
+  bool reserveArgument(unsigned argumentNumber, size_t size);
+  bool reservePinned(SharedMemory& argument, size_t size);
+  bool reserveOutputs(unsigned int numberOfMessages);
   cl_mem* getClMemPointer(const std::string& bufferName);
 
   bool constructArguments(
@@ -109,7 +313,79 @@ public:
   bool writeToBuffer(unsigned argumentNumber, const std::vector<unsigned int>& input);
   bool writeToBuffer(unsigned argumentNumber, const std::string& input);
   bool writeToBuffer(unsigned argumentNumber, const void* input, size_t size);
-  bool writeMessageIndex(uint input);
+  bool writeMessageCount(uint input);
+  //Enqueues the kernel over messages firstMessageIndex, ..., firstMessageIndex + numberOfMessages - 1
+  //with one work item per messagesPerWorkItem messages, in as few launches as possible.
+  //If maxMessagesPerLaunch is non-zero, the range is split into consecutive launches
+  //of at most that many messages, each launch waiting for the previous one to complete.
+  bool enqueueBatch(unsigned int firstMessageIndex, unsigned int numberOfMessages, unsigned int maxMessagesPerLaunch);
+  void applyTuning(const KernelTuning& input);
+  //The maxMessagesPerLaunch to pass to enqueueBatch: the tuned launch size within messagesPerLaunchLimit.
+  unsigned int getMessagesPerLaunch();
+  //Largest work group the compiled kernel runs with on the current device; 0 if unknown.
+  size_t getMaximumWorkGroupSize();
+  SharedMemory& getArgument(unsigned argumentNumber);
+  cl_mem& getArgumentMemory(unsigned argumentNumber);
+  //Call after enqueueing a batch's writes, launches and reads in the current slot.
+  //Parks the host staging buffers of that batch, hands back empty ones
+  //and rebinds the kernel arguments to the next slot's device buffers.
+  //The caller must not reuse a slot before the last batch in it has completed.
+  bool rotateBuffers();
+  //Non-blocking counterparts of writeToBuffer, enqueueBatch and clEnqueueReadBuffer.
+  //Writes and launches also wait for the unmaps of the slot's last read-backs, see releaseReadBacks.
+  //Each enqueues its command to start after all events in waitList and
+  //hands back an event that completes with the command; the caller releases it.
+  //Host memory given to a write or a read must stay untouched until its event completes.
+  //writeToBufferAsync appends its event to outputEvents.
+  //With GPU::flagZeroCopy, input must be the argument's own staging buffer: see shareHostBuffer.
+  bool writeToBufferAsync(
+    unsigned argumentNumber,
+    const HostBuffer& input,
+    const std::vector<cl_event>& waitList,
+    std::vector<cl_event>& outputEvents
+  );
+  bool shareHostBuffer(
+    unsigned argumentNumber,
+    const HostBuffer& input,
+    const std::vector<cl_event>& waitList,
+    std::vector<cl_event>& outputEvents
+  );
+  bool writeToBufferAsync(
+    unsigned argumentNumber,
+    const void* input,
+    size_t size,
+    const std::vector<cl_event>& waitList,
+    std::vector<cl_event>& outputEvents
+  );
+  //output points at the bytes read back once outputEvent completes, until releaseReadBacks of the slot.
+  bool readBackAsync(
+    unsigned argumentNumber,
+    size_t size,
+    const std::vector<cl_event>& waitList,
+    const unsigned char*& output,
+    cl_event& outputEvent
+  );
+  //Call once the results read back in the slot are consumed: unmaps the buffers readBackAsync mapped.
+  bool releaseReadBacks(unsigned int slot);
+  //Unmaps enqueued by releaseReadBacks, by slot, until the slot's next commands are enqueued.
+  std::vector<std::vector<cl_event> > pendingUnmaps;
+  std::vector<cl_event> withPendingUnmaps(const std::vector<cl_event>& waitList);
+  //Records the profiling timestamps of the event into profileOfCommands once the command completes.
+  //The command queue profiles its commands: see GPU::initializePlatform.
+  //waitList: the events the command was enqueued after, to tell its dependency wait from its queue wait.
+  void profile(
+    cl_event theEvent, KernelStatistics::CommandKind kind, size_t bytes, const std::vector<cl_event>& waitList
+  );
+  static void CL_CALLBACK profilingTrampoline(cl_event theEvent, cl_int status, void* userData);
+  KernelStatistics getStatistics();
+  //outputEvent completes with the last launch.
+  bool enqueueBatchAsync(
+    unsigned int firstMessageIndex,
+    unsigned int numberOfMessages,
+    unsigned int maxMessagesPerLaunch,
+    const std::vector<cl_event>& waitList,
+    cl_event& outputEvent
+  );
   GPUKernel();
   ~GPUKernel();
   bool SetArguments();
@@ -126,6 +402,9 @@ public:
   static std::string kernelTestBuffer;
   static std::string kernelInitializeMultiplicationContext;
   static std::string kernelInitializeGeneratorContext;
+  //Defined in the programs of the two kernels above; run only on context pools loaded from files.
+  static std::string kernelRelocateMultiplicationContext;
+  static std::string kernelRelocateGeneratorContext;
   static std::string kernelGeneratePublicKey;
   static std::string kernelSign;
   static std::string kernelVerifySignature;
@@ -157,23 +436,47 @@ public:
   unsigned char* bufferGeneratorContext;
   unsigned char* bufferSignature;
 
-  bool flagMultiplicationContextComputed;
-  bool flagGeneratorContextComputed;
-  bool flagMultiplicationContextComputationSTARTED;
-  bool flagGeneratorContextComputationSTARTED;
+  //Set once the context is in its buffer, see CryptoEC256k1GPU::initializeMultiplicationContext.
+  //The warm-up and dispatch threads may both initialize a context: its lock lets one of them at a time do so.
+  std::atomic<bool> flagMultiplicationContextComputed;
+  std::atomic<bool> flagGeneratorContextComputed;
+  std::mutex multiplicationContextLock;
+  std::mutex generatorContextLock;
 
 
   std::unordered_map<std::string, std::shared_ptr<GPUKernel> > theKernels;
-  cl_platform_id platformIds[2];
-  cl_uint numberOfPlatforms;
-  cl_device_id allDevices[2];
-  cl_uint numberOfDevices;
+  //Absolute path of the folder of the .cl files, set by initializeKernelsNoBuild.
+  //Kernels are built with absolute paths only: the current folder of the process never changes.
+  std::string kernelFolder;
+  //Absolute path of the folder of the program binary, context and tuning caches,
+  //set by initializeKernelsNoBuild, see resolveCacheRoot. Never derived from kernelFolder:
+  //when the cl folder is not found, kernelFolder falls back to the current folder.
+  std::string cacheRoot;
+  //The cache root given on the command line, cache=<folder>; if empty, resolveCacheRoot
+  //uses $XDG_CACHE_HOME/kanban-gpu, else $HOME/.cache/kanban-gpu.
+  static std::string cacheRootConfigured;
+  //Creates the cache root if needed; returns its absolute path, empty on failure.
+  static std::string resolveCacheRoot();
+  std::vector<cl_device_id> allDevices; //<- every device of theDesiredDeviceType, set by initializePlatform
   cl_device_type theDesiredDeviceType;
+  //Set before initializePlatform to run on a given device, see DeviceManager;
+  //NULL for the first device of theDesiredDeviceType.
+  cl_device_id desiredDeviceId;
   cl_device_id currentDeviceId;
   std::string deviceInfo;
   cl_context context;
   cl_command_queue commandQueue;
   bool flagVerbose;
+  //Set by initializePlatform when the device shares the host's memory:
+  //device buffers are then allocated in host memory and the staging buffers are used in place.
+  bool flagZeroCopy;
+  //Set when desiredDeviceId is a sub-device created by DeviceManager::partition: the GPU releases it.
+  bool flagSubDevice;
+  //Routing rules of a sub-device, see DeviceManager::partitionKernels:
+  //the kernels it serves, all when empty, less the kernels reserved for the other sub-devices of its device.
+  std::vector<std::string> kernelsServed;
+  std::vector<std::string> kernelsNotServed;
+  bool servesKernel(const std::string& kernelName);
   bool flagInitializedPlatform;
   bool flagInitializedKernelsNoBuild;
   bool flagInitializedKernelsFull;
@@ -184,7 +487,32 @@ public:
   bool initializePlatformFull();
   bool initializeKernelsNoBuild();
   bool initializeKernelsFull();
+  bool buildKernels(const std::vector<std::string>& kernelNames);
+  //Tuning files are kept in this folder, relative to the cache root,
+  //one per device name and driver version.
+  static std::string tuningFolder;
+  std::unordered_map<std::string, KernelTuning> tunings;
+  std::string tuningFileName();
+  //Reads the tuning file of the current device, if any, and applies it to the kernels.
+  bool loadTunings();
+  bool storeTunings();
+  //Benchmarks the kernel over a grid of work group sizes, launch sizes and batch sizes,
+  //applies the best configuration and records it in tunings.
+  //runBatch(numberOfMessages, outputSeconds) must compute a batch of that many messages
+  //with the kernel's current configuration and report the time it took.
+  bool autotune(
+    const std::string& kernelName,
+    const std::function<bool(unsigned int numberOfMessages, double& outputSeconds)>& runBatch
+  );
+  void scheduleBuild(const std::string& kernelName, std::unordered_map<std::string, std::shared_future<bool> >& builds);
   bool finish();
+  //The command queue executes out of order: commands are ordered only by their event wait lists.
+  static cl_int enqueueMarker(cl_command_queue queue, const std::vector<cl_event>& waitList, cl_event& outputEvent);
+  static void releaseEvents(std::vector<cl_event>& events);
+  //Runs callback(status) once theEvent completes; status is CL_COMPLETE or a negative error code.
+  //The callback runs on a thread of the OpenCL runtime and must be thread-safe and short.
+  static bool onCompletion(cl_event theEvent, const std::function<void(cl_int)>& callback);
+  static void CL_CALLBACK completionTrampoline(cl_event theEvent, cl_int status, void* userData);
   static std::vector<unsigned char> getUintBytesBigEndian(uint32_t input);
 
   std::string getId();
@@ -208,4 +536,88 @@ public:
   ~GPU();
 };
 
+//Running estimate of the seconds a backend takes for a batch of a kernel:
+//fixedSeconds + secondsPerMessage * number of messages,
+//a least squares fit of the measured batches in which older batches weigh less.
+class CostModel {
+public:
+  //Decayed sums of the fit.
+  double weight;
+  double sumMessages;
+  double sumSeconds;
+  double sumMessagesSquared;
+  double sumMessagesSeconds;
+  double fixedSeconds; //<- launch, transfers and read-back: what a device round trip costs regardless of the batch size
+  double secondsPerMessage;
+  unsigned int numberOfSamples;
+  //Weight of the newest batch.
+  static constexpr double smoothing = 0.2;
+  void record(unsigned int numberOfMessages, double seconds);
+  double predict(unsigned int numberOfMessages) const;
+  CostModel();
+};
+
+//One GPU object, with its own context, command queue, kernels and secp256k1 contexts,
+//per OpenCL device in the box.
+//Splits the batches of a kernel across backends: the devices, in order, and,
+//when the caller counts one more backend, the server's CPU backend after them.
+//The split follows the cost model of each backend for the kernel and the work it has not finished,
+//so that all backends given a share are predicted to finish together:
+//a small batch goes whole to the backend with no fixed cost, the CPU, and the host cores work while the devices do.
+class DeviceManager {
+public:
+  cl_device_type theDesiredDeviceType; //<- initialized to CL_DEVICE_TYPE_ALL
+  std::vector<std::shared_ptr<GPU> > theGPUs;
+  //By kernel name, one per backend.
+  std::unordered_map<std::string, std::vector<CostModel> > costs;
+  //Per backend: predicted seconds of the batches launched on it and not yet recorded, see charge.
+  std::vector<double> outstandingSeconds;
+  //Per backend: latest completion recorded; a batch waits for the batches before it on its backend.
+  std::vector<std::chrono::steady_clock::time_point> lastCompletion;
+  //Sub-device partitioning, applied by initialize to every device that supports it; see parsePartition.
+  //By counts: the compute units of each sub-device, 0 standing for the compute units the others leave.
+  std::vector<unsigned int> partitionComputeUnits;
+  //When non-zero: one sub-device per affinity domain instead, see CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN.
+  cl_device_affinity_domain partitionAffinityDomain;
+  //Routing rules: the kernels sub-device i serves. Sub-devices with no rule serve the kernels no rule names.
+  std::vector<std::vector<std::string> > partitionKernels;
+  //The kernels the server splits across backends, the only ones routing rules may name.
+  static const std::vector<std::string>& routableKernels();
+  //Reads partitionComputeUnits and partitionKernels from, for example,
+  //4:secp256k1_opencl_sign,0
+  //(4 compute units that only sign, the rest for everything else; several kernels are joined with +),
+  //or partitionAffinityDomain from one of numa, l3, l2, l1, next.
+  //Rejects kernels not in routableKernels, and rules on every sub-device that leave one of them to none:
+  //a sub-device builds only the kernels it serves.
+  bool parsePartition(const std::string& description);
+  //Splits the device into sub-devices, as configured above.
+  //Returns false, with no sub-device created, when there is no partitioning or the device does not support it.
+  bool partition(cl_device_id device, std::vector<cl_device_id>& output);
+  //Creates a GPU for every device or sub-device found and initializes its kernels, without building them.
+  bool initialize();
+  //Splits numberOfMessages of the kernel into one count per backend, in backend order.
+  //Devices that do not serve the kernel get none; backends past the devices, such as the CPU backend, serve all kernels.
+  //Only a plan: the backends are charged for the batches actually launched, see charge.
+  void split(
+    const std::string& kernelName,
+    unsigned int numberOfMessages,
+    unsigned int numberOfBackends,
+    std::vector<unsigned int>& outputCounts
+  );
+  //Adds the predicted seconds of a batch launched on the backend to its outstandingSeconds and returns them.
+  double charge(unsigned int backendIndex, const std::string& kernelName, unsigned int numberOfMessages);
+  //predictedSeconds: what charge returned for the batch; released from outstandingSeconds as is,
+  //however the cost model has changed since.
+  //A numberOfMessages of 0, for a failed batch, only releases its charge.
+  void recordBatch(
+    unsigned int backendIndex,
+    const std::string& kernelName,
+    unsigned int numberOfMessages,
+    double predictedSeconds,
+    std::chrono::steady_clock::time_point timeLaunched,
+    std::chrono::steady_clock::time_point timeCompleted
+  );
+  DeviceManager();
+};
+
 #endif
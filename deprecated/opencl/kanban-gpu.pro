@@ -7,6 +7,7 @@ SOURCES += \
     main.cpp \
     gpu.cpp \
     server.cpp \
+    cpu_backend.cpp \
     miscellaneous.cpp \
     test.cpp \
     cl/secp256k1_to_string_methods.cpp \
@@ -20,10 +21,14 @@ LIBS+=-lOpenCL -lstdc++fs -lpthread
 HEADERS += \
     gpu.h \
     server.h \
+    cpu_backend.h \
+    queues.h \
     logging.h \
     miscellaneous.h \
     cl/secp256k1.h \
     cl/secp256k1_cpp.h \
     secp256k1_interface.h \
+    secp256k1_precomputed_tables.h \
+    kernel_sources.h \
     json.h \
     encodings.h
@@ -0,0 +1,19 @@
+#ifndef KERNEL_SOURCES_H_header
+#define KERNEL_SOURCES_H_header
+
+//The makefile runs kernel_sources_generator over cl/*.cl to emit
+//each kernel's source, with its #include "..." files expanded, as a string literal
+//compiled into the binary, and defines MACRO_USE_EMBEDDED_KERNEL_SOURCES.
+//Kernels then load with no file access, from whatever folder the binary runs in,
+//and the expanded source is all the program binary cache needs to hash.
+
+struct EmbeddedKernelSource {
+  const char* name; //<- file name with no extension, equal to the __kernel function name
+  const char* source;
+  unsigned int size;
+};
+
+extern const EmbeddedKernelSource embeddedKernelSources[];
+extern const unsigned int numberOfEmbeddedKernelSources;
+
+#endif // KERNEL_SOURCES_H_header
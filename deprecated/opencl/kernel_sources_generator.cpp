@@ -0,0 +1,141 @@
+// Build-time tool: expands the #include "..." lines of .cl files
+// and writes the results as the string literals declared in kernel_sources.h.
+// Usage: kernel_sources_generator outputFileName.cpp file1.cl file2.cl ...
+// See the makefile.
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+std::string folderOf(const std::string& fileName) {
+  size_t lastSlash = fileName.find_last_of('/');
+  if (lastSlash == std::string::npos) {
+    return ".";
+  }
+  return fileName.substr(0, lastSlash);
+}
+
+std::string baseNameOf(const std::string& fileName) {
+  size_t lastSlash = fileName.find_last_of('/');
+  return lastSlash == std::string::npos ? fileName : fileName.substr(lastSlash + 1);
+}
+
+//Replaces each #include "..." line with the included file, expanded in turn,
+//the way the preprocessor would, without evaluating any other directive:
+//the parametric address space files are included several times on purpose
+//and every copy is expanded. A file already being expanded is not expanded again.
+//#line directives keep the compiler's messages pointing at the original files.
+bool expandIncludes(
+  const std::string& folder, const std::string& fileName, std::vector<std::string>& includeStack, std::string& output
+) {
+  std::ifstream theFile(folder + "/" + fileName);
+  if (!theFile.is_open()) {
+    std::cout << "Failed to open " << folder << "/" << fileName << std::endl;
+    return false;
+  }
+  includeStack.push_back(fileName);
+  std::stringstream lineMarker;
+  lineMarker << "#line 1 \"" << fileName << "\"\n";
+  output += lineMarker.str();
+  std::string line;
+  unsigned int lineNumber = 0;
+  while (std::getline(theFile, line)) {
+    lineNumber ++;
+    size_t start = line.find_first_not_of(" \t");
+    size_t openQuote = std::string::npos;
+    size_t closeQuote = std::string::npos;
+    if (start != std::string::npos && line.compare(start, 8, "#include") == 0) {
+      openQuote = line.find('"', start + 8);
+      closeQuote = openQuote == std::string::npos ? std::string::npos : line.find('"', openQuote + 1);
+    }
+    if (closeQuote == std::string::npos) {
+      output += line;
+      output += "\n";
+      continue;
+    }
+    std::string includedName = line.substr(openQuote + 1, closeQuote - openQuote - 1);
+    if (std::find(includeStack.begin(), includeStack.end(), includedName) == includeStack.end()) {
+      if (!expandIncludes(folder, includedName, includeStack, output)) {
+        return false;
+      }
+    }
+    std::stringstream backMarker;
+    backMarker << "#line " << lineNumber + 1 << " \"" << fileName << "\"\n";
+    output += backMarker.str();
+  }
+  includeStack.pop_back();
+  return true;
+}
+
+//One literal piece per line: no compiler limit on the length of a single piece is reached.
+void writeStringLiteral(std::ostream& output, const std::string& contents) {
+  output << "\n    \"";
+  for (unsigned i = 0; i < contents.size(); i ++) {
+    unsigned char current = contents[i];
+    if (current == '\n') {
+      output << "\\n\"\n    \"";
+    } else if (current == '\\' || current == '"') {
+      output << "\\" << current;
+    } else if (current == '?') {
+      //Not the start of a trigraph.
+      output << "\\?";
+    } else if (current < 32 || current >= 127) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\%03o", current);
+      output << escaped;
+    } else {
+      output << current;
+    }
+  }
+  output << "\"";
+}
+
+bool writeKernelSources(std::ostream& output, const std::vector<std::string>& fileNames) {
+  output << "// Generated by kernel_sources_generator: do not edit.\n";
+  output << "#include \"kernel_sources.h\"\n\n";
+  output << "const EmbeddedKernelSource embeddedKernelSources[] = {\n";
+  for (unsigned i = 0; i < fileNames.size(); i ++) {
+    std::string baseName = baseNameOf(fileNames[i]);
+    size_t extension = baseName.rfind(".cl");
+    if (extension == std::string::npos || extension + 3 != baseName.size()) {
+      std::cout << fileNames[i] << " is not a .cl file. " << std::endl;
+      return false;
+    }
+    std::string expanded;
+    std::vector<std::string> includeStack;
+    if (!expandIncludes(folderOf(fileNames[i]), baseName, includeStack, expanded)) {
+      return false;
+    }
+    output << "  {\n    \"" << baseName.substr(0, extension) << "\",";
+    writeStringLiteral(output, expanded);
+    output << ",\n    " << expanded.size() << "\n  },\n";
+  }
+  output << "};\n";
+  output << "const unsigned int numberOfEmbeddedKernelSources = " << fileNames.size() << ";\n";
+  return true;
+}
+
+int main(int numberOfArguments, char* arguments[]) {
+  if (numberOfArguments < 3) {
+    std::cout << "Usage: " << arguments[0] << " outputFileName.cpp file1.cl file2.cl ..." << std::endl;
+    return - 1;
+  }
+  std::string fileName = arguments[1];
+  std::vector<std::string> inputFileNames(arguments + 2, arguments + numberOfArguments);
+  std::string temporaryFileName = fileName + ".partial";
+  std::ofstream output(temporaryFileName, std::ios::trunc);
+  if (!writeKernelSources(output, inputFileNames)) {
+    return - 1;
+  }
+  output.close();
+  //Never leave partial sources behind for make to pick up.
+  if (!output || std::rename(temporaryFileName.c_str(), fileName.c_str()) != 0) {
+    std::cout << "Failed to write " << fileName << std::endl;
+    return - 1;
+  }
+  return 0;
+}
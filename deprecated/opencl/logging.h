@@ -2,6 +2,10 @@
 #define LOGGING_H_header
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
 
 class Logger
 {
@@ -14,15 +18,36 @@ public:
 
   std::fstream theFile;
   std::string descriptionPrependToLogs;
-  bool flagExtraDescription;
   bool flagDeallocated;
+  //The server logs from several threads: each thread collects its line in its own buffer
+  //and writes it whole, under theMutex, on Logger::endL.
+  std::mutex theMutex;
+  //Lines a thread has not ended with Logger::endL are written when the thread exits,
+  //so that the last words of a short-lived thread, such as a build thread, are not lost.
+  class PendingLines {
+  public:
+    std::unordered_map<Logger*, std::ostringstream> lines;
+    ~PendingLines();
+  };
+  std::ostringstream& currentLine() {
+    static thread_local PendingLines pending;
+    return pending.lines[this];
+  }
+  void writeLine(std::ostringstream& line) {
+    {
+      std::lock_guard<std::mutex> lock(this->theMutex);
+      std::cout << this->descriptionPrependToLogs << line.str() << std::endl;
+      this->theFile << line.str() << "\n";
+      this->theFile.flush();
+    }
+    line.str("");
+  }
   enum logModifiers{ endL};
   friend Logger& operator << (Logger& inputLogger, logModifiers other) {
-    if (other == Logger::endL) {
-      std::cout << std::endl;
-      inputLogger.theFile << "\n";
+    if (other != Logger::endL || inputLogger.flagDeallocated) {
+      return inputLogger;
     }
-    inputLogger.flagExtraDescription = true;
+    inputLogger.writeLine(inputLogger.currentLine());
     return inputLogger;
   }
   template<typename any>
@@ -31,18 +56,11 @@ public:
       std::cout << other << std::endl;
       return inputLogger;
     }
-    if (inputLogger.flagExtraDescription) {
-      inputLogger.flagExtraDescription = false;
-      std::cout << inputLogger.descriptionPrependToLogs;
-    }
-    inputLogger.theFile << other;
-    inputLogger.theFile.flush();
-    std::cout << other;
+    inputLogger.currentLine() << other;
     return inputLogger;
   }
   Logger(const std::string& pathname, const std::string& inputDescriptionPrependToLogs) {
     this->theFile.open(pathname, std::fstream::out | std::fstream::trunc);
-    this->flagExtraDescription = true;
     this->descriptionPrependToLogs = inputDescriptionPrependToLogs;
     this->flagDeallocated = false;
   }
@@ -52,5 +70,17 @@ public:
   }
 };
 
+inline Logger::PendingLines::~PendingLines() {
+  for (
+    std::unordered_map<Logger*, std::ostringstream>::iterator current = this->lines.begin();
+    current != this->lines.end();
+    current ++
+  ) {
+    if (!current->first->flagDeallocated && !current->second.str().empty()) {
+      current->first->writeLine(current->second);
+    }
+  }
+}
+
 #endif // LOGGING_H
 
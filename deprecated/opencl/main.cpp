@@ -31,6 +31,32 @@ int main(int numberOfArguments, char *arguments[]) {
       return result;
     }
   Server theServer;
+  //An argument partition=... splits the devices into sub-devices, see DeviceManager::parsePartition,
+  //for example: kanban-gpu binary partition=4:secp256k1_opencl_sign,0
+  //An argument cache=<folder> sets the folder of the program binary, context and tuning caches,
+  //see GPU::cacheRoot.
+  for (int i = 1; i < numberOfArguments; i ++) {
+    std::string argument = arguments[i];
+    if (argument.compare(0, 6, "cache=") == 0) {
+      GPU::cacheRootConfigured = argument.substr(6);
+      continue;
+    }
+    if (argument.compare(0, 10, "partition=") != 0) {
+      continue;
+    }
+    if (!theServer.devices.parsePartition(argument.substr(10))) {
+      return - 1;
+    }
+  }
+  if (numberOfArguments >= 2)
+    if (((std::string) arguments[1]) == "autotune") {
+      //Writes the tuning file of the device, see Server::Autotune.
+      return theServer.Autotune() ? 0 : - 1;
+    }
+  if (numberOfArguments >= 2)
+    if (((std::string) arguments[1]) == "binary") {
+      theServer.flagBinaryProtocol = true;
+    }
   if (!theServer.Run()) {
     logServer << "Graceful exit with errors. " << Logger::endL;
     return - 1;
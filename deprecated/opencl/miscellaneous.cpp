@@ -2,6 +2,14 @@
 #include <sstream>
 #include <iomanip>
 #include <experimental/filesystem>
+#include <fstream>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <vector>
 
 std::string Miscellaneous::toStringHex(const std::string& other) {
   std::stringstream out;
@@ -26,6 +34,17 @@ std::string Miscellaneous::toStringShorten(const std::string& input, int numChar
   return out.str();
 }
 
+std::string Miscellaneous::hashFNV1a64Hex(const std::string& input) {
+  unsigned long long result = 14695981039346656037ULL;
+  for (unsigned i = 0; i < input.size(); i ++) {
+    result ^= (unsigned char) input[i];
+    result *= 1099511628211ULL;
+  }
+  std::stringstream out;
+  out << std::hex << std::setfill('0') << std::setw(16) << result;
+  return out.str();
+}
+
 void OSWrapper::setCurrentPath(const std::string& desiredPath){
   std::experimental::filesystem::current_path(desiredPath);
 }
@@ -34,6 +53,82 @@ std::string OSWrapper::getCurrentPath(){
   return std::experimental::filesystem::current_path();
 }
 
+bool OSWrapper::createDirectories(const std::string& path) {
+  std::error_code errorCode;
+  std::experimental::filesystem::create_directories(path, errorCode);
+  return !errorCode && std::experimental::filesystem::is_directory(path, errorCode);
+}
+
+std::string OSWrapper::canonicalPath(const std::string& path) {
+  std::error_code errorCode;
+  std::experimental::filesystem::path result = std::experimental::filesystem::canonical(path, errorCode);
+  if (errorCode) {
+    return "";
+  }
+  return result.string();
+}
+
+bool OSWrapper::writeFileAtomically(const std::string& fileName, const unsigned char* data, size_t size) {
+  //A temporary file of its own per writer, in the folder of the target so that the rename stays atomic:
+  //concurrent writers of one target, in this process or another, never write into each other's files.
+  std::vector<char> temporaryFileName(fileName.begin(), fileName.end());
+  std::string suffix = ".XXXXXX";
+  temporaryFileName.insert(temporaryFileName.end(), suffix.begin(), suffix.end());
+  temporaryFileName.push_back('\0');
+  int fileDescriptor = mkstemp(temporaryFileName.data());
+  if (fileDescriptor < 0) {
+    return false;
+  }
+  //mkstemp creates the file readable by its owner only.
+  bool success = fchmod(fileDescriptor, 0644) == 0;
+  size_t written = 0;
+  while (success && written < size) {
+    ssize_t numberOfBytesWritten = write(fileDescriptor, data + written, size - written);
+    if (numberOfBytesWritten < 0 && errno == EINTR) {
+      continue;
+    }
+    success = numberOfBytesWritten > 0;
+    if (success) {
+      written += numberOfBytesWritten;
+    }
+  }
+  success = close(fileDescriptor) == 0 && success;
+  if (!success || std::rename(temporaryFileName.data(), fileName.c_str()) != 0) {
+    unlink(temporaryFileName.data());
+    return false;
+  }
+  return true;
+}
+
+bool OSWrapper::mapFileReadOnly(const std::string& fileName, const unsigned char*& output, size_t& outputSize) {
+  output = nullptr;
+  outputSize = 0;
+  int fileDescriptor = open(fileName.c_str(), O_RDONLY);
+  if (fileDescriptor < 0) {
+    return false;
+  }
+  struct stat fileStatus;
+  if (fstat(fileDescriptor, &fileStatus) != 0 || fileStatus.st_size <= 0) {
+    close(fileDescriptor);
+    return false;
+  }
+  void* mapped = mmap(nullptr, fileStatus.st_size, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+  //The mapping stays valid after the file descriptor is closed.
+  close(fileDescriptor);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  output = (const unsigned char*) mapped;
+  outputSize = fileStatus.st_size;
+  return true;
+}
+
+void OSWrapper::unmapFile(const unsigned char* mapped, size_t size) {
+  if (mapped != nullptr) {
+    munmap((void*) mapped, size);
+  }
+}
+
 StateMaintainerFolderLocation::StateMaintainerFolderLocation(Logger& inputlogFile) {
   this->ambientDirectoryAtObjectCreation = OSWrapper::getCurrentPath();
   this->logFile = &inputlogFile;
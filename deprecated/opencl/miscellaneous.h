@@ -24,6 +24,15 @@ class OSWrapper {
 public:
   static void setCurrentPath(const std::string& path);
   static std::string getCurrentPath();
+  static bool createDirectories(const std::string& path);
+  //Absolute path with no symbolic links or dot segments; empty if the path does not exist.
+  static std::string canonicalPath(const std::string& path);
+  //Writes to a temporary file, then renames it into place,
+  //so that readers never see a partial file.
+  static bool writeFileAtomically(const std::string& fileName, const unsigned char* data, size_t size);
+  //Maps the whole file read-only and shared: processes mapping the same file share its pages.
+  static bool mapFileReadOnly(const std::string& fileName, const unsigned char*& output, size_t& outputSize);
+  static void unmapFile(const unsigned char* mapped, size_t size);
 };
 
 class Miscellaneous
@@ -31,6 +40,8 @@ class Miscellaneous
 public:
   static std::string toStringHex(const std::string& other);
   static std::string toStringShorten(const std::string& input, int numCharactersToRetain);
+  //64-bit FNV-1a, as 16 hex digits. Not cryptographic: for cache keys only.
+  static std::string hashFNV1a64Hex(const std::string& input);
 };
 
 
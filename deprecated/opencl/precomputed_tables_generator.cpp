@@ -0,0 +1,86 @@
+// Build-time tool: computes the secp256k1 contexts with the C++ build of the openCL code
+// and writes them as the constant arrays declared in secp256k1_precomputed_tables.h.
+// Usage: precomputed_tables_generator outputFileName.cpp
+// See the makefile.
+
+#include "logging.h"
+#include "cl/secp256k1_cpp.h"
+#include <fstream>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+Logger logGPU("../logfiles/logGPU.txt", "[GPU] ");
+
+bool writeTable(
+  std::ostream& output, const std::string& name, const unsigned char* data, unsigned int size
+) {
+  if (size == 0) {
+    std::cout << "Table " << name << " is empty. " << std::endl;
+    return false;
+  }
+  output << "alignas(64) const unsigned char " << name << "[" << size << "] = {";
+  for (unsigned i = 0; i < size; i ++) {
+    if (i % 24 == 0) {
+      output << "\n ";
+    }
+    output << " " << (int) data[i] << ",";
+  }
+  output << "\n};\n";
+  output << "const unsigned int " << name << "_size = " << size << ";\n\n";
+  return true;
+}
+
+//The table of a context starts at the position stored in output 1 of its memory pool.
+bool writeContextTables(std::ostream& output) {
+  std::vector<unsigned char> generatorPool(MACRO_MEMORY_POOL_SIZE_GeneratorContext);
+  secp256k1_opencl_compute_generator_context(generatorPool.data());
+  std::vector<unsigned char> multiplicationPool(MACRO_MEMORY_POOL_SIZE_MultiplicationContext);
+  secp256k1_opencl_compute_multiplication_context(multiplicationPool.data());
+
+  unsigned int generatorStruct = memoryPool_read_uint_fromOutput(0, generatorPool.data());
+  unsigned int generatorPrec = memoryPool_read_uint_fromOutput(1, generatorPool.data());
+  unsigned int multiplicationPreG = memoryPool_read_uint_fromOutput(1, multiplicationPool.data());
+  unsigned int sizeGeneratorStruct = sizeof(secp256k1_ecmult_gen_context);
+  unsigned int sizeGeneratorPrec = 16 * 64 * sizeof(secp256k1_ge_storage);
+  unsigned int sizeMultiplicationPreG = ECMULT_TABLE_SIZE(WINDOW_G) * sizeof(secp256k1_ge_storage);
+  if (
+    generatorStruct == 0 || generatorPrec == 0 || multiplicationPreG == 0 ||
+    generatorStruct + sizeGeneratorStruct > generatorPool.size() ||
+    generatorPrec + sizeGeneratorPrec > generatorPool.size() ||
+    multiplicationPreG + sizeMultiplicationPreG > multiplicationPool.size()
+  ) {
+    std::cout << "Context computation did not record its tables. " << std::endl;
+    return false;
+  }
+  output << "// Generated by precomputed_tables_generator: do not edit.\n";
+  output << "#include \"secp256k1_precomputed_tables.h\"\n\n";
+  output << "const unsigned int secp256k1_precomputed_window_g = " << WINDOW_G << ";\n\n";
+  return
+    writeTable(output, "secp256k1_precomputed_generator_context", &generatorPool[generatorStruct], sizeGeneratorStruct) &&
+    writeTable(output, "secp256k1_precomputed_generator_prec", &generatorPool[generatorPrec], sizeGeneratorPrec) &&
+    writeTable(
+      output, "secp256k1_precomputed_multiplication_pre_g", &multiplicationPool[multiplicationPreG], sizeMultiplicationPreG
+    );
+}
+
+int main(int numberOfArguments, char* arguments[]) {
+  if (numberOfArguments != 2) {
+    std::cout << "Usage: " << arguments[0] << " outputFileName.cpp" << std::endl;
+    return - 1;
+  }
+  std::string fileName = arguments[1];
+  std::string temporaryFileName = fileName + ".partial";
+  std::ofstream output(temporaryFileName, std::ios::trunc);
+  if (!writeContextTables(output)) {
+    return - 1;
+  }
+  output.close();
+  //Never leave a partial table behind for make to pick up.
+  if (!output || std::rename(temporaryFileName.c_str(), fileName.c_str()) != 0) {
+    std::cout << "Failed to write " << fileName << std::endl;
+    return - 1;
+  }
+  return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef QUEUES_H_header
+#define QUEUES_H_header
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+//Bounded single-producer, single-consumer ring buffer.
+//Exactly one thread may push and exactly one thread may pop.
+//push and pop never block and never take a lock:
+//they return false when the queue is full, respectively empty.
+//pushWait and popWait back off (spin, then yield, then sleep) until they succeed
+//or the stop flag is raised.
+template <typename Element>
+class BoundedQueue {
+  std::vector<Element> slots;
+  //Monotonic counters; slot index = counter % capacity.
+  std::atomic<unsigned long long> head; //<- written by the consumer only
+  std::atomic<unsigned long long> tail; //<- written by the producer only
+public:
+  static void backOff(unsigned int& attempt) {
+    attempt ++;
+    if (attempt < 64) {
+      return;
+    }
+    if (attempt < 128) {
+      std::this_thread::yield();
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  BoundedQueue(unsigned int capacity): slots(capacity), head(0), tail(0) {
+  }
+  unsigned int capacity() const {
+    return this->slots.size();
+  }
+  //Approximate when called concurrently with push or pop.
+  unsigned int size() const {
+    return (unsigned int) (this->tail.load(std::memory_order_acquire) - this->head.load(std::memory_order_acquire));
+  }
+  //Moves input into the queue on success.
+  bool push(Element& input) {
+    unsigned long long currentTail = this->tail.load(std::memory_order_relaxed);
+    if (currentTail - this->head.load(std::memory_order_acquire) >= this->slots.size()) {
+      return false;
+    }
+    this->slots[currentTail % this->slots.size()] = std::move(input);
+    this->tail.store(currentTail + 1, std::memory_order_release);
+    return true;
+  }
+  bool pop(Element& output) {
+    unsigned long long currentHead = this->head.load(std::memory_order_relaxed);
+    if (currentHead == this->tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    output = std::move(this->slots[currentHead % this->slots.size()]);
+    this->head.store(currentHead + 1, std::memory_order_release);
+    return true;
+  }
+  //Returns false if flagStop was raised before there was room.
+  bool pushWait(Element& input, const std::atomic<bool>& flagStop) {
+    unsigned int attempt = 0;
+    while (!this->push(input)) {
+      if (flagStop.load()) {
+        return false;
+      }
+      BoundedQueue::backOff(attempt);
+    }
+    return true;
+  }
+  //Returns false only if flagStop was raised and the queue is drained.
+  bool popWait(Element& output, const std::atomic<bool>& flagStop) {
+    unsigned int attempt = 0;
+    while (!this->pop(output)) {
+      if (flagStop.load()) {
+        return this->pop(output);
+      }
+      BoundedQueue::backOff(attempt);
+    }
+    return true;
+  }
+};
+
+#endif // QUEUES_H_header
@@ -1,6 +1,11 @@
 #include "secp256k1_interface.h"
 #include "cl/secp256k1_cpp.h"
 #include "logging.h"
+#include "miscellaneous.h"
+#ifdef MACRO_USE_PRECOMPUTED_TABLES
+#include "secp256k1_precomputed_tables.h"
+#endif
+#include <algorithm>
 
 extern Logger logGPU;
 
@@ -28,7 +33,11 @@ bool CryptoEC256k1::computeMultiplicationContext(unsigned char* outputMemoryPool
 }
 
 bool CryptoEC256k1::computeMultiplicationContextDefaultBuffers() {
+#ifdef MACRO_USE_PRECOMPUTED_TABLES
+  return CryptoEC256k1::loadPrecomputedMultiplicationContext(CryptoEC256k1::bufferMultiplicationContext);
+#else
   return CryptoEC256k1::computeMultiplicationContext(CryptoEC256k1::bufferMultiplicationContext);
+#endif
 }
 
 bool CryptoEC256k1::computeGeneratorContext(unsigned char* outputMemoryPool) {
@@ -38,62 +47,230 @@ bool CryptoEC256k1::computeGeneratorContext(unsigned char* outputMemoryPool) {
 }
 
 bool CryptoEC256k1::computeGeneratorContextDefaultBuffers() {
+#ifdef MACRO_USE_PRECOMPUTED_TABLES
+  return CryptoEC256k1::loadPrecomputedGeneratorContext(CryptoEC256k1::bufferGeneratorContext);
+#else
   return CryptoEC256k1::computeGeneratorContext(CryptoEC256k1::bufferGeneratorContext);
+#endif
 }
 
+#ifdef MACRO_USE_PRECOMPUTED_TABLES
+//As memoryPool_initialize, without zeroing the pool beyond its error log.
+static void memoryPool_initializeZeroLogOnly(unsigned int totalSize, unsigned char* memoryPool) {
+  memoryPool_initializeNoZeroingNoLog(totalSize, memoryPool);
+  unsigned char* errorLog = (unsigned char*) checked_malloc(MACRO_MessageLogSize, memoryPool);
+  std::fill(errorLog, errorLog + MACRO_MessageLogSize, 0);
+}
+
+//The pools below leave output 1 at 0: their tables are outside the pool
+//and memoryPool_relocate_*Context leave the stored pointer as is.
+bool CryptoEC256k1::loadPrecomputedMultiplicationContext(unsigned char* outputMemoryPool) {
+  if (
+    secp256k1_precomputed_window_g != WINDOW_G ||
+    secp256k1_precomputed_multiplication_pre_g_size != ECMULT_TABLE_SIZE(WINDOW_G) * sizeof_secp256k1_ge_storage()
+  ) {
+    logGPU << "Precomputed multiplication table does not match WINDOW_G: please rebuild. " << Logger::endL;
+    return false;
+  }
+  memoryPool_initializeZeroLogOnly(GPU::memoryMultiplicationContext - 100, outputMemoryPool);
+  memoryPool_writeCurrentSizeAsOutput(0, outputMemoryPool);
+  secp256k1_ecmult_context* multiplicationContext = (secp256k1_ecmult_context*) checked_malloc(
+    sizeof_secp256k1_ecmult_context(), outputMemoryPool
+  );
+  //Never written through: the C++ build uses the table read-only.
+  multiplicationContext->pre_g = (secp256k1_ge_storage(*)[]) secp256k1_precomputed_multiplication_pre_g;
+  return true;
+}
+
+bool CryptoEC256k1::loadPrecomputedGeneratorContext(unsigned char* outputMemoryPool) {
+  if (
+    secp256k1_precomputed_generator_context_size != sizeof_secp256k1_ecmult_gen_context() ||
+    secp256k1_precomputed_generator_prec_size != 16 * 64 * sizeof_secp256k1_ge_storage()
+  ) {
+    logGPU << "Precomputed generator table does not match this build: please rebuild. " << Logger::endL;
+    return false;
+  }
+  memoryPool_initializeZeroLogOnly(GPU::memoryGeneratorContext - 100, outputMemoryPool);
+  memoryPool_writeCurrentSizeAsOutput(0, outputMemoryPool);
+  unsigned char* generatorContextBytes = (unsigned char*) checked_malloc(
+    sizeof_secp256k1_ecmult_gen_context(), outputMemoryPool
+  );
+  std::copy(
+    secp256k1_precomputed_generator_context,
+    secp256k1_precomputed_generator_context + secp256k1_precomputed_generator_context_size,
+    generatorContextBytes
+  );
+  secp256k1_ecmult_gen_context* generatorContext = (secp256k1_ecmult_gen_context*) generatorContextBytes;
+  generatorContext->prec = (secp256k1_ge_storage*) secp256k1_precomputed_generator_prec;
+  return true;
+}
+#endif
+
+/* Called by the warm-up thread and, for requests that arrive before the warm-up reaches them,
+ * by the dispatch thread: the second caller waits on the lock for the first to finish.
+ * The context counts as computed only when it was loaded or computed successfully;
+ * after a failure, the next call tries again.
+ */
 bool CryptoEC256k1GPU::initializeMultiplicationContext(GPU& theGPU) {
-  static int numInWait = 0;
-  if (theGPU.flagMultiplicationContextComputed) {
+  if (theGPU.flagMultiplicationContextComputed.load()) {
     return true;
   }
-  //This function should run only once.
-  //The only time we expect to run this code more than once is if
-  //two GPU multiplication initializations are started simultaneously
-  //in separate threads. Currently the C++ driver is single-threaded
-  //(and expected to remain so - openCL is expected to take care of
-  //parallelization). In other words, this
-  //code is here as a reminder of what needs to be done if we
-  //decide to go multi-threaded (not expected to happen).
-  if (theGPU.flagMultiplicationContextComputationSTARTED) {
-    numInWait ++;
-    int currentIndex = numInWait;
-    logGPU << "Kernel " << currentIndex << " is waiting for multiplication initialization";
-    while (theGPU.flagMultiplicationContextComputationSTARTED) {
-      //infinite loop until multiplication context computation is done
+  std::lock_guard<std::mutex> lock(theGPU.multiplicationContextLock);
+  if (theGPU.flagMultiplicationContextComputed.load()) {
+    return true;
+  }
+  if (!theGPU.initializeAllNoBuild()) {
+    return false;
+  }
+  GPUKernel& kernelContext = *theGPU.theKernels[GPU::kernelInitializeMultiplicationContext];
+  bool result = CryptoEC256k1GPU::loadContext(
+    kernelContext, GPU::kernelRelocateMultiplicationContext, theGPU.bufferMultiplicationContext, GPU::memoryMultiplicationContext, theGPU
+  );
+  if (!result) {
+    result = CryptoEC256k1GPU::computeMultiplicationContext(theGPU.bufferMultiplicationContext, theGPU);
+    if (result) {
+      CryptoEC256k1GPU::storeContext(kernelContext, theGPU.bufferMultiplicationContext);
     }
-    logGPU << "Kernel " << currentIndex << " done waiting. ";
-    return theGPU.flagMultiplicationContextComputed;
   }
-  theGPU.flagMultiplicationContextComputationSTARTED = true;
-  bool result = CryptoEC256k1GPU::computeMultiplicationContext(theGPU.bufferMultiplicationContext, theGPU);
-  theGPU.flagMultiplicationContextComputed = true;
+  theGPU.flagMultiplicationContextComputed.store(result);
   return result;
 }
 
+//See initializeMultiplicationContext.
 bool CryptoEC256k1GPU::initializeGeneratorContext(GPU& theGPU) {
-  static int numInWait = 0;
-  if (theGPU.flagGeneratorContextComputed) {
+  if (theGPU.flagGeneratorContextComputed.load()) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lock(theGPU.generatorContextLock);
+  if (theGPU.flagGeneratorContextComputed.load()) {
     return true;
   }
-  //This function should run only once.
-  //Comments similar to those in initializeMultiplicationContext
-  //apply.
-  if (theGPU.flagGeneratorContextComputationSTARTED) {
-    numInWait ++;
-    int currentIndex = numInWait;
-    logGPU << "Kernel " << currentIndex << " is waiting for generator context initialization";
-    while (theGPU.flagGeneratorContextComputationSTARTED) {
-      //infinite loop until generator context computation is done
+  if (!theGPU.initializeAllNoBuild()) {
+    return false;
+  }
+  GPUKernel& kernelContext = *theGPU.theKernels[GPU::kernelInitializeGeneratorContext];
+  bool result = CryptoEC256k1GPU::loadContext(
+    kernelContext, GPU::kernelRelocateGeneratorContext, theGPU.bufferGeneratorContext, GPU::memoryGeneratorContext, theGPU
+  );
+  if (!result) {
+    result = CryptoEC256k1GPU::computeGeneratorContext(theGPU.bufferGeneratorContext, theGPU);
+    if (result) {
+      CryptoEC256k1GPU::storeContext(kernelContext, theGPU.bufferGeneratorContext);
     }
-    logGPU << "Kernel " << currentIndex << " done waiting. ";
-    return theGPU.flagGeneratorContextComputed;
   }
-  theGPU.flagGeneratorContextComputationSTARTED = true;
-  bool result = CryptoEC256k1GPU::computeGeneratorContext(theGPU.bufferGeneratorContext, theGPU);
-  theGPU.flagGeneratorContextComputed = true;
+  theGPU.flagGeneratorContextComputed.store(result);
   return result;
 }
 
+std::string CryptoEC256k1GPU::contextFileName(GPUKernel& contextKernel) {
+  std::string result = contextKernel.programBinaryFileName;
+  std::string binaryExtension = ".bin";
+  if (result.size() > binaryExtension.size()) {
+    result.resize(result.size() - binaryExtension.size());
+  }
+  return result + ".context";
+}
+
+bool CryptoEC256k1GPU::isValidContext(const unsigned char* memoryPool, size_t size, unsigned int maximumPoolSize) {
+  if (size < memoryPool_readNumberReservedBytesIncludingLog() || size > maximumPoolSize) {
+    return false;
+  }
+  //The context kernels initialize their pools 100 bytes short of the buffer size.
+  if (memoryPool_readMaxPoolSize(memoryPool) != maximumPoolSize - 100) {
+    return false;
+  }
+  if (memoryPool_readPoolSize(memoryPool) != size) {
+    return false;
+  }
+  for (int i = 0; i < 2; i ++) {
+    unsigned int position = memoryPool_read_uint_fromOutput(i, memoryPool);
+    if (position == 0 || position >= size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CryptoEC256k1GPU::loadContext(
+  GPUKernel& contextKernel,
+  const std::string& relocationKernel,
+  unsigned char* outputMemoryPool,
+  unsigned int maximumPoolSize,
+  GPU& theGPU
+) {
+  //Builds the kernel only to create its buffers and cache key; the kernel is not run.
+  if (!contextKernel.build()) {
+    return false;
+  }
+  std::string fileName = CryptoEC256k1GPU::contextFileName(contextKernel);
+  const unsigned char* mapped = nullptr;
+  size_t size = 0;
+  if (!OSWrapper::mapFileReadOnly(fileName, mapped, size)) {
+    return false;
+  }
+  if (!CryptoEC256k1GPU::isValidContext(mapped, size, maximumPoolSize)) {
+    logGPU << Logger::colorYellow << "Ignoring invalid context file " << fileName << ". " << Logger::colorNormal << Logger::endL;
+    OSWrapper::unmapFile(mapped, size);
+    return false;
+  }
+  cl_int ret = clEnqueueWriteBuffer(
+    theGPU.commandQueue,
+    contextKernel.getOutput(0)->theMemory,
+    CL_TRUE,
+    0,
+    size,
+    mapped,
+    0,
+    NULL,
+    NULL
+  );
+  if (ret == CL_SUCCESS) {
+    std::copy(mapped, mapped + size, outputMemoryPool);
+  }
+  OSWrapper::unmapFile(mapped, size);
+  if (ret != CL_SUCCESS) {
+    logGPU << "Failed to upload context file " << fileName << ". Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  if (!CryptoEC256k1GPU::relocateContext(contextKernel, relocationKernel, theGPU)) {
+    return false;
+  }
+  logGPU << "Context loaded from " << fileName << ", " << size << " bytes. " << Logger::endL;
+  return true;
+}
+
+bool CryptoEC256k1GPU::relocateContext(GPUKernel& contextKernel, const std::string& relocationKernel, GPU& theGPU) {
+  cl_int ret = CL_SUCCESS;
+  cl_kernel kernel = clCreateKernel(contextKernel.program, relocationKernel.c_str(), &ret);
+  if (ret != CL_SUCCESS) {
+    logGPU << "Failed to create kernel " << relocationKernel << ". Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*) &contextKernel.getOutput(0)->theMemory);
+  size_t oneWorkItem = 1;
+  if (ret == CL_SUCCESS) {
+    ret = clEnqueueNDRangeKernel(theGPU.commandQueue, kernel, 1, NULL, &oneWorkItem, &oneWorkItem, 0, NULL, NULL);
+  }
+  clReleaseKernel(kernel);
+  if (ret != CL_SUCCESS) {
+    logGPU << "Failed to run kernel " << relocationKernel << ". Return code: " << ret << ". " << Logger::endL;
+    return false;
+  }
+  return theGPU.finish();
+}
+
+bool CryptoEC256k1GPU::storeContext(GPUKernel& contextKernel, const unsigned char* memoryPool) {
+  std::string fileName = CryptoEC256k1GPU::contextFileName(contextKernel);
+  unsigned int size = memoryPool_readPoolSize(memoryPool);
+  std::string folder = fileName.substr(0, fileName.find_last_of('/'));
+  if (!OSWrapper::createDirectories(folder) || !OSWrapper::writeFileAtomically(fileName, memoryPool, size)) {
+    logGPU << "Failed to write context file " << fileName << ". " << Logger::endL;
+    return false;
+  }
+  logGPU << "Context stored in " << fileName << ", " << size << " bytes. " << Logger::endL;
+  return true;
+}
+
 bool CryptoEC256k1GPU::testSuite1BasicOperationsDefaultBuffers(GPU& theGPU) {
   return CryptoEC256k1GPU::testSuite1BasicOperations(theGPU.bufferTestSuite1BasicOperations, theGPU);
 }
@@ -275,21 +452,8 @@ bool CryptoEC256k1GPU::signMessageDefaultBuffers(
   kernelSign->writeToBuffer(2, outputInputNonce, 32);
   kernelSign->writeToBuffer(3, inputSecretKey, 32);
   kernelSign->writeToBuffer(4, inputMessage, 32);
-  kernelSign->writeMessageIndex(inputMessageIndex);
   logGPU << "DEBUG: Got to signature start." << Logger::endL;
-  cl_int ret = clEnqueueNDRangeKernel(
-    theGPU.commandQueue,
-    kernelSign->kernel,
-    1,
-    NULL,
-    kernelSign->global_item_size,
-    kernelSign->local_item_size,
-    0,
-    NULL,
-    NULL
-  );
-  if (ret != CL_SUCCESS) {
-    logGPU << "Failed to enqueue kernel. Return code: " << ret << ". " << Logger::endL;
+  if (!kernelSign->enqueueBatch(inputMessageIndex, 1, 0)) {
     return false;
   }
   if (!theGPU.finish()) {
@@ -299,7 +463,7 @@ bool CryptoEC256k1GPU::signMessageDefaultBuffers(
   unsigned char outputSizeBuffer[4];
 
   logGPU << "DEBUG: enqueued output size. " << Logger::endL;
-  ret = clEnqueueReadBuffer(
+  cl_int ret = clEnqueueReadBuffer(
     theGPU.commandQueue,
     resultSignatureSize,
     CL_TRUE,
@@ -351,21 +515,11 @@ bool CryptoEC256k1GPU::generatePublicKeyDefaultBuffers(
   if (!kernelGeneratePublicKey->build()) {
     return false;
   }
-  kernelGeneratePublicKey->writeToBuffer(2, inputSecretKey, 32);
+  unsigned char compressionFlag = 0;
+  kernelGeneratePublicKey->writeToBuffer(3, inputSecretKey, 32);
+  kernelGeneratePublicKey->writeToBuffer(4, &compressionFlag, 1);
   logGPU << "DEBUG: Got to generate public key start." << Logger::endL;
-  cl_int ret = clEnqueueNDRangeKernel(
-    theGPU.commandQueue,
-    kernelGeneratePublicKey->kernel,
-    1,
-    NULL,
-    kernelGeneratePublicKey->global_item_size,
-    kernelGeneratePublicKey->local_item_size,
-    0,
-    NULL,
-    NULL
-  );
-  if (ret != CL_SUCCESS) {
-    logGPU << "Failed to enqueue kernel. Return code: " << ret << ". " << Logger::endL;
+  if (!kernelGeneratePublicKey->enqueueBatch(0, 1, 0)) {
     return false;
   }
   if (!theGPU.finish()) {
@@ -375,7 +529,7 @@ bool CryptoEC256k1GPU::generatePublicKeyDefaultBuffers(
   unsigned char outputSizeBuffer[4];
 
   logGPU << "DEBUG: enqueued output size. " << Logger::endL;
-  ret = clEnqueueReadBuffer(
+  cl_int ret = clEnqueueReadBuffer(
     theGPU.commandQueue,
     resultPublicKeySize,
     CL_TRUE,
@@ -462,21 +616,8 @@ bool CryptoEC256k1GPU::verifySignatureDefaultBuffers(
   kernelVerifySignature->writeToBuffer(4, publicKey, publicKeySize);
   kernelVerifySignature->writeToBuffer(5, publicKeySizes, 4);
   kernelVerifySignature->writeToBuffer(6, message, 32);
-  kernelVerifySignature->writeMessageIndex(0);
   logGPU << "DEBUG: Got to generate public key start." << Logger::endL;
-  cl_int ret = clEnqueueNDRangeKernel(
-    theGPU.commandQueue,
-    kernelVerifySignature->kernel,
-    1,
-    NULL,
-    kernelVerifySignature->global_item_size,
-    kernelVerifySignature->local_item_size,
-    0,
-    NULL,
-    NULL
-  );
-  if (ret != CL_SUCCESS) {
-    logGPU << "Failed to enqueue verify signature kernel. Return code: " << ret << ". " << Logger::endL;
+  if (!kernelVerifySignature->enqueueBatch(0, 1, 0)) {
     return false;
   }
   if (!theGPU.finish()) {
@@ -484,7 +625,7 @@ bool CryptoEC256k1GPU::verifySignatureDefaultBuffers(
   }
   cl_mem& resultSignature = kernelVerifySignature->getOutput(0)->theMemory;
   logGPU << "DEBUG: enqueued output size. " << Logger::endL;
-  ret = clEnqueueReadBuffer(
+  cl_int ret = clEnqueueReadBuffer(
     theGPU.commandQueue,
     resultSignature,
     CL_TRUE,
@@ -531,18 +672,14 @@ bool CryptoEC256k1::signMessage(
   unsigned int inputMessageIndex
 ) {
   unsigned char outputSizeBuffer[4];
-  std::vector<unsigned char> theBytes = GPU::getUintBytesBigEndian(inputMessageIndex);
-  secp256k1_opencl_sign(
+  secp256k1_opencl_sign_one_message(
     outputSignature,
     outputSizeBuffer,
     outputInputNonce,
     inputSecretKey,
     inputMessage,
     inputMemoryPoolGeneratorContext_MUST_BE_INITIALIZED,
-    theBytes[0],
-    theBytes[1],
-    theBytes[2],
-    theBytes[3]
+    inputMessageIndex
   );
   *outputSize = memoryPool_read_uint(outputSizeBuffer);
   return true;
@@ -578,15 +715,17 @@ bool CryptoEC256k1::generatePublicKey(
   unsigned char *inputMemoryPoolGeneratorContext_MUST_BE_INITIALIZED
 ) {
   unsigned char outputSizeBuffer[4];
-  secp256k1_opencl_generate_public_key(
+  unsigned char compressionFlag = 0;
+  secp256k1_fe inversionScratch[2];
+  secp256k1_opencl_generate_public_keys_range(
     outputPublicKey,
     outputSizeBuffer,
+    (unsigned char*) inversionScratch,
     inputSecretKey,
+    &compressionFlag,
     inputMemoryPoolGeneratorContext_MUST_BE_INITIALIZED,
     0,
-    0,
-    0,
-    0
+    1
   );
   *outputPublicKeySize = memoryPool_read_uint(outputSizeBuffer);
   return true;
@@ -624,7 +763,7 @@ bool CryptoEC256k1::verifySignature(
   unsigned char publicKeySizes[4];
   memoryPool_write_uint(signatureSize, signatureSizes);
   memoryPool_write_uint(publicKeySize, publicKeySizes);
-  secp256k1_opencl_verify_signature(
+  secp256k1_opencl_verify_signature_one_message(
     output,
     outputMemoryPoolSignature,
     inputSignature,
@@ -633,7 +772,7 @@ bool CryptoEC256k1::verifySignature(
     publicKeySizes,
     message,
     memoryPoolMultiplicationContext_MUST_BE_INITIALIZED,
-    0, 0, 0, 0
+    0
   );
   return true;
 }
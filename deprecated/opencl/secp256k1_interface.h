@@ -12,6 +12,28 @@ public:
   static bool initializeMultiplicationContext(GPU& theGPU);
   static bool initializeGeneratorContext(GPU& theGPU);
 
+  //Context files hold a context's memory pool exactly as computed by contextKernel,
+  //in the program binary cache next to the kernel's binary and keyed like it:
+  //by the kernel's source, build options, device and driver.
+  //The pool refers to its tables by offsets; the one pointer in it is re-derived
+  //once after upload by relocationKernel (see memoryPool_relocate_generatorContext),
+  //so a file computed by one process serves every later process.
+  static std::string contextFileName(GPUKernel& contextKernel);
+  static bool isValidContext(const unsigned char* memoryPool, size_t size, unsigned int maximumPoolSize);
+  //Maps the context file, uploads it to the kernel's output buffer, relocates it there
+  //and copies it to outputMemoryPool.
+  //Returns false on a miss or an invalid file, leaving the caller to compute the context.
+  static bool loadContext(
+    GPUKernel& contextKernel,
+    const std::string& relocationKernel,
+    unsigned char* outputMemoryPool,
+    unsigned int maximumPoolSize,
+    GPU& theGPU
+  );
+  //Runs relocationKernel, found in the program of contextKernel, on one work item.
+  static bool relocateContext(GPUKernel& contextKernel, const std::string& relocationKernel, GPU& theGPU);
+  static bool storeContext(GPUKernel& contextKernel, const unsigned char* memoryPool);
+
   static bool computeMultiplicationContext(unsigned char* outputMemoryPool, GPU& theGPU);
   static bool computeMultiplicationContextDefaultBuffers(GPU& theGPU);
   static bool computeGeneratorContext(unsigned char* outputMemoryPool, GPU& theGPU);
@@ -74,6 +96,11 @@ public:
   static bool computeMultiplicationContextDefaultBuffers();
   static bool computeGeneratorContext(unsigned char* outputMemoryPool);
   static bool computeGeneratorContextDefaultBuffers();
+  //With MACRO_USE_PRECOMPUTED_TABLES, the *DefaultBuffers functions above call these instead:
+  //they write a context whose table pointer refers to the compiled-in tables.
+  //See secp256k1_precomputed_tables.h.
+  static bool loadPrecomputedMultiplicationContext(unsigned char* outputMemoryPool);
+  static bool loadPrecomputedGeneratorContext(unsigned char* outputMemoryPool);
   static bool signMessage(
     unsigned char* outputSignature,
     unsigned int* outputSize,
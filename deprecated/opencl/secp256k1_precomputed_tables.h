@@ -0,0 +1,26 @@
+#ifndef SECP256K1_PRECOMPUTED_TABLES_H_header
+#define SECP256K1_PRECOMPUTED_TABLES_H_header
+
+//C++ build only.
+//The makefile runs precomputed_tables_generator to emit these tables
+//as constant arrays compiled into the binary, and defines MACRO_USE_PRECOMPUTED_TABLES.
+//The tables then sit in the read-only data segment: the C++ contexts
+//need no computation and processes running the same binary share one copy.
+//
+//The tables are byte copies of the contexts computed by the C++ build
+//with the compiler and flags of the build, so they are regenerated with it.
+
+//The secp256k1_ecmult_gen_context struct: blind, initial and a prec pointer to be overwritten.
+extern const unsigned char secp256k1_precomputed_generator_context[];
+extern const unsigned int secp256k1_precomputed_generator_context_size;
+//The 16 * 64 secp256k1_ge_storage elements of secp256k1_ecmult_gen_context::prec.
+extern const unsigned char secp256k1_precomputed_generator_prec[];
+extern const unsigned int secp256k1_precomputed_generator_prec_size;
+//The ECMULT_TABLE_SIZE(WINDOW_G) odd multiples of the generator,
+//secp256k1_ecmult_context::pre_g.
+extern const unsigned char secp256k1_precomputed_multiplication_pre_g[];
+extern const unsigned int secp256k1_precomputed_multiplication_pre_g_size;
+//WINDOW_G at generation time.
+extern const unsigned int secp256k1_precomputed_window_g;
+
+#endif // SECP256K1_PRECOMPUTED_TABLES_H_header
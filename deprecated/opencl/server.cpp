@@ -4,6 +4,7 @@
 #include "secp256k1_interface.h"
 //#include <stdio.h>
 //#include <stdlib.h>
+#include <algorithm>
 #include <string.h>
 #include <unistd.h> // <- file descriptor operations
 //#include <sys/types.h>
@@ -11,6 +12,10 @@
 #include <netinet/in.h> // <- addresses and similar
 #include <netdb.h> //<-addrinfo and related data structures defined here
 #include <assert.h>
+#include <fcntl.h> //<- non-blocking sockets
+#include <errno.h>
+#include <sys/epoll.h>
+#include <poll.h>
 
 Logger logServer("../logfiles/logServer.txt", "[ServerGPU] ");
 
@@ -36,23 +41,43 @@ PipeBasic::~PipeBasic() {
 }
 
 MessagePipeline::MessagePipeline() {
+  this->fileDescriptorOutputData = - 1;
   this->bufferCapacityData = 50000000;
   this->bufferCapacityMetaData = 1000000;
   //Pipe buffers start.
   this->inputMeta = new PipeBasic(this->bufferCapacityMetaData, "metaData");
   this->inputData = new PipeBasic(this->bufferCapacityData, "data");
-  this->bufferOutputGPU = new unsigned char[this->bufferCapacityData];
-  this->bufferOutputGPU_second = new unsigned char[this->bufferCapacityData];
   //Pipe buffers end.
 }
 
-Server::Server() {
+Server::Server():
+  incomingMessages(Server::queueCapacity),
+  outgoingResults(Server::queueCapacity) {
   this->flagInitialized = false;
+  this->currentDevice = 0;
+  this->flagStop = false;
+  this->flagDispatchFinished = false;
+  this->flagBufferFull = false;
+  this->flagIngestPaused = false;
+  this->numberOfRequestsInFlight = 0;
+  this->timeStatisticsLogged = std::chrono::steady_clock::now();
+  this->launchesLogged = 0;
+  this->highWaterMark = 8192;
+  this->lowWaterMark = 4096;
+  this->flagBinaryProtocol = false;
+  this->listeningSocketBinary = - 1;
+  this->epollFileDescriptor = - 1;
+  this->lastConnectionId = 0;
   this->listeningSocketData = - 1;
   this->listeningSocketMetaData = - 1;
   this->portMetaData = - 1;
   this->portData = - 1;
   this->portOutputData = - 1;
+  std::string serverCommands[] = {"SHA256", "testBuffer", "generatePublicKey", "signOneMessage", "verifySignature"};
+  for (unsigned i = 0; i < sizeof(serverCommands) / sizeof(serverCommands[0]); i ++) {
+    this->commandsWarm[serverCommands[i]] = false;
+    this->scheduler.commands[serverCommands[i]].flagOnHold = true;
+  }
 }
 
 MessagePipeline::~MessagePipeline() {
@@ -61,10 +86,6 @@ MessagePipeline::~MessagePipeline() {
   this->inputData = 0;
   delete this->inputMeta;
   this->inputMeta = 0;
-  delete [] this->bufferOutputGPU;
-  this->bufferOutputGPU = 0;
-  delete [] this->bufferOutputGPU_second;
-  this->bufferOutputGPU_second = 0;
   //Pipe buffers end.
   if (this->fileDescriptorOutputData >= 0) {
     close (this->fileDescriptorOutputData);
@@ -73,6 +94,10 @@ MessagePipeline::~MessagePipeline() {
 }
 
 Server::~Server() {
+  if (this->warmUpThread.joinable()) {
+    this->flagStop = true;
+    this->warmUpThread.join();
+  }
   if (this->listeningSocketData >= 0) {
     close(this->listeningSocketData);
   }
@@ -82,19 +107,55 @@ Server::~Server() {
   if (this->listeningSocketOutputData >= 0) {
     close(this->listeningSocketOutputData);
   }
+  if (this->listeningSocketBinary >= 0) {
+    close(this->listeningSocketBinary);
+  }
+  if (this->epollFileDescriptor >= 0) {
+    close(this->epollFileDescriptor);
+  }
+  this->epollFileDescriptor = - 1;
   this->listeningSocketData = - 1;
   this->listeningSocketMetaData = - 1;
   this->listeningSocketOutputData = - 1;
+  this->listeningSocketBinary = - 1;
 }
 
 bool Server::initialize() {
   if (this->flagInitialized) {
     return true;
   }
-  logServer << "Creating GPU ..." << Logger::endL;
-  this->theGPU = std::make_shared<GPU>();
-  logServer << "GPU created, initializing kernels..." << Logger::endL;
-  this->theGPU->initializeKernelsNoBuild();
+  logServer << "Creating a GPU per device and initializing kernels..." << Logger::endL;
+  if (this->devices.initialize()) {
+    this->SelectDevice(0);
+  } else {
+    logServer << "No usable OpenCL device: every request runs on the CPU. " << Logger::endL;
+  }
+  std::string serverKernels[] = {
+    GPU::kernelSHA256, GPU::kernelSign, GPU::kernelTestBuffer, GPU::kernelVerifySignature, GPU::kernelGeneratePublicKey
+  };
+  for (unsigned i = 0; i < this->devices.theGPUs.size(); i ++) {
+    for (unsigned j = 0; j < sizeof(serverKernels) / sizeof(serverKernels[0]); j ++) {
+      this->devices.theGPUs[i]->theKernels[serverKernels[j]]->bufferRingDepth = Server::bufferRingDepth;
+    }
+  }
+  //Batch sizes found by Autotune, if any, summed over the devices the batches are split across;
+  //the scheduler adapts them from there.
+  std::string serverCommands[] = {"SHA256", "testBuffer", "generatePublicKey", "signOneMessage", "verifySignature"};
+  for (unsigned i = 0; i < sizeof(serverCommands) / sizeof(serverCommands[0]); i ++) {
+    unsigned int tunedBatchSize = 0;
+    std::string kernelName = Server::KernelOfCommand(serverCommands[i]);
+    for (unsigned j = 0; j < this->devices.theGPUs.size(); j ++) {
+      if (this->devices.theGPUs[j]->servesKernel(kernelName)) {
+        tunedBatchSize += this->devices.theGPUs[j]->theKernels[kernelName]->tuning.batchSize;
+      }
+    }
+    if (tunedBatchSize != 0) {
+      this->scheduler.commands[serverCommands[i]].batchSize = std::max(
+        this->scheduler.minimumBatchSize, std::min(this->scheduler.maximumBatchSize, tunedBatchSize)
+      );
+    }
+  }
+  this->warmUpThread = std::thread(&Server::RunWarmUp, this);
   logServer << "Kernels initialized, initializing ports..." << Logger::endL;
   if (!this->initializePorts()) {
     return false;
@@ -103,6 +164,10 @@ bool Server::initialize() {
   if (!this->listenAll()) {
     return false;
   }
+  if (this->flagBinaryProtocol) {
+    //Binary protocol clients are accepted by the event loop, see RunOnceEventLoop.
+    return this->initializeEventLoop();
+  }
   if (!this->acceptAll()) {
     return false;
   }
@@ -110,18 +175,405 @@ bool Server::initialize() {
   return true;
 }
 
+/* The server runs as three threads connected by BoundedQueue's:
+ * the ingest thread reads and parses requests (RunIngest),
+ * the calling thread owns the OpenCL queue and dispatches batches (RunOnce),
+ * and the writer thread sends the results (RunWriter).
+ * This way packet N + 1 is parsed while packet N computes and
+ * the results of packet N - 1 are being written.
+ */
 bool Server::Run() {
   if (!this->initialize()) {
     return false;
   }
+  this->flagStop = false;
+  this->flagDispatchFinished = false;
+  std::thread ingestThread(&Server::RunIngest, this);
+  std::thread writerThread(&Server::RunWriter, this);
   while (this->RunOnce()) {
   }
+  this->flagStop = true;
+  this->flagDispatchFinished = true;
+  if (!this->flagBinaryProtocol) {
+    //Unblock the ingest thread if it waits in read.
+    shutdown(this->thePipe.inputMeta->fileDescriptor, SHUT_RDWR);
+    shutdown(this->thePipe.inputData->fileDescriptor, SHUT_RDWR);
+  }
+  ingestThread.join();
+  writerThread.join();
+  return false;
+}
+
+/* Builds the kernels and computes the contexts of the server commands so that no request pays for them:
+ * first all kernels of all devices at once, see GPU::buildKernels,
+ * then the contexts, one command after the other, on all devices at once.
+ * A command is warm once it is warm on every device.
+ * Requests of a command that is not warm yet are held by the scheduler, see BatchScheduler::CommandBatches::flagOnHold.
+ */
+void Server::RunWarmUp() {
+  auto timeStart = std::chrono::steady_clock::now();
+  //Loads the contexts of the CPU backend and starts its workers, while the kernels build.
+  std::future<bool> cpuReady = std::async(std::launch::async, [this]() {
+    return this->cpu.initialize(0);
+  });
+  std::vector<std::future<bool> > builds;
+  for (unsigned i = 0; i < this->devices.theGPUs.size(); i ++) {
+    GPU* current = this->devices.theGPUs[i].get();
+    builds.push_back(std::async(std::launch::async, [current]() {
+      std::string serverKernels[] = {
+        GPU::kernelSHA256, GPU::kernelTestBuffer, GPU::kernelGeneratePublicKey, GPU::kernelSign, GPU::kernelVerifySignature
+      };
+      //A sub-device builds only the kernels its routing rules send to it, see DeviceManager::initialize.
+      std::vector<std::string> served;
+      for (unsigned j = 0; j < sizeof(serverKernels) / sizeof(serverKernels[0]); j ++) {
+        if (current->servesKernel(serverKernels[j])) {
+          served.push_back(serverKernels[j]);
+        }
+      }
+      return current->buildKernels(served);
+    }));
+  }
+  for (unsigned i = 0; i < builds.size(); i ++) {
+    //Failures are reported per command below.
+    builds[i].get();
+  }
+  if (!cpuReady.get()) {
+    logServer << Logger::colorRed << "Failed to initialize the CPU backend. " << Logger::colorNormal << Logger::endL;
+  }
+  //The cheap kernels first; the contexts take the longest.
+  std::string commands[] = {"SHA256", "testBuffer", "generatePublicKey", "signOneMessage", "verifySignature"};
+  for (unsigned i = 0; i < sizeof(commands) / sizeof(commands[0]); i ++) {
+    if (this->flagStop.load()) {
+      logServer << "Warm-up interrupted before " << commands[i] << ". " << Logger::endL;
+      return;
+    }
+    std::vector<std::future<bool> > warmUps;
+    for (unsigned j = 0; j < this->devices.theGPUs.size(); j ++) {
+      GPU* current = this->devices.theGPUs[j].get();
+      const std::string& command = commands[i];
+      if (!current->servesKernel(Server::KernelOfCommand(command))) {
+        continue;
+      }
+      warmUps.push_back(std::async(std::launch::async, [this, current, &command]() {
+        return this->WarmUpCommand(command, *current);
+      }));
+    }
+    bool success = true;
+    for (unsigned j = 0; j < warmUps.size(); j ++) {
+      success = warmUps[j].get() && success;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeStart).count();
+    if (success) {
+      logServer << Logger::colorGreen << commands[i] << " ready after " << seconds << " second(s). "
+      << Logger::colorNormal << Logger::endL;
+    } else {
+      //Its requests are released all the same: each batch of them retries the initialization,
+      //see CryptoEC256k1GPU::initializeGeneratorContext, and fails if it fails again.
+      logServer << Logger::colorRed << "Failed to warm up " << commands[i] << " after " << seconds << " second(s). "
+      << Logger::colorNormal << Logger::endL;
+    }
+    this->commandsWarm[commands[i]].store(true, std::memory_order_release);
+  }
+}
+
+bool Server::WarmUpCommand(const std::string& command, GPU& theGPU) {
+  if (command == "SHA256") {
+    return theGPU.theKernels[GPU::kernelSHA256]->build();
+  }
+  if (command == "testBuffer") {
+    return theGPU.theKernels[GPU::kernelTestBuffer]->build();
+  }
+  if (command == "generatePublicKey") {
+    return
+      CryptoEC256k1GPU::initializeGeneratorContext(theGPU) &&
+      theGPU.theKernels[GPU::kernelGeneratePublicKey]->build();
+  }
+  if (command == "signOneMessage") {
+    return
+      CryptoEC256k1GPU::initializeGeneratorContext(theGPU) &&
+      theGPU.theKernels[GPU::kernelSign]->build();
+  }
+  if (command == "verifySignature") {
+    return
+      CryptoEC256k1GPU::initializeMultiplicationContext(theGPU) &&
+      theGPU.theKernels[GPU::kernelVerifySignature]->build();
+  }
+  return false;
+}
+
+void Server::SelectDevice(unsigned int deviceIndex) {
+  this->currentDevice = deviceIndex;
+  this->theGPU = deviceIndex < this->devices.theGPUs.size() ? this->devices.theGPUs[deviceIndex] : nullptr;
+}
+
+//The CPU backend comes after the OpenCL devices.
+unsigned int Server::CPUDeviceIndex() {
+  return this->devices.theGPUs.size();
+}
+
+std::string Server::KernelOfCommand(const std::string& command) {
+  if (command == "SHA256") {
+    return GPU::kernelSHA256;
+  }
+  if (command == "testBuffer") {
+    return GPU::kernelTestBuffer;
+  }
+  if (command == "generatePublicKey") {
+    return GPU::kernelGeneratePublicKey;
+  }
+  if (command == "signOneMessage") {
+    return GPU::kernelSign;
+  }
+  if (command == "verifySignature") {
+    return GPU::kernelVerifySignature;
+  }
+  return "";
+}
+
+/* Offline mode, see main: times the server kernels of every device on synthetic requests
+ * and writes the best configuration of each to the tuning file of the device, see GPU::autotune.
+ * Every later start of the server applies that file.
+ */
+bool Server::Autotune() {
+  if (!this->devices.initialize()) {
+    return false;
+  }
+  bool result = true;
+  for (unsigned i = 0; i < this->devices.theGPUs.size(); i ++) {
+    this->SelectDevice(i);
+    logServer << "Autotuning device " << i << ": " << this->theGPU->getId() << ". " << Logger::endL;
+    if (!this->AutotuneDevice()) {
+      result = false;
+    }
+  }
+  return result;
+}
+
+bool Server::AutotuneDevice() {
+  bool result = true;
+  std::string commands[] = {"SHA256", "generatePublicKey", "signOneMessage", "verifySignature"};
+  for (unsigned i = 0; i < sizeof(commands) / sizeof(commands[0]); i ++) {
+    const std::string& command = commands[i];
+    if (!this->theGPU->servesKernel(Server::KernelOfCommand(command))) {
+      continue;
+    }
+    std::vector<std::string> samples;
+    if (!this->WarmUpCommand(command, *this->theGPU) || !this->AutotuneSamples(command, samples)) {
+      logServer << Logger::colorRed << "Failed to prepare " << command << " for autotuning. " << Logger::colorNormal << Logger::endL;
+      result = false;
+      continue;
+    }
+    //Staging buffers by batch size: queued once, restored before every run.
+    std::unordered_map<unsigned int, std::vector<HostBuffer> > staged;
+    if (!this->theGPU->autotune(
+      Server::KernelOfCommand(command),
+      [this, &command, &samples, &staged](unsigned int numberOfMessages, double& outputSeconds) {
+        return this->AutotuneBatch(command, samples, numberOfMessages, staged[numberOfMessages], outputSeconds);
+      }
+    )) {
+      result = false;
+    }
+  }
+  //The kernels tuned successfully are kept even if others failed.
+  return this->theGPU->storeTunings() && result;
+}
+
+//Request payloads of the command, in the layouts the Queue* functions expect.
+//Signatures to verify are computed on the CPU, see CryptoEC256k1.
+bool Server::AutotuneSamples(const std::string& command, std::vector<std::string>& output) {
+  const unsigned int numberOfSamples = 16;
+  output.clear();
+  for (unsigned i = 0; i < numberOfSamples; i ++) {
+    unsigned char secretKey[32], nonce[32], message[32];
+    for (unsigned j = 0; j < 32; j ++) {
+      secretKey[j] = (unsigned char) (i * 37 + j * 11 + 1);
+      nonce[j] = (unsigned char) (i * 53 + j * 13 + 7);
+      message[j] = (unsigned char) (i * 71 + j * 17 + 3);
+    }
+    //Well below the order of the group.
+    secretKey[0] = (unsigned char) (i + 1);
+    nonce[0] = (unsigned char) (i + 1);
+    std::string secretKeyString((char*) secretKey, 32);
+    std::string nonceString((char*) nonce, 32);
+    std::string messageString((char*) message, 32);
+    if (command == "SHA256") {
+      output.push_back(nonceString + messageString);
+    } else if (command == "generatePublicKey") {
+      output.push_back(secretKeyString + "\x01");
+    } else if (command == "signOneMessage") {
+      output.push_back(nonceString + secretKeyString + messageString);
+    } else if (command == "verifySignature") {
+      Signature theSignature;
+      PublicKey thePublicKey;
+      if (
+        !CryptoEC256k1::signMessageDefaultBuffers(
+          theSignature.serialization, &theSignature.size, nonce, secretKey, message
+        ) ||
+        !CryptoEC256k1::generatePublicKeyDefaultBuffers(thePublicKey.serialization, &thePublicKey.size, secretKey)
+      ) {
+        return false;
+      }
+      std::string sample;
+      sample.push_back((char) theSignature.size);
+      sample.append((char*) theSignature.serialization, theSignature.size);
+      sample.push_back((char) thePublicKey.size);
+      sample.append((char*) thePublicKey.serialization, thePublicKey.size);
+      output.push_back(sample + messageString);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Computes one batch of numberOfMessages requests cycling through samples
+ * and reports the time from the first write to the end of the last launch.
+ * The first batch of a size is queued request by request like the server does;
+ * its staging buffers are kept in staged and copied back for every later batch of that size.
+ */
+bool Server::AutotuneBatch(
+  const std::string& command,
+  const std::vector<std::string>& samples,
+  unsigned int numberOfMessages,
+  std::vector<HostBuffer>& staged,
+  double& outputSeconds
+) {
+  GPUKernel& kernel = *this->theGPU->getKernel(Server::KernelOfCommand(command));
+  std::vector<std::shared_ptr<SharedMemory> > arguments = kernel.getOutputCollection();
+  arguments.insert(arguments.end(), kernel.getInputCollection().begin(), kernel.getInputCollection().end());
+  bool success = true;
+  if (staged.empty()) {
+    for (unsigned i = 0; i < numberOfMessages && success; i ++) {
+      MessageFromNode theMessage;
+      theMessage.id = std::to_string(i);
+      theMessage.command = command;
+      theMessage.theMessage = samples[i % samples.size()];
+      theMessage.length = theMessage.theMessage.size();
+      success = this->QueueCommand(theMessage);
+    }
+    for (unsigned i = 0; i < arguments.size() && success; i ++) {
+      staged.push_back(arguments[i]->buffer);
+    }
+  } else {
+    for (unsigned i = 0; i < arguments.size(); i ++) {
+      arguments[i]->buffer = staged[i];
+    }
+    kernel.computationIds.assign(numberOfMessages, "autotune");
+  }
+  cl_event launchFinished = NULL;
+  auto timeStart = std::chrono::steady_clock::now();
+  success = success && this->ExecuteCommand(command, launchFinished);
+  success = success && clWaitForEvents(1, &launchFinished) == CL_SUCCESS;
+  outputSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - timeStart).count();
+  if (launchFinished != NULL) {
+    clReleaseEvent(launchFinished);
+  }
+  kernel.computationIds.clear();
+  this->timesQueued[kernel.name].clear();
+  this->packetNumberOfComputations = 0;
+  for (unsigned i = 0; i < arguments.size(); i ++) {
+    arguments[i]->buffer.clear();
+  }
+  return success;
+}
+
+bool Server::ExecuteCommand(const std::string& command, cl_event& outputLaunchFinished) {
+  if (command == "SHA256") {
+    return this->ExecuteSha256s(outputLaunchFinished);
+  }
+  if (command == "testBuffer") {
+    return this->ExecuteTestBuffers(outputLaunchFinished);
+  }
+  if (command == "generatePublicKey") {
+    return this->ExecuteGeneratePublicKeys(outputLaunchFinished);
+  }
+  if (command == "signOneMessage") {
+    return this->ExecuteSignMessages(outputLaunchFinished);
+  }
+  if (command == "verifySignature") {
+    return this->ExecuteVerifySignatures(outputLaunchFinished);
+  }
   return false;
 }
 
+//Dispatch thread only. Lets the scheduler release the requests of the commands that became warm.
+void Server::ReleaseWarmCommands(bool flagReleaseAll) {
+  for (
+    std::unordered_map<std::string, std::atomic<bool> >::iterator current = this->commandsWarm.begin();
+    current != this->commandsWarm.end();
+    current ++
+  ) {
+    BatchScheduler::CommandBatches& batches = this->scheduler.commands[current->first];
+    if (batches.flagOnHold && (flagReleaseAll || current->second.load(std::memory_order_acquire))) {
+      batches.flagOnHold = false;
+    }
+  }
+}
+
+void Server::RunIngest() {
+  if (this->flagBinaryProtocol) {
+    while (this->RunOnceEventLoop()) {
+    }
+  } else {
+    while (this->RunOnceIngest()) {
+    }
+  }
+  this->flagStop = true;
+}
+
+/* Stops reading requests while highWaterMark or more of them are waiting for results;
+ * resumes once at most lowWaterMark are left.
+ * Returns true while paused.
+ */
+bool Server::IngestShouldPause() {
+  unsigned int inFlight = this->numberOfRequestsInFlight.load();
+  if (!this->flagIngestPaused && inFlight >= this->highWaterMark) {
+    logServer << inFlight << " requests in flight, pausing reads. " << Logger::endL;
+    this->flagIngestPaused = true;
+  } else if (this->flagIngestPaused && inFlight <= this->lowWaterMark) {
+    logServer << inFlight << " requests in flight, resuming reads. " << Logger::endL;
+    this->flagIngestPaused = false;
+  }
+  if (this->flagIngestPaused) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return this->flagIngestPaused;
+}
+
+bool Server::RunOnceIngest() {
+  if (this->IngestShouldPause()) {
+    return !this->flagStop.load();
+  }
+  if (!this->thePipe.ReadNext()) { //reads all pending messages
+    return false;
+  }
+  return this->PushIngested();
+}
+
+bool Server::PushIngested() {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  while (!this->thePipe.messagesRead.empty()) {
+    MessageFromNode& current = this->thePipe.messagesRead.front();
+    current.timeReceived = now;
+    //Frames already read past the high-water mark get an explicit busy reply.
+    //The legacy protocol has no busy reply and relies on the paused reads alone.
+    if (this->flagBinaryProtocol && this->numberOfRequestsInFlight.load() >= this->highWaterMark) {
+      current.flagBusy = true;
+    } else {
+      this->numberOfRequestsInFlight ++;
+    }
+    if (!this->incomingMessages.pushWait(this->thePipe.messagesRead.front(), this->flagStop)) {
+      return false;
+    }
+    this->thePipe.messagesRead.pop_front();
+  }
+  return true;
+}
+
 std::vector<std::string> portsToTryMetaData = {"49201"};
 std::vector<std::string> portsToTryData = {"48201"};
 std::vector<std::string> portsToTryOutputData = {"47201"};
+std::vector<std::string> portsToTryBinary = {"46201"};
 
 bool Server::initializeOneSocketAndPort(int& outputSocket, std::string& outputPort, std::vector<std::string>& portsToTry) {
   addrinfo hints;
@@ -162,6 +614,9 @@ bool Server::initializeOneSocketAndPort(int& outputSocket, std::string& outputPo
 }
 
 bool Server::initializePorts() {
+  if (this->flagBinaryProtocol) {
+    return this->initializeOneSocketAndPort(this->listeningSocketBinary, this->portBinary, portsToTryBinary);
+  }
   if (!this->initializeOneSocketAndPort(this->listeningSocketMetaData, this->portMetaData, portsToTryMetaData)) {
     return false;
   }
@@ -208,13 +663,17 @@ bool Server::listenOneSocket(int theSocket, int& outputFileDescriptor, const std
   logServer << "Listening to port: " << port << Logger::endL;
   int success = listen(theSocket, 100);
   if (success != 0) {
-    logServer << "Failed listening. " << strerror(errno);
+    logServer << "Failed listening. " << strerror(errno) << Logger::endL;
     return false;
   }
   return true;
 }
 
 bool Server::listenAll() {
+  if (this->flagBinaryProtocol) {
+    int unused = - 1;
+    return this->listenOneSocket(this->listeningSocketBinary, unused, this->portBinary);
+  }
   if (!this->listenOneSocket(this->listeningSocketMetaData, this->thePipe.inputMeta->fileDescriptor, this->portMetaData)) {
     return false;
   }
@@ -246,6 +705,308 @@ void MessageFromNode::reset() {
   this->length = - 1;
   this->command = "";
   this->theMessage = "";
+  this->timeReceived = std::chrono::steady_clock::time_point();
+  this->flagBusy = false;
+}
+
+BatchScheduler::CommandBatches::CommandBatches() {
+  this->batchSize = 0;
+  this->nextLatencyIndex = 0;
+  this->flagOnHold = false;
+}
+
+BatchScheduler::BatchScheduler() {
+  this->initialBatchSize = 256;
+  this->minimumBatchSize = 32;
+  this->maximumBatchSize = 4096;
+  this->maximumWait = std::chrono::microseconds(2000);
+  this->latencyTargetInSeconds = 0.05;
+  this->numberOfPending = 0;
+}
+
+void BatchScheduler::add(MessageFromNode& message) {
+  CommandBatches& batches = this->commands[message.command];
+  if (batches.batchSize == 0) {
+    batches.batchSize = this->initialBatchSize;
+  }
+  batches.pending.push_back(std::move(message));
+  this->numberOfPending ++;
+}
+
+bool BatchScheduler::empty() {
+  return this->numberOfPending == 0;
+}
+
+bool BatchScheduler::isReady(CommandBatches& batches, std::chrono::steady_clock::time_point now, bool flagFlushAll) {
+  if (batches.pending.empty() || batches.flagOnHold) {
+    return false;
+  }
+  if (flagFlushAll || batches.pending.size() >= batches.batchSize) {
+    return true;
+  }
+  return now - batches.pending.front().timeReceived >= this->maximumWait;
+}
+
+bool BatchScheduler::hasReady(std::chrono::steady_clock::time_point now, bool flagFlushAll) {
+  for (
+    std::unordered_map<std::string, CommandBatches>::iterator current = this->commands.begin();
+    current != this->commands.end();
+    current ++
+  ) {
+    if (this->isReady(current->second, now, flagFlushAll)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Moves the ready batches, at most batchSize messages per command, into output.
+ * Commands whose batch was cut by size rather than by deadline are listed in outputFullCommands.
+ */
+void BatchScheduler::takeReady(
+  std::deque<MessageFromNode>& output,
+  std::vector<std::string>& outputFullCommands,
+  std::chrono::steady_clock::time_point now,
+  bool flagFlushAll
+) {
+  for (
+    std::unordered_map<std::string, CommandBatches>::iterator current = this->commands.begin();
+    current != this->commands.end();
+    current ++
+  ) {
+    CommandBatches& batches = current->second;
+    if (!this->isReady(batches, now, flagFlushAll)) {
+      continue;
+    }
+    if (batches.pending.size() >= batches.batchSize) {
+      outputFullCommands.push_back(current->first);
+    }
+    unsigned int toTake = std::min((unsigned int) batches.pending.size(), batches.batchSize);
+    for (unsigned i = 0; i < toTake; i ++) {
+      output.push_back(std::move(batches.pending.front()));
+      batches.pending.pop_front();
+    }
+    this->numberOfPending -= toTake;
+  }
+}
+
+//Puts messages taken by takeReady but not launched back at the head of their commands' queues, in order.
+void BatchScheduler::returnToFront(std::deque<MessageFromNode>& messages) {
+  while (!messages.empty()) {
+    CommandBatches& batches = this->commands[messages.back().command];
+    batches.pending.push_front(std::move(messages.back()));
+    messages.pop_back();
+    this->numberOfPending ++;
+  }
+}
+
+void BatchScheduler::recordLatency(const std::string& command, double latencyInSeconds) {
+  CommandBatches& batches = this->commands[command];
+  if (batches.recentLatencies.size() < BatchScheduler::latencySamples) {
+    batches.recentLatencies.push_back(latencyInSeconds);
+    return;
+  }
+  batches.recentLatencies[batches.nextLatencyIndex] = latencyInSeconds;
+  batches.nextLatencyIndex = (batches.nextLatencyIndex + 1) % BatchScheduler::latencySamples;
+}
+
+double BatchScheduler::percentile99(const std::string& command) {
+  std::vector<double> sorted = this->commands[command].recentLatencies;
+  if (sorted.empty()) {
+    return 0;
+  }
+  std::vector<double>::iterator position = sorted.begin() + (sorted.size() * 99) / 100;
+  std::nth_element(sorted.begin(), position, sorted.end());
+  return *position;
+}
+
+/* Called after a batch of the command completed.
+ * Shrinks the batch size when the p99 latency misses the target;
+ * grows it while batches fill up before their deadline (overload)
+ * and the p99 latency has room to spare.
+ */
+void BatchScheduler::adapt(const std::string& command, bool batchWasFull) {
+  CommandBatches& batches = this->commands[command];
+  if (batches.recentLatencies.size() < BatchScheduler::minimumLatencySamples) {
+    return;
+  }
+  double latency99 = this->percentile99(command);
+  unsigned int oldBatchSize = batches.batchSize;
+  if (latency99 > this->latencyTargetInSeconds) {
+    batches.batchSize = std::max(this->minimumBatchSize, batches.batchSize * 3 / 4);
+  } else if (batchWasFull && latency99 < this->latencyTargetInSeconds * 0.8) {
+    batches.batchSize = std::min(this->maximumBatchSize, batches.batchSize + batches.batchSize / 8 + 1);
+  }
+  if (batches.batchSize != oldBatchSize) {
+    logServer << "Batch size of " << command << ": " << oldBatchSize << " -> " << batches.batchSize
+    << ", p99 latency: " << latency99 * 1000 << " ms. " << Logger::endL;
+  }
+}
+
+unsigned char BinaryFrame::opcodeFromCommand(const std::string& command) {
+  for (unsigned char opcode = BinaryFrame::opcodeSHA256; opcode <= BinaryFrame::opcodeStats; opcode ++) {
+    if (BinaryFrame::commandFromOpcode(opcode) == command) {
+      return opcode;
+    }
+  }
+  return 0;
+}
+
+unsigned int BinaryFrame::countFrames(const std::string& frames) {
+  unsigned int result = 0;
+  size_t frameStart = 0;
+  while (frames.size() - frameStart >= BinaryFrame::headerSize) {
+    frameStart += BinaryFrame::headerSize + memoryPool_read_uint((const unsigned char*) &frames[frameStart + 8]);
+    if (frameStart > frames.size()) {
+      break;
+    }
+    result ++;
+  }
+  return result;
+}
+
+std::string BinaryFrame::commandFromOpcode(unsigned char opcode) {
+  switch (opcode) {
+  case BinaryFrame::opcodeSHA256:
+    return "SHA256";
+  case BinaryFrame::opcodeSignOneMessage:
+    return "signOneMessage";
+  case BinaryFrame::opcodeTestBuffer:
+    return "testBuffer";
+  case BinaryFrame::opcodeVerifySignature:
+    return "verifySignature";
+  case BinaryFrame::opcodeGeneratePublicKey:
+    return "generatePublicKey";
+  case BinaryFrame::opcodeStats:
+    return "stats";
+  default:
+    return "";
+  }
+}
+
+void BinaryFrame::writeHeader(
+  unsigned char* output, unsigned char opcode, unsigned char status, unsigned int requestId, unsigned int payloadLength
+) {
+  output[0] = opcode;
+  output[1] = status;
+  output[2] = 0;
+  output[3] = 0;
+  memoryPool_write_uint(requestId, &output[4]);
+  memoryPool_write_uint(payloadLength, &output[8]);
+}
+
+std::string BinaryFrame::computationId(unsigned int connectionId, unsigned int requestId) {
+  std::stringstream out;
+  out << connectionId << ":" << requestId;
+  return out.str();
+}
+
+bool BinaryFrame::parseComputationId(const std::string& input, unsigned int& outputConnectionId, unsigned int& outputRequestId) {
+  std::size_t separator = input.find(':');
+  if (separator == std::string::npos) {
+    return false;
+  }
+  outputConnectionId = (unsigned int) std::stoul(input.substr(0, separator));
+  outputRequestId = (unsigned int) std::stoul(input.substr(separator + 1));
+  return true;
+}
+
+ClientConnection::ClientConnection(int inputFileDescriptor, unsigned int inputId) {
+  this->fileDescriptor = inputFileDescriptor;
+  this->id = inputId;
+  this->readBuffer.resize(ClientConnection::readBufferSize);
+  this->flagReadClosed = false;
+  this->numberOfUnansweredRequests = 0;
+}
+
+ClientConnection::~ClientConnection() {
+  if (this->fileDescriptor >= 0) {
+    close(this->fileDescriptor);
+  }
+  this->fileDescriptor = - 1;
+}
+
+/* Reads all bytes available on the connection without blocking and
+ * converts all complete frames into messages, appended to output.
+ * The bytes of a trailing incomplete frame are kept in
+ * this->incompleteFrame until the rest of the frame arrives.
+ * At end of stream, the complete frames are still converted and flagReadClosed is set.
+ * Returns false on read errors or a malformed frame; the caller should then drop the connection.
+ */
+bool ClientConnection::ReadAvailable(std::deque<MessageFromNode>& output, unsigned int maximumPayloadLength) {
+  bool endOfStream = false;
+  while (true) {
+    int numberOfBytesRead = read(this->fileDescriptor, &this->readBuffer[0], this->readBuffer.size());
+    if (numberOfBytesRead < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      logServer << "Failed to read connection " << this->id << ". " << strerror(errno) << Logger::endL;
+      return false;
+    }
+    if (numberOfBytesRead == 0) {
+      //The frames already read still get their results.
+      logServer << "Connection " << this->id << " closed by client. " << Logger::endL;
+      endOfStream = true;
+      break;
+    }
+    this->incompleteFrame.append(&this->readBuffer[0], numberOfBytesRead);
+  }
+  unsigned int frameStart = 0;
+  while (this->incompleteFrame.size() - frameStart >= BinaryFrame::headerSize) {
+    const unsigned char* header = (const unsigned char*) &this->incompleteFrame[frameStart];
+    unsigned int payloadLength = memoryPool_read_uint(&header[8]);
+    if (payloadLength > maximumPayloadLength) {
+      logServer << "Connection " << this->id << ": binary frame payload of " << payloadLength
+      << " bytes exceeds the " << maximumPayloadLength << " byte limit. " << Logger::endL;
+      return false;
+    }
+    if (this->incompleteFrame.size() - frameStart < BinaryFrame::headerSize + payloadLength) {
+      break;
+    }
+    MessageFromNode currentMessage;
+    currentMessage.command = BinaryFrame::commandFromOpcode(header[0]);
+    if (currentMessage.command == "") {
+      logServer << "Connection " << this->id << ": unknown binary frame opcode: " << (int) header[0] << ". " << Logger::endL;
+      return false;
+    }
+    currentMessage.id = BinaryFrame::computationId(this->id, memoryPool_read_uint(&header[4]));
+    currentMessage.length = payloadLength;
+    currentMessage.theMessage.assign(&this->incompleteFrame[frameStart + BinaryFrame::headerSize], payloadLength);
+    output.push_back(std::move(currentMessage));
+    this->numberOfUnansweredRequests ++;
+    frameStart += BinaryFrame::headerSize + payloadLength;
+  }
+  this->incompleteFrame.erase(0, frameStart);
+  if (endOfStream) {
+    if (!this->incompleteFrame.empty()) {
+      logServer << "Connection " << this->id << ": dropped " << this->incompleteFrame.size()
+      << " bytes of an incomplete frame at end of stream. " << Logger::endL;
+      this->incompleteFrame.clear();
+    }
+    //Only now that its frames are counted, see Server::CloseIfAnswered.
+    this->flagReadClosed = true;
+  }
+  return true;
+}
+
+/* Writes as much of this->pendingOutput as the socket accepts without blocking.
+ * Returns false on write errors; the caller should then drop the connection.
+ */
+bool ClientConnection::WritePending() {
+  while (this->pendingOutput.size() > 0) {
+    //MSG_NOSIGNAL: a client that hung up must not raise SIGPIPE.
+    int numberOfBytesWritten = send(this->fileDescriptor, this->pendingOutput.c_str(), this->pendingOutput.size(), MSG_NOSIGNAL);
+    if (numberOfBytesWritten < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      logServer << "Failed to write to connection " << this->id << ". " << strerror(errno) << Logger::endL;
+      return false;
+    }
+    this->pendingOutput.erase(0, numberOfBytesWritten);
+  }
+  return true;
 }
 
 /* Attempts to read up to this->capacity bytes from a given pipe. Will
@@ -536,67 +1297,690 @@ bool MessagePipeline::ReadNext() {
   return true;
 }
 
-bool Server::RunOnce() {
-  if (!this->thePipe.ReadNext()) { //reads all pending messages
+bool Server::setNonBlocking(int fileDescriptor) {
+  int flags = fcntl(fileDescriptor, F_GETFL, 0);
+  if (flags < 0 || fcntl(fileDescriptor, F_SETFL, flags | O_NONBLOCK) < 0) {
+    logServer << "Failed to make file descriptor " << fileDescriptor << " non-blocking. " << strerror(errno) << Logger::endL;
     return false;
   }
-  this->packetNumberOfComputations = 0;
-  while (!this->thePipe.messagesRead.empty()) {
-    if (!this->QueueCommand(this->thePipe.messagesRead.front())) {
-      if (this->packetNumberOfComputations == 0) {
-        return false;
-      }
-    }
-    this->packetNumberOfComputations ++;
-    this->thePipe.messagesRead.pop_front();
-  }
-  return this->ExecuteQueued();
+  return true;
 }
 
-bool Server::QueueCommand(MessageFromNode& theMessage) {
-  logServer << "Processing message: " << theMessage.toString() << Logger::endL;
-  if (!this->theGPU->initializeAllNoBuild()) {
+bool Server::initializeEventLoop() {
+  if (!this->setNonBlocking(this->listeningSocketBinary)) {
     return false;
   }
-  if (theMessage.command == "SHA256") {
-    return this->QueueSha256(theMessage);
-  }
-  if (theMessage.command == "signOneMessage") {
-    return this->QueueSignOneMessage(theMessage);
-  }
-  if (theMessage.command == "testBuffer") {
-    return this->QueueTestBuffer(theMessage);
+  this->epollFileDescriptor = epoll_create1(0);
+  if (this->epollFileDescriptor < 0) {
+    logServer << "Failed to create epoll instance. " << strerror(errno) << Logger::endL;
+    return false;
   }
-  logServer << "Fatal error: unknown command. Message: " << theMessage.id << ", " << "command: " << theMessage.command
-  << ", " << theMessage.length << " bytes. ";
-  if (theMessage.length < 50) {
-    logServer << "Message: " << theMessage.theMessage;
+  //Connection ids start at 1: id 0 marks the listening socket.
+  epoll_event listeningEvent;
+  listeningEvent.events = EPOLLIN;
+  listeningEvent.data.u64 = 0;
+  if (epoll_ctl(this->epollFileDescriptor, EPOLL_CTL_ADD, this->listeningSocketBinary, &listeningEvent) < 0) {
+    logServer << "Failed to register listening socket with epoll. " << strerror(errno) << Logger::endL;
+    return false;
   }
-  logServer << Logger::endL;
-  return false;
-
+  logServer << "Event loop listening on port " << this->portBinary << "." << Logger::endL;
+  return true;
 }
 
-bool Server::ExecuteQueued() {
-  std::shared_ptr<GPUKernel> theKernelSha256     = this->theGPU->theKernels[GPU::kernelSHA256];
-  std::shared_ptr<GPUKernel> theKernelSignOne    = this->theGPU->theKernels[GPU::kernelSign];
-  std::shared_ptr<GPUKernel> theKernelTestBuffer = this->theGPU->theKernels[GPU::kernelTestBuffer];
-  if (theKernelSha256->computationIds.size() > 0) {
-    if (!this->ExecuteSha256s()) {
+bool Server::AcceptConnections() {
+  while (true) {
+    sockaddr clientAddress;
+    socklen_t clientAddressLength = sizeof(clientAddress);
+    int clientFileDescriptor = accept(this->listeningSocketBinary, &clientAddress, &clientAddressLength);
+    if (clientFileDescriptor < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      logServer << "Error on accept: " << strerror(errno) << Logger::endL;
       return false;
     }
-  }
+    if (!this->setNonBlocking(clientFileDescriptor)) {
+      close(clientFileDescriptor);
+      continue;
+    }
+    this->lastConnectionId ++;
+    std::shared_ptr<ClientConnection> incoming = std::make_shared<ClientConnection>(clientFileDescriptor, this->lastConnectionId);
+    epoll_event clientEvent;
+    clientEvent.events = EPOLLIN;
+    clientEvent.data.u64 = incoming->id;
+    if (epoll_ctl(this->epollFileDescriptor, EPOLL_CTL_ADD, clientFileDescriptor, &clientEvent) < 0) {
+      logServer << "Failed to register connection with epoll. " << strerror(errno) << Logger::endL;
+      continue;
+    }
+    unsigned int numberOfConnections = 0;
+    {
+      std::lock_guard<std::mutex> lock(this->connectionsLock);
+      this->connections[incoming->id] = incoming;
+      numberOfConnections = this->connections.size();
+    }
+    logServer << "Accepted connection " << incoming->id << ". Open connections: " << numberOfConnections << "." << Logger::endL;
+  }
+}
+
+void Server::CloseConnection(unsigned int connectionId) {
+  unsigned int numberOfConnections = 0;
+  {
+    std::lock_guard<std::mutex> lock(this->connectionsLock);
+    std::unordered_map<unsigned int, std::shared_ptr<ClientConnection> >::iterator found = this->connections.find(connectionId);
+    if (found == this->connections.end()) {
+      return;
+    }
+    //The file descriptor stays open while the writer thread still holds the connection.
+    epoll_ctl(this->epollFileDescriptor, EPOLL_CTL_DEL, found->second->fileDescriptor, NULL);
+    this->connections.erase(found);
+    numberOfConnections = this->connections.size();
+  }
+  logServer << "Closed connection " << connectionId << ". Open connections: " << numberOfConnections << "." << Logger::endL;
+}
+
+//Called by the ingest thread after it sets flagReadClosed and by the writer thread after it counts results:
+//each updates its own atomic before it reads the other's, so at least one of them closes.
+void Server::CloseIfAnswered(ClientConnection& connection) {
+  if (connection.flagReadClosed.load() && connection.numberOfUnansweredRequests.load() == 0) {
+    //Output still pending stays with the writer thread, see WaitToWritePending.
+    this->CloseConnection(connection.id);
+  }
+}
+
+/* One iteration of the binary protocol ingest loop:
+ * waits for activity on any connection, accepts new clients,
+ * reads all available frames from every readable client
+ * and hands them to the dispatch thread.
+ * Writing results is left to the writer thread.
+ */
+bool Server::RunOnceEventLoop() {
+  if (this->IngestShouldPause()) {
+    return !this->flagStop.load();
+  }
+  const int maximumEvents = 64;
+  //Time out now and then to notice this->flagStop.
+  const int timeoutInMilliseconds = 100;
+  epoll_event events[maximumEvents];
+  int numberOfEvents = epoll_wait(this->epollFileDescriptor, events, maximumEvents, timeoutInMilliseconds);
+  if (this->flagStop.load()) {
+    return false;
+  }
+  if (numberOfEvents < 0) {
+    if (errno == EINTR) {
+      return true;
+    }
+    logServer << "Epoll wait failed. " << strerror(errno) << Logger::endL;
+    return false;
+  }
+  for (int i = 0; i < numberOfEvents; i ++) {
+    unsigned int connectionId = (unsigned int) events[i].data.u64;
+    if (connectionId == 0) {
+      if (!this->AcceptConnections()) {
+        return false;
+      }
+      continue;
+    }
+    std::shared_ptr<ClientConnection> current = this->getConnection(connectionId);
+    if (current == nullptr) {
+      continue;
+    }
+    bool isGood = (events[i].events & (EPOLLERR | EPOLLHUP)) == 0 || (events[i].events & EPOLLIN) != 0;
+    if (isGood && (events[i].events & EPOLLIN) != 0) {
+      isGood = current->ReadAvailable(this->thePipe.messagesRead, this->thePipe.bufferCapacityData);
+    }
+    if (!isGood) {
+      this->CloseConnection(connectionId);
+    } else if (current->flagReadClosed.load()) {
+      //Nothing more to read: stop polling, keep the connection for the writer thread.
+      epoll_ctl(this->epollFileDescriptor, EPOLL_CTL_DEL, current->fileDescriptor, NULL);
+    }
+  }
+  if (!this->PushIngested()) {
+    return false;
+  }
+  for (int i = 0; i < numberOfEvents; i ++) {
+    std::shared_ptr<ClientConnection> current = this->getConnection((unsigned int) events[i].data.u64);
+    if (current != nullptr) {
+      this->CloseIfAnswered(*current);
+    }
+  }
+  return true;
+}
+
+/* Moves requests from the ingest thread into the batch scheduler
+ * until one of its batches is ready.
+ * Returns false once the server stops and every request has been dispatched.
+ */
+bool Server::ScheduleIncoming(MessageFromNode& message) {
+  if (message.command == "stats") {
+    return this->AnswerStatistics(message);
+  }
+  if (message.flagBusy) {
+    //Refused at once: a busy request neither waits for a batch nor counts toward one.
+    this->AppendFrameBinary(
+      BinaryFrame::opcodeFromCommand(message.command), BinaryFrame::statusBusy, message.id, nullptr, 0
+    );
+    std::stringstream noResults;
+    return this->WriteResults(noResults);
+  }
+  this->scheduler.add(message);
+  return true;
+}
+
+bool Server::WaitForBatches() {
+  unsigned int attempt = 0;
+  while (true) {
+    //Read the flag first: requests pushed before the stop are then sure to be popped below.
+    bool stopping = this->flagStop.load();
+    MessageFromNode current;
+    while (this->incomingMessages.pop(current)) {
+      if (!this->ScheduleIncoming(current)) {
+        return false;
+      }
+      attempt = 0;
+    }
+    if (!this->ProcessCompletedBatches()) {
+      return false;
+    }
+    this->LogStatisticsPeriodically();
+    if (stopping && this->warmUpThread.joinable()) {
+      //The warm-up stops after its current step; the held requests then initialize their kernels themselves.
+      this->warmUpThread.join();
+      this->ReleaseWarmCommands(true);
+    }
+    this->ReleaseWarmCommands(false);
+    if (this->scheduler.hasReady(std::chrono::steady_clock::now(), stopping)) {
+      return true;
+    }
+    if (stopping) {
+      this->FinishBatchesInFlight();
+      return false;
+    }
+    if (this->scheduler.empty() && this->batchesInFlight.empty()) {
+      if (this->incomingMessages.popWait(current, this->flagStop) && !this->ScheduleIncoming(current)) {
+        return false;
+      }
+      continue;
+    }
+    //Requests are pending but their deadline has not come yet, or launched batches are still running.
+    BoundedQueue<MessageFromNode>::backOff(attempt);
+  }
+}
+
+/* One iteration of the dispatch loop:
+ * waits until the batch scheduler has a full or overdue batch,
+ * queues the ready batches into the kernels and launches them.
+ * Results are handed to the writer thread as their batches complete,
+ * while later batches are queued and launched.
+ */
+bool Server::RunOnce() {
+  if (!this->WaitForBatches()) {
+    return false;
+  }
+  std::deque<MessageFromNode> batch;
+  std::vector<std::string> fullCommands;
+  this->scheduler.takeReady(batch, fullCommands, std::chrono::steady_clock::now(), this->flagStop.load());
+  this->packetNumberOfComputations = 0;
+  this->commandsWithFullBatches.swap(fullCommands);
+  std::vector<unsigned int> deviceOfMessage;
+  this->SplitAcrossDevices(batch, deviceOfMessage);
+  std::deque<MessageFromNode> spillOver;
+  for (unsigned device = 0; device <= this->CPUDeviceIndex(); device ++) {
+    this->SelectDevice(device);
+    if (!this->QueueOnCurrentDevice(batch, deviceOfMessage, spillOver) || !this->ExecuteQueued()) {
+      return false;
+    }
+  }
+  if (!spillOver.empty()) {
+    logServer << spillOver.size() << " request(s) spill over to the next launch. " << Logger::endL;
+    this->scheduler.returnToFront(spillOver);
+  }
+  return true;
+}
+
+//Assigns each request to a device or to the CPU backend, in the proportions of DeviceManager::split.
+void Server::SplitAcrossDevices(std::deque<MessageFromNode>& batch, std::vector<unsigned int>& outputDeviceOfMessage) {
+  std::unordered_map<std::string, unsigned int> numberPerCommand;
+  for (unsigned i = 0; i < batch.size(); i ++) {
+    numberPerCommand[batch[i].command] ++;
+  }
+  std::unordered_map<std::string, std::vector<unsigned int> > countsPerCommand;
+  for (
+    std::unordered_map<std::string, unsigned int>::iterator current = numberPerCommand.begin();
+    current != numberPerCommand.end();
+    current ++
+  ) {
+    std::vector<unsigned int>& counts = countsPerCommand[current->first];
+    unsigned int numberOfBackends = this->CPUDeviceIndex() + (this->cpu.flagInitialized.load() ? 1 : 0);
+    if (numberOfBackends == 0) {
+      //No device and no CPU backend: the requests fail in QueueOnCPU.
+      counts.assign(1, current->second);
+      continue;
+    }
+    this->devices.split(Server::KernelOfCommand(current->first), current->second, numberOfBackends, counts);
+    counts.resize(this->CPUDeviceIndex() + 1, 0);
+  }
+  std::unordered_map<std::string, unsigned int> nextDevice;
+  outputDeviceOfMessage.resize(batch.size());
+  for (unsigned i = 0; i < batch.size(); i ++) {
+    std::vector<unsigned int>& counts = countsPerCommand[batch[i].command];
+    unsigned int& device = nextDevice[batch[i].command];
+    while (counts[device] == 0) {
+      device ++;
+    }
+    counts[device] --;
+    outputDeviceOfMessage[i] = device;
+  }
+}
+
+//Queues the requests of the batch assigned to the current device into its kernels.
+//Requests that do not fit in the staging buffers are moved to spillOver.
+bool Server::QueueOnCurrentDevice(
+  std::deque<MessageFromNode>& batch,
+  const std::vector<unsigned int>& deviceOfMessage,
+  std::deque<MessageFromNode>& spillOver
+) {
+  std::unordered_map<std::string, unsigned int> numberQueuedPerCommand;
+  for (unsigned i = 0; i < batch.size(); i ++) {
+    if (deviceOfMessage[i] != this->currentDevice) {
+      continue;
+    }
+    bool queued = this->currentDevice == this->CPUDeviceIndex() ?
+      this->QueueOnCPU(batch[i]) :
+      this->QueueCommand(batch[i]);
+    if (queued) {
+      this->packetNumberOfComputations ++;
+      numberQueuedPerCommand[batch[i].command] ++;
+      continue;
+    }
+    if (this->flagBufferFull && numberQueuedPerCommand[batch[i].command] > 0) {
+      //The staging buffers are full: hold the request for the next launch.
+      spillOver.push_back(std::move(batch[i]));
+      continue;
+    }
+    if (this->flagBufferFull) {
+      logServer << "Request " << batch[i].id << " does not fit in empty staging buffers. " << Logger::endL;
+    }
+    this->numberOfRequestsInFlight --;
+    if (this->flagBinaryProtocol) {
+      //A bad request fails only its own computation, not the server.
+      this->AppendErrorBinary(batch[i]);
+    } else if (this->packetNumberOfComputations == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Writer thread: sends each packet of results to its destination.
+ * Binary protocol results that do not fit in the socket buffer
+ * stay in the connection's pendingOutput and are retried
+ * once poll reports the socket writable.
+ */
+void Server::RunWriter() {
+  while (true) {
+    OutgoingResult current;
+    bool found = false;
+    if (this->connectionsWithPendingOutput.empty()) {
+      found = this->outgoingResults.popWait(current, this->flagDispatchFinished);
+      if (!found) {
+        return;
+      }
+    } else {
+      found = this->outgoingResults.pop(current);
+    }
+    if (found) {
+      if (!this->WriteOneResult(current)) {
+        this->flagStop = true;
+        return;
+      }
+      continue;
+    }
+    if (this->flagDispatchFinished.load()) {
+      return;
+    }
+    this->WaitToWritePending();
+  }
+}
+
+bool Server::WriteOneResult(OutgoingResult& result) {
+  if (!this->flagBinaryProtocol) {
+    logServer << "Writing computation packet ..." << Logger::endL;
+    int numWrittenBytes = write(this->thePipe.fileDescriptorOutputData, result.bytes.c_str(), result.bytes.size());
+    logServer << "Computation output written." << Logger::endL;
+    if (numWrittenBytes < 0) {
+      logServer << "Error writing bytes. " << Logger::endL;
+      return false;
+    }
+    if (numWrittenBytes < (signed) result.bytes.size()) {
+      logServer << "Did not manage to write all bytes. " << Logger::endL;
+      return false;
+    }
+    return true;
+  }
+  std::shared_ptr<ClientConnection> owner = this->getConnection(result.connectionId);
+  if (owner == nullptr) {
+    //The client disconnected while its computation was running.
+    return true;
+  }
+  owner->pendingOutput.append(result.bytes);
+  owner->numberOfUnansweredRequests -= BinaryFrame::countFrames(result.bytes);
+  this->CloseIfAnswered(*owner);
+  if (!owner->WritePending()) {
+    this->connectionsWithPendingOutput.erase(owner->id);
+    return true;
+  }
+  if (owner->pendingOutput.size() > 0) {
+    this->connectionsWithPendingOutput[owner->id] = owner;
+  } else {
+    this->connectionsWithPendingOutput.erase(owner->id);
+  }
+  return true;
+}
+
+void Server::WaitToWritePending() {
+  //Short timeout: new results may arrive on this->outgoingResults meanwhile.
+  const int timeoutInMilliseconds = 1;
+  std::vector<pollfd> toPoll;
+  std::vector<std::shared_ptr<ClientConnection> > polled;
+  for (
+    std::unordered_map<unsigned int, std::shared_ptr<ClientConnection> >::iterator current = this->connectionsWithPendingOutput.begin();
+    current != this->connectionsWithPendingOutput.end();
+    current ++
+  ) {
+    pollfd incoming;
+    incoming.fd = current->second->fileDescriptor;
+    incoming.events = POLLOUT;
+    incoming.revents = 0;
+    toPoll.push_back(incoming);
+    polled.push_back(current->second);
+  }
+  if (poll(&toPoll[0], toPoll.size(), timeoutInMilliseconds) <= 0) {
+    return;
+  }
+  for (unsigned i = 0; i < toPoll.size(); i ++) {
+    if (toPoll[i].revents == 0) {
+      continue;
+    }
+    if (!polled[i]->WritePending() || polled[i]->pendingOutput.size() == 0) {
+      this->connectionsWithPendingOutput.erase(polled[i]->id);
+    }
+  }
+}
+
+bool Server::QueueCommand(MessageFromNode& theMessage) {
+  logServer << "Processing message: " << theMessage.toString() << Logger::endL;
+  this->flagBufferFull = false;
+  if (!this->theGPU->initializeAllNoBuild()) {
+    return false;
+  }
+  if (theMessage.command == "SHA256") {
+    return this->QueueSha256(theMessage);
+  }
+  if (theMessage.command == "signOneMessage") {
+    return this->QueueSignOneMessage(theMessage);
+  }
+  if (theMessage.command == "testBuffer") {
+    return this->QueueTestBuffer(theMessage);
+  }
+  if (theMessage.command == "verifySignature") {
+    return this->QueueVerifySignature(theMessage);
+  }
+  if (theMessage.command == "generatePublicKey") {
+    return this->QueueGeneratePublicKey(theMessage);
+  }
+  logServer << "Fatal error: unknown command. Message: " << theMessage.id << ", " << "command: " << theMessage.command
+  << ", " << theMessage.length << " bytes. ";
+  if (theMessage.length < 50) {
+    logServer << "Message: " << theMessage.theMessage;
+  }
+  logServer << Logger::endL;
+  return false;
+
+}
+
+bool Server::ExecuteQueued() {
+  if (this->currentDevice == this->CPUDeviceIndex()) {
+    return this->ExecuteQueuedOnCPU();
+  }
+  std::shared_ptr<GPUKernel> theKernelSha256     = this->theGPU->theKernels[GPU::kernelSHA256];
+  std::shared_ptr<GPUKernel> theKernelSignOne    = this->theGPU->theKernels[GPU::kernelSign];
+  std::shared_ptr<GPUKernel> theKernelTestBuffer = this->theGPU->theKernels[GPU::kernelTestBuffer];
+  std::shared_ptr<GPUKernel> theKernelVerify     = this->theGPU->theKernels[GPU::kernelVerifySignature];
+  std::shared_ptr<GPUKernel> theKernelPublicKeys = this->theGPU->theKernels[GPU::kernelGeneratePublicKey];
+  //Nothing below blocks, except to free a kernel's buffer slot:
+  //every batch's writes, launches and read-back form their own event chain,
+  //so independent kernels, and consecutive batches of one kernel, overlap on the device
+  //and each batch's results are ready as soon as its own chain completes.
+  cl_event launchFinished = NULL;
+  if (theKernelSha256->computationIds.size() > 0) {
+    if (!this->WaitForSlot(*theKernelSha256) || !this->ExecuteSha256s(launchFinished)) {
+      return false;
+    }
+    if (!this->EnqueueReadBack(*theKernelSha256, launchFinished, 0, theKernelSha256->computationIds.size() * 32, - 1, 0)) {
+      return false;
+    }
+  }
   if (theKernelSignOne->computationIds.size() > 0) {
-    if (!this->ExecuteSignMessages()) {
+    if (!this->WaitForSlot(*theKernelSignOne) || !this->ExecuteSignMessages(launchFinished)) {
+      return false;
+    }
+    unsigned int numberOfSignatures = theKernelSignOne->computationIds.size();
+    if (!this->EnqueueReadBack(
+      *theKernelSignOne, launchFinished, 0, numberOfSignatures * MACRO_size_of_signature, 1, numberOfSignatures * 4
+    )) {
       return false;
     }
   }
   if (theKernelTestBuffer->computationIds.size() > 0) {
-    if (!this->ExecuteTestBuffers()) {
+    if (!this->WaitForSlot(*theKernelTestBuffer) || !this->ExecuteTestBuffers(launchFinished)) {
+      return false;
+    }
+    unsigned int totalSize = theKernelTestBuffer->getOutput(0)->buffer.size();
+    theKernelTestBuffer->getOutput(0)->buffer.clear();
+    //The second read-back is the offsets input buffer: argument 1.
+    if (!this->EnqueueReadBack(
+      *theKernelTestBuffer, launchFinished, 0, totalSize, 1, theKernelTestBuffer->computationIds.size() * 4
+    )) {
+      return false;
+    }
+  }
+  if (theKernelVerify->computationIds.size() > 0) {
+    if (!this->WaitForSlot(*theKernelVerify) || !this->ExecuteVerifySignatures(launchFinished)) {
+      return false;
+    }
+    if (!this->EnqueueReadBack(*theKernelVerify, launchFinished, 0, theKernelVerify->computationIds.size(), - 1, 0)) {
+      return false;
+    }
+  }
+  if (theKernelPublicKeys->computationIds.size() > 0) {
+    if (!this->WaitForSlot(*theKernelPublicKeys) || !this->ExecuteGeneratePublicKeys(launchFinished)) {
+      return false;
+    }
+    unsigned int numberOfKeys = theKernelPublicKeys->computationIds.size();
+    if (!this->EnqueueReadBack(
+      *theKernelPublicKeys, launchFinished, 0, numberOfKeys * MACRO_size_of_signature, 1, numberOfKeys * 4
+    )) {
       return false;
     }
   }
-  return this->ProcessResults();
+  clFlush(this->theGPU->commandQueue);
+  return this->ProcessCompletedBatches();
+}
+/* Moves the kernel's queued computations into a new in-flight batch and
+ * enqueues non-blocking reads of the kernel arguments with indices
+ * firstArgument and secondArgument (- 1 for none) into it,
+ * to start once launchFinished completes. Releases launchFinished.
+ * Arguments are numbered as in the kernel signature: outputs first, then inputs.
+ * Finally rotates the kernel to its next buffer slot.
+ */
+bool Server::EnqueueReadBack(
+  GPUKernel& kernel,
+  cl_event launchFinished,
+  int firstArgument,
+  unsigned int firstSize,
+  int secondArgument,
+  unsigned int secondSize
+) {
+  std::shared_ptr<InFlightBatch> batch = std::make_shared<InFlightBatch>();
+  batch->kernelName = kernel.name;
+  batch->deviceIndex = this->currentDevice;
+  batch->slot = kernel.currentSlot;
+  batch->computationIds.swap(kernel.computationIds);
+  batch->timesReceived.swap(this->timesQueued[kernel.name]);
+  batch->command = this->commandsQueued[kernel.name];
+  batch->flagFull = std::find(
+    this->commandsWithFullBatches.begin(), this->commandsWithFullBatches.end(), batch->command
+  ) != this->commandsWithFullBatches.end();
+  batch->packetSize = this->packetNumberOfComputations;
+  batch->resultsSize = firstSize;
+  batch->predictedSeconds = this->devices.charge(batch->deviceIndex, batch->kernelName, batch->computationIds.size());
+  batch->timeLaunched = std::chrono::steady_clock::now();
+  std::vector<cl_event> afterLaunch(1, launchFinished);
+  std::vector<cl_event> reads(2, (cl_event) NULL);
+  bool success = kernel.readBackAsync(firstArgument, firstSize, afterLaunch, batch->results, reads[0]);
+  if (success && secondArgument >= 0) {
+    success = kernel.readBackAsync(secondArgument, secondSize, afterLaunch, batch->resultsSecond, reads[1]);
+  } else {
+    reads.resize(1);
+  }
+  clReleaseEvent(launchFinished);
+  cl_event allRead = NULL;
+  if (success) {
+    success = GPU::enqueueMarker(this->theGPU->commandQueue, reads, allRead) == CL_SUCCESS;
+  }
+  GPU::releaseEvents(reads);
+  if (!success) {
+    logServer << "Failed to enqueue read of the results of " << kernel.name << ". " << Logger::endL;
+    return false;
+  }
+  //The callback may fire before onCompletion returns: the batch must already be listed.
+  this->batchesInFlight.push_back(batch);
+  InFlightBatch* target = batch.get();
+  success = GPU::onCompletion(allRead, [target](cl_int eventStatus) {
+    target->timeCompleted = std::chrono::steady_clock::now();
+    target->completionStatus.store(eventStatus);
+  });
+  clReleaseEvent(allRead);
+  if (!success) {
+    return false;
+  }
+  return kernel.rotateBuffers();
+}
+
+//Checks the request and adds it to the command's CPU batch of the current launch.
+bool Server::QueueOnCPU(MessageFromNode& theMessage) {
+  logServer << "Processing message on the CPU: " << theMessage.toString() << Logger::endL;
+  this->flagBufferFull = false;
+  if (!this->cpu.flagInitialized.load()) {
+    logServer << "The CPU backend is not initialized. " << Logger::endL;
+    return false;
+  }
+  unsigned int signatureSize = 0, publicKeySize = 0;
+  if (theMessage.command == "signOneMessage" && !Server::CheckSignOneMessage(theMessage)) {
+    return false;
+  }
+  if (theMessage.command == "verifySignature" && !Server::CheckVerifySignature(theMessage, signatureSize, publicKeySize)) {
+    return false;
+  }
+  if (theMessage.command == "generatePublicKey" && !Server::CheckGeneratePublicKey(theMessage)) {
+    return false;
+  }
+  if (Server::KernelOfCommand(theMessage.command) == "") {
+    logServer << "Fatal error: unknown command. Message: " << theMessage.id << ", " << "command: " << theMessage.command
+    << ", " << theMessage.length << " bytes. " << Logger::endL;
+    return false;
+  }
+  std::shared_ptr<InFlightBatch>& batch = this->batchesOnCPU[theMessage.command];
+  if (batch == nullptr) {
+    batch = std::make_shared<InFlightBatch>();
+    batch->kernelName = Server::KernelOfCommand(theMessage.command);
+    batch->deviceIndex = this->CPUDeviceIndex();
+    batch->command = theMessage.command;
+    batch->flagFull = std::find(
+      this->commandsWithFullBatches.begin(), this->commandsWithFullBatches.end(), batch->command
+    ) != this->commandsWithFullBatches.end();
+    this->requestsOnCPU[theMessage.command] = std::make_shared<std::vector<std::string> >();
+  }
+  batch->computationIds.push_back(theMessage.id);
+  batch->timesReceived.push_back(theMessage.timeReceived);
+  this->requestsOnCPU[theMessage.command]->push_back(theMessage.theMessage);
+  return true;
+}
+
+//Hands the CPU batches of the current launch to the CPU backend.
+//They complete like the batches read back from a device, see ProcessCompletedBatches.
+bool Server::ExecuteQueuedOnCPU() {
+  for (
+    std::unordered_map<std::string, std::shared_ptr<InFlightBatch> >::iterator current = this->batchesOnCPU.begin();
+    current != this->batchesOnCPU.end();
+    current ++
+  ) {
+    current->second->packetSize = this->packetNumberOfComputations;
+    current->second->predictedSeconds = this->devices.charge(
+      current->second->deviceIndex, current->second->kernelName, current->second->computationIds.size()
+    );
+    //The last worker may complete the batch before execute returns: the batch must already be listed.
+    this->batchesInFlight.push_back(current->second);
+    this->cpu.execute(current->first, this->requestsOnCPU[current->first], current->second);
+  }
+  this->batchesOnCPU.clear();
+  this->requestsOnCPU.clear();
+  return this->ProcessCompletedBatches();
+}
+
+//Records a request queued in the kernel for the current launch.
+void Server::AddComputation(GPUKernel& kernel, MessageFromNode& theMessage) {
+  kernel.computationIds.push_back(theMessage.id);
+  this->timesQueued[kernel.name].push_back(theMessage.timeReceived);
+  this->commandsQueued[kernel.name] = theMessage.command;
+}
+
+//Hands completed batches to the writer thread until
+//no batch in flight occupies the kernel's current buffer slot.
+bool Server::WaitForSlot(GPUKernel& kernel) {
+  unsigned int attempt = 0;
+  while (true) {
+    bool slotBusy = false;
+    for (
+      std::list<std::shared_ptr<InFlightBatch> >::iterator current = this->batchesInFlight.begin();
+      current != this->batchesInFlight.end();
+      current ++
+    ) {
+      if (
+        (*current)->kernelName == kernel.name && (*current)->slot == kernel.currentSlot &&
+        (*current)->deviceIndex == this->currentDevice
+      ) {
+        slotBusy = true;
+        break;
+      }
+    }
+    if (!slotBusy) {
+      return true;
+    }
+    if (attempt == 0) {
+      clFlush(this->theGPU->commandQueue);
+    }
+    BoundedQueue<MessageFromNode>::backOff(attempt);
+    if (!this->ProcessCompletedBatches()) {
+      return false;
+    }
+  }
+}
+
+//Called on stop: waits for every launched batch and delivers its results.
+bool Server::FinishBatchesInFlight() {
+  for (unsigned i = 0; i < this->devices.theGPUs.size(); i ++) {
+    clFlush(this->devices.theGPUs[i]->commandQueue);
+  }
+  unsigned int attempt = 0;
+  while (!this->batchesInFlight.empty()) {
+    if (!this->ProcessCompletedBatches()) {
+      return false;
+    }
+    BoundedQueue<MessageFromNode>::backOff(attempt);
+  }
+  return true;
 }
 
 bool Server::QueueTestBuffer(MessageFromNode& theMessage) {
@@ -604,15 +1988,19 @@ bool Server::QueueTestBuffer(MessageFromNode& theMessage) {
   if (!kernelBuffer->build()) {
     return false;
   }
-  std::vector<unsigned char>& buffer = kernelBuffer->getOutput(0)->buffer;
-  std::vector<unsigned char>& bufferOffsets = kernelBuffer->getInput(0)->buffer;
-  if (buffer.size() + theMessage.theMessage.size() > buffer.capacity()) {
+  HostBuffer& buffer = kernelBuffer->getOutput(0)->buffer;
+  HostBuffer& bufferOffsets = kernelBuffer->getInput(0)->buffer;
+  if (
+    buffer.size() + theMessage.theMessage.size() > kernelBuffer->getOutput(0)->maximumSize ||
+    kernelBuffer->computationIds.size() + 1 > kernelBuffer->maximumMessages
+  ) {
+    this->flagBufferFull = true;
     return false;
   }
   bufferOffsets.resize(bufferOffsets.size() + 4);
   memoryPool_write_uint(buffer.size(), &bufferOffsets[bufferOffsets.size() - 4]);
   buffer.insert(buffer.end(), theMessage.theMessage.begin(), theMessage.theMessage.end());
-  kernelBuffer->computationIds.push_back(theMessage.id);
+  this->AddComputation(*kernelBuffer, theMessage);
   return true;
 }
 
@@ -621,11 +2009,15 @@ bool Server::QueueSha256(MessageFromNode& theMessage) {
   if (!theKernel->build()) {
     return false;
   }
-  std::vector<unsigned char>& offsets = theKernel->getInput(0)->buffer;
-  std::vector<unsigned char>& lengths = theKernel->getInput(1)->buffer;
-  std::vector<unsigned char>& messages = theKernel->getInput(3)->buffer;
+  HostBuffer& offsets = theKernel->getInput(0)->buffer;
+  HostBuffer& lengths = theKernel->getInput(1)->buffer;
+  HostBuffer& messages = theKernel->getInput(2)->buffer;
   logServer << "DEBUG: Queueing " << theMessage.toString() << Logger::endL;
-  if (messages.size() + theMessage.theMessage.size() > messages.capacity()) {
+  if (
+    messages.size() + theMessage.theMessage.size() > theKernel->getInput(2)->maximumSize ||
+    theKernel->computationIds.size() + 1 > theKernel->maximumMessages
+  ) {
+    this->flagBufferFull = true;
     return false;
   }
   int oldLengthsSize = lengths.size();
@@ -633,97 +2025,80 @@ bool Server::QueueSha256(MessageFromNode& theMessage) {
   memoryPool_write_uint(theMessage.theMessage.size(), &lengths[oldLengthsSize]);
   int oldOffsetSize = offsets.size();
   offsets.resize(oldOffsetSize + 4);
-  memoryPool_write_uint(messages.size(), &offsets[oldLengthsSize]);
+  memoryPool_write_uint(messages.size(), &offsets[oldOffsetSize]);
   messages.insert(messages.end(), theMessage.theMessage.begin(), theMessage.theMessage.end());
-  theKernel->computationIds.push_back(theMessage.id);
+  this->AddComputation(*theKernel, theMessage);
 
   logServer << "DEBUG: Queued successfully. " << Logger::endL;
   return true;
 }
 
-bool Server::ExecuteSha256s() {
+bool Server::ExecuteSha256s(cl_event& outputLaunchFinished) {
   std::shared_ptr<GPUKernel> kernelSHA256 = this->theGPU->theKernels[GPU::kernelSHA256];
   if (!kernelSHA256->build()) {
     return false;
   }
-  kernelSHA256->writeToBuffer(1, kernelSHA256->getInput(0)->buffer);
-  kernelSHA256->writeToBuffer(2, kernelSHA256->getInput(1)->buffer);
-  kernelSHA256->writeToBuffer(4, kernelSHA256->getInput(3)->buffer);
-  for (unsigned i = 0; i < kernelSHA256->computationIds.size(); i ++) {
-    kernelSHA256->writeMessageIndex(i);
-    cl_int ret = clEnqueueNDRangeKernel(
-      this->theGPU->commandQueue,
-      kernelSHA256->kernel,
-      1,
-      NULL,
-      kernelSHA256->global_item_size,
-      kernelSHA256->local_item_size,
-      0,
-      NULL,
-      NULL
+  std::vector<cl_event> writes;
+  bool success =
+    kernelSHA256->writeToBufferAsync(1, kernelSHA256->getInput(0)->buffer, std::vector<cl_event>(), writes) &&
+    kernelSHA256->writeToBufferAsync(2, kernelSHA256->getInput(1)->buffer, std::vector<cl_event>(), writes) &&
+    kernelSHA256->writeToBufferAsync(3, kernelSHA256->getInput(2)->buffer, std::vector<cl_event>(), writes) &&
+    kernelSHA256->enqueueBatchAsync(
+      0, kernelSHA256->computationIds.size(), kernelSHA256->getMessagesPerLaunch(), writes, outputLaunchFinished
     );
-    if (ret != CL_SUCCESS) {
-      logServer << "Failed to enqueue kernel. Return code: " << ret << ". ";
-      return false;
-    }
+  GPU::releaseEvents(writes);
+  if (!success) {
+    return false;
   }
+  //Shrinking keeps the capacity: the host memory read by the pending writes is not freed.
+  //The next batch is queued while this one runs, into other memory:
+  //GPUKernel::rotateBuffers parks this memory in the slot's hostRing
+  //until Server::WaitForSlot finds the slot free again.
   kernelSHA256->getInput(0)->buffer.resize(0);
   kernelSHA256->getInput(1)->buffer.resize(0);
-  kernelSHA256->getInput(3)->buffer.resize(0);
+  kernelSHA256->getInput(2)->buffer.resize(0);
   return true;
 }
-
-bool Server::ProcessResultsSha256(std::stringstream& output) {
-  std::shared_ptr<GPUKernel> kernelSHA256 = this->theGPU->getKernel(this->theGPU->kernelSHA256);
-  if (kernelSHA256->computationIds.size() == 0) {
+bool Server::ProcessResultsSha256(InFlightBatch& batch, std::stringstream& output) {
+  if (batch.computationIds.size() == 0) {
     return true;
   }
-  cl_mem& result = kernelSHA256->getOutput(0)->theMemory;
-  cl_int ret = clEnqueueReadBuffer(
-    this->theGPU->commandQueue,
-    result,
-    CL_TRUE,
-    0,
-    kernelSHA256->computationIds.size() * 32,
-    this->thePipe.bufferOutputGPU,
-    0,
-    NULL,
-    NULL
-  );
-  if (ret != CL_SUCCESS) {
-    logServer << "Failed to read buffer. " << Logger::endL;
-    return false;
-  }
-  for (unsigned i = 0; i < kernelSHA256->computationIds.size(); i ++) {
+  for (unsigned i = 0; i < batch.computationIds.size(); i ++) {
     logServer << "DEBUG: Processing results of computation " << i << Logger::endL;
-    std::string outputBinary((char*)  &this->thePipe.bufferOutputGPU[i * 32], 32);
-    output << "{\"id\":\"" << kernelSHA256->computationIds[i] << "\", \"result\": \"" << Miscellaneous::toStringHex(outputBinary)
-    << "\", \"packetSize\":" << this->packetNumberOfComputations << "}\n";
-    logServer << "Computation " << kernelSHA256->computationIds[i] << " completed." << Logger::endL;
+    if (this->flagBinaryProtocol) {
+      this->AppendResultBinary(BinaryFrame::opcodeSHA256, batch.computationIds[i], &batch.results[i * 32], 32);
+    } else {
+      std::string outputBinary((char*)  &batch.results[i * 32], 32);
+      output << "{\"id\":\"" << batch.computationIds[i] << "\", \"result\": \"" << Miscellaneous::toStringHex(outputBinary)
+      << "\", \"packetSize\":" << batch.packetSize << "}\n";
+    }
+    logServer << "Computation " << batch.computationIds[i] << " completed." << Logger::endL;
   }
-  kernelSHA256->computationIds.clear();
-  logServer << "DEBUG: computation ids cleared. " << Logger::endL;
   return true;
 }
 
-bool Server::QueueSignOneMessage(MessageFromNode& theMessage) {
-  if (theMessage.length != 32 * 3) {
+//Message layout: 32 bytes nonce, 32 bytes secret key, 32 bytes message hash.
+bool Server::CheckSignOneMessage(const MessageFromNode& theMessage) {
+  if (theMessage.length != 32 * 3 || theMessage.theMessage.size() != 32 * 3) {
     logServer << "Sign one message: got message of length: " << theMessage.length
     << ", expected " << 32 * 3 << " bytes." << Logger::endL;
     return false;
   }
   logServer << "Got 96 bytes, as expected: " << Miscellaneous::toStringHex(theMessage.theMessage) << Logger::endL;
+  return true;
+}
+
+bool Server::QueueSignOneMessage(MessageFromNode& theMessage) {
+  if (!Server::CheckSignOneMessage(theMessage)) {
+    return false;
+  }
   std::shared_ptr<GPUKernel> kernelSign = this->theGPU->getKernel(GPU::kernelSign);
-  std::vector<unsigned char>& outputSignatures = kernelSign->getOutput(0)->buffer;
-  std::vector<unsigned char>& nonces =           kernelSign->getOutput(2)->buffer;
-  std::vector<unsigned char>& secretKeys =       kernelSign->getInput(0)->buffer;
-  std::vector<unsigned char>& messages =         kernelSign->getInput(1)->buffer;
-  if (
-    messages.size()   + 32 > messages.capacity() ||
-    secretKeys.size() + 32 > secretKeys.capacity() ||
-    nonces.size()     + 32 > nonces.capacity() ||
-    (kernelSign->computationIds.size() + 1) * (MACRO_size_of_signature) > outputSignatures.capacity()
-  ) {
+  HostBuffer& nonces =           kernelSign->getOutput(2)->buffer;
+  HostBuffer& secretKeys =       kernelSign->getInput(0)->buffer;
+  HostBuffer& messages =         kernelSign->getInput(1)->buffer;
+  //Every argument of the kernel is sized per message.
+  if (kernelSign->computationIds.size() + 1 > kernelSign->maximumMessages) {
+    this->flagBufferFull = true;
     return false;
   }
   std::string theNonce         = theMessage.theMessage.substr(0,  32);
@@ -732,204 +2107,542 @@ bool Server::QueueSignOneMessage(MessageFromNode& theMessage) {
   nonces.insert(nonces.end(), theNonce.begin(), theNonce.end());
   secretKeys.insert(secretKeys.end(), theSecretKey.begin(), theSecretKey.end());
   messages.insert(messages.end(), theMessageToSign.begin(), theMessageToSign.end());
-  kernelSign->computationIds.push_back(theMessage.id);
+  this->AddComputation(*kernelSign, theMessage);
   this->packetNumberOfComputations ++;
   return true;
 }
 
-bool Server::ExecuteSignMessages() {
+bool Server::ExecuteSignMessages(cl_event& outputLaunchFinished) {
   std::shared_ptr<GPUKernel> kernelSign = this->theGPU->getKernel(GPU::kernelSign);
   if (!CryptoEC256k1GPU::initializeGeneratorContext(*this->theGPU.get())) {
     return false;
   }
   logServer << "DEBUG: Got to message signing. " << Logger::endL;
-  kernelSign->writeToBuffer(2, kernelSign->getOutput(2)->buffer);
-  kernelSign->writeToBuffer(3, kernelSign->getInput(0)->buffer);
-  kernelSign->writeToBuffer(4, kernelSign->getInput(1)->buffer);
-  for (unsigned i = 0; i < kernelSign->computationIds.size(); i ++) {
-    kernelSign->writeMessageIndex(i);
-    cl_int ret = clEnqueueNDRangeKernel(
-      this->theGPU->commandQueue,
-      kernelSign->kernel,
-      1,
-      NULL,
-      kernelSign->global_item_size,
-      kernelSign->local_item_size,
-      0,
-      NULL,
-      NULL
+  std::vector<cl_event> writes;
+  bool success =
+    kernelSign->writeToBufferAsync(2, kernelSign->getOutput(2)->buffer, std::vector<cl_event>(), writes) &&
+    kernelSign->writeToBufferAsync(3, kernelSign->getInput(0)->buffer, std::vector<cl_event>(), writes) &&
+    kernelSign->writeToBufferAsync(4, kernelSign->getInput(1)->buffer, std::vector<cl_event>(), writes) &&
+    kernelSign->enqueueBatchAsync(
+      0, kernelSign->computationIds.size(), kernelSign->getMessagesPerLaunch(), writes, outputLaunchFinished
     );
-    if (ret != CL_SUCCESS) {
-      logServer << "Failed to enqueue kernel. Return code: " << ret << ". ";
-      return false;
-    }
+  GPU::releaseEvents(writes);
+  if (!success) {
+    return false;
   }
+  //The host memory read by the pending writes is parked, see GPUKernel::rotateBuffers.
   kernelSign->getOutput(2)->buffer.clear();
   kernelSign->getInput(0)->buffer.clear();
   kernelSign->getInput(1)->buffer.clear();
   return true;
 }
-
-bool Server::ExecuteTestBuffers() {
-  std::shared_ptr<GPUKernel> kernelBuffers = this->theGPU->getKernel(GPU::kernelTestBuffer);
-
-  kernelBuffers->writeToBuffer(0, kernelBuffers->getOutput(0)->buffer);
-  kernelBuffers->writeToBuffer(1, kernelBuffers->getInput(0)->buffer);
-  for (unsigned i = 0; i < kernelBuffers->computationIds.size(); i ++) {
-    kernelBuffers->writeMessageIndex(i);
-    cl_int ret = clEnqueueNDRangeKernel(
-      this->theGPU->commandQueue,
-      kernelBuffers->kernel,
-      1,
-      NULL,
-      kernelBuffers->global_item_size,
-      kernelBuffers->local_item_size,
-      0,
-      NULL,
-      NULL
-    );
-    if (ret != CL_SUCCESS) {
-      logServer << "Failed to enqueue kernel. Return code: " << ret << ". ";
-      return false;
-    }
+//Message layout:
+//1 byte signature size, signature,
+//1 byte public key size, public key,
+//32 bytes message hash.
+bool Server::CheckVerifySignature(
+  const MessageFromNode& theMessage, unsigned int& outputSignatureSize, unsigned int& outputPublicKeySize
+) {
+  if (theMessage.theMessage.size() < 2 + 32) {
+    logServer << "Verify signature: message of length " << theMessage.theMessage.size() << " is too short. " << Logger::endL;
+    return false;
   }
+  unsigned int signatureSize = (unsigned char) theMessage.theMessage[0];
+  unsigned int publicKeyPosition = 1 + signatureSize;
+  if (publicKeyPosition >= theMessage.theMessage.size()) {
+    logServer << "Verify signature: signature of size " << signatureSize << " does not fit in the message. " << Logger::endL;
+    return false;
+  }
+  unsigned int publicKeySize = (unsigned char) theMessage.theMessage[publicKeyPosition];
+  if (
+    signatureSize > MACRO_size_of_signature ||
+    publicKeySize > MACRO_size_of_signature ||
+    2 + signatureSize + publicKeySize + 32 != theMessage.theMessage.size()
+  ) {
+    logServer << "Verify signature: got message of length: " << theMessage.theMessage.size()
+    << " with signature size " << signatureSize << " and public key size " << publicKeySize
+    << ", expected " << 2 + signatureSize + publicKeySize + 32 << " bytes. " << Logger::endL;
+    return false;
+  }
+  outputSignatureSize = signatureSize;
+  outputPublicKeySize = publicKeySize;
   return true;
 }
 
-bool Server::ProcessResultsTestBuffer(std::stringstream& output) {
-  std::shared_ptr<GPUKernel> kernelBuffers = this->theGPU->theKernels[this->theGPU->kernelTestBuffer];
-  cl_mem& resultBuffers = kernelBuffers->getOutput(0)->theMemory;
-  unsigned int totalSize = kernelBuffers->getOutput(0)->buffer.size();
-  kernelBuffers->getOutput(0)->buffer.clear();
-  cl_int ret = clEnqueueReadBuffer(
-    this->theGPU->commandQueue,
-    resultBuffers,
-    CL_TRUE,
-    0,
-    totalSize,
-    this->thePipe.bufferOutputGPU,
-    0,
-    NULL,
-    NULL
+bool Server::QueueVerifySignature(MessageFromNode& theMessage) {
+  unsigned int signatureSize = 0, publicKeySize = 0;
+  if (!Server::CheckVerifySignature(theMessage, signatureSize, publicKeySize)) {
+    return false;
+  }
+  unsigned int publicKeyPosition = 1 + signatureSize;
+  std::shared_ptr<GPUKernel> kernelVerify = this->theGPU->getKernel(GPU::kernelVerifySignature);
+  HostBuffer& signatures =     kernelVerify->getInput(0)->buffer;
+  HostBuffer& signatureSizes = kernelVerify->getInput(1)->buffer;
+  HostBuffer& publicKeys =     kernelVerify->getInput(2)->buffer;
+  HostBuffer& publicKeySizes = kernelVerify->getInput(3)->buffer;
+  HostBuffer& messages =       kernelVerify->getInput(4)->buffer;
+  unsigned int numberOfQueued = kernelVerify->computationIds.size();
+  if (numberOfQueued + 1 > kernelVerify->maximumMessages) {
+    this->flagBufferFull = true;
+    return false;
+  }
+  //Signatures and public keys are read by the kernel at a
+  //stride of MACRO_size_of_signature bytes.
+  signatures.resize((numberOfQueued + 1) * MACRO_size_of_signature, 0);
+  publicKeys.resize((numberOfQueued + 1) * MACRO_size_of_signature, 0);
+  signatureSizes.resize((numberOfQueued + 1) * 4);
+  publicKeySizes.resize((numberOfQueued + 1) * 4);
+  std::copy(
+    theMessage.theMessage.begin() + 1,
+    theMessage.theMessage.begin() + publicKeyPosition,
+    signatures.begin() + numberOfQueued * MACRO_size_of_signature
   );
-  if (ret != CL_SUCCESS) {
-    logServer << "Failed to read buffer. " << Logger::endL;
-    return false;
-  }
-  cl_mem& resultOffsets = kernelBuffers->getInput(0)->theMemory;
-  ret = clEnqueueReadBuffer(
-    this->theGPU->commandQueue,
-    resultOffsets,
-    CL_TRUE,
-    0,
-    kernelBuffers->computationIds.size() * 4,
-    this->thePipe.bufferOutputGPU_second,
-    0,
-    NULL,
-    NULL
+  std::copy(
+    theMessage.theMessage.begin() + publicKeyPosition + 1,
+    theMessage.theMessage.begin() + publicKeyPosition + 1 + publicKeySize,
+    publicKeys.begin() + numberOfQueued * MACRO_size_of_signature
   );
-  if (ret != CL_SUCCESS) {
-    logServer << "Failed to read buffer. " << Logger::endL;
+  memoryPool_write_uint(signatureSize, &signatureSizes[numberOfQueued * 4]);
+  memoryPool_write_uint(publicKeySize, &publicKeySizes[numberOfQueued * 4]);
+  messages.insert(messages.end(), theMessage.theMessage.end() - 32, theMessage.theMessage.end());
+  this->AddComputation(*kernelVerify, theMessage);
+  return true;
+}
+
+bool Server::ExecuteVerifySignatures(cl_event& outputLaunchFinished) {
+  std::shared_ptr<GPUKernel> kernelVerify = this->theGPU->getKernel(GPU::kernelVerifySignature);
+  if (!CryptoEC256k1GPU::initializeMultiplicationContext(*this->theGPU.get())) {
+    return false;
+  }
+  if (!kernelVerify->build()) {
+    return false;
+  }
+  std::vector<cl_event> writes;
+  bool success = true;
+  for (int i = 0; i < 5 && success; i ++) {
+    success = kernelVerify->writeToBufferAsync(2 + i, kernelVerify->getInput(i)->buffer, std::vector<cl_event>(), writes);
+  }
+  //Within the number of signature memory pool slots, see GPUKernel::messagesPerLaunchLimit.
+  success = success && kernelVerify->enqueueBatchAsync(
+    0, kernelVerify->computationIds.size(), kernelVerify->getMessagesPerLaunch(), writes, outputLaunchFinished
+  );
+  GPU::releaseEvents(writes);
+  if (!success) {
+    return false;
+  }
+  //The host memory read by the pending writes is parked, see GPUKernel::rotateBuffers.
+  for (int i = 0; i < 5; i ++) {
+    kernelVerify->getInput(i)->buffer.clear();
+  }
+  return true;
+}
+//Message layout: 32 bytes secret key, optionally followed by
+//1 byte that requests compressed serialization when non-zero.
+bool Server::CheckGeneratePublicKey(const MessageFromNode& theMessage) {
+  if (theMessage.theMessage.size() != 32 && theMessage.theMessage.size() != 33) {
+    logServer << "Generate public key: got message of length: " << theMessage.theMessage.size()
+    << ", expected 32 or 33 bytes." << Logger::endL;
+    return false;
+  }
+  return true;
+}
+
+bool Server::QueueGeneratePublicKey(MessageFromNode& theMessage) {
+  if (!Server::CheckGeneratePublicKey(theMessage)) {
     return false;
   }
+  std::shared_ptr<GPUKernel> kernelPublicKeys = this->theGPU->getKernel(GPU::kernelGeneratePublicKey);
+  HostBuffer& secretKeys =       kernelPublicKeys->getInput(0)->buffer;
+  HostBuffer& compressionFlags = kernelPublicKeys->getInput(1)->buffer;
+  unsigned int numberOfQueued = kernelPublicKeys->computationIds.size();
+  if (numberOfQueued + 1 > kernelPublicKeys->maximumMessages) {
+    this->flagBufferFull = true;
+    return false;
+  }
+  bool compressed = theMessage.theMessage.size() == 33 && theMessage.theMessage[32] != 0;
+  secretKeys.insert(secretKeys.end(), theMessage.theMessage.begin(), theMessage.theMessage.begin() + 32);
+  compressionFlags.push_back(compressed ? 1 : 0);
+  this->AddComputation(*kernelPublicKeys, theMessage);
+  return true;
+}
+
+bool Server::ExecuteGeneratePublicKeys(cl_event& outputLaunchFinished) {
+  std::shared_ptr<GPUKernel> kernelPublicKeys = this->theGPU->getKernel(GPU::kernelGeneratePublicKey);
+  if (!CryptoEC256k1GPU::initializeGeneratorContext(*this->theGPU.get())) {
+    return false;
+  }
+  if (!kernelPublicKeys->build()) {
+    return false;
+  }
+  std::vector<cl_event> writes;
+  bool success =
+    kernelPublicKeys->writeToBufferAsync(3, kernelPublicKeys->getInput(0)->buffer, std::vector<cl_event>(), writes) &&
+    kernelPublicKeys->writeToBufferAsync(4, kernelPublicKeys->getInput(1)->buffer, std::vector<cl_event>(), writes) &&
+    kernelPublicKeys->enqueueBatchAsync(
+      0, kernelPublicKeys->computationIds.size(), kernelPublicKeys->getMessagesPerLaunch(), writes, outputLaunchFinished
+    );
+  GPU::releaseEvents(writes);
+  if (!success) {
+    return false;
+  }
+  //The host memory read by the pending writes is parked, see GPUKernel::rotateBuffers.
+  kernelPublicKeys->getInput(0)->buffer.clear();
+  kernelPublicKeys->getInput(1)->buffer.clear();
+  return true;
+}
+bool Server::ExecuteTestBuffers(cl_event& outputLaunchFinished) {
+  std::shared_ptr<GPUKernel> kernelBuffers = this->theGPU->getKernel(GPU::kernelTestBuffer);
+  std::vector<cl_event> writes;
+  bool success =
+    kernelBuffers->writeToBufferAsync(0, kernelBuffers->getOutput(0)->buffer, std::vector<cl_event>(), writes) &&
+    kernelBuffers->writeToBufferAsync(1, kernelBuffers->getInput(0)->buffer, std::vector<cl_event>(), writes) &&
+    kernelBuffers->enqueueBatchAsync(
+      0, kernelBuffers->computationIds.size(), kernelBuffers->getMessagesPerLaunch(), writes, outputLaunchFinished
+    );
+  GPU::releaseEvents(writes);
+  return success;
+}
+bool Server::ProcessResultsTestBuffer(InFlightBatch& batch, std::stringstream& output) {
+  unsigned int totalSize = batch.resultsSize;
 
-  for (unsigned i = 0; i < kernelBuffers->computationIds.size(); i ++) {
-    unsigned currentOffset = memoryPool_read_uint(&this->thePipe.bufferOutputGPU_second[i * 4]);
+  for (unsigned i = 0; i < batch.computationIds.size(); i ++) {
+    unsigned currentOffset = memoryPool_read_uint(&batch.resultsSecond[i * 4]);
     unsigned nextOffset = -1;
-    if (i + 1 < kernelBuffers->computationIds.size()) {
-      nextOffset = memoryPool_read_uint(&this->thePipe.bufferOutputGPU_second[(i + 1) * 4]);
+    if (i + 1 < batch.computationIds.size()) {
+      nextOffset = memoryPool_read_uint(&batch.resultsSecond[(i + 1) * 4]);
     } else {
       nextOffset = totalSize;
     }
     signed currentSize = nextOffset - currentOffset;
-    output << "{\"id\":\"" << kernelBuffers->computationIds[i] << "\", \"result\": \"" << currentSize
-    << " bytes read, no work performed.\", \"packetSize\":" << this->packetNumberOfComputations << "}\n";
-    logServer << "Computation " << kernelBuffers->computationIds[i] << " completed." << Logger::endL;
+    if (this->flagBinaryProtocol) {
+      unsigned char sizeBytes[4];
+      memoryPool_write_uint(currentSize, sizeBytes);
+      this->AppendResultBinary(BinaryFrame::opcodeTestBuffer, batch.computationIds[i], sizeBytes, 4);
+    } else {
+      output << "{\"id\":\"" << batch.computationIds[i] << "\", \"result\": \"" << currentSize
+      << " bytes read, no work performed.\", \"packetSize\":" << batch.packetSize << "}\n";
+    }
+    logServer << "Computation " << batch.computationIds[i] << " completed." << Logger::endL;
   }
-  kernelBuffers->computationIds.clear();
   return true;
 }
 
-bool Server::ProcessResultSignMessages(std::stringstream &output) {
-  if (!this->theGPU->initializeAllNoBuild()) {
-    return false;
-  }
-  std::shared_ptr<GPUKernel> kernelSign = this->theGPU->theKernels[this->theGPU->kernelSign];
-  if (kernelSign->computationIds.size() == 0) {
+bool Server::ProcessResultSignMessages(InFlightBatch& batch, std::stringstream& output) {
+  if (batch.computationIds.size() == 0) {
     return true;
   }
-  if (!kernelSign->build()) {
-    return false;
+
+  for (unsigned i = 0; i < batch.computationIds.size(); i ++) {
+    unsigned currentSize = memoryPool_read_uint(&batch.resultsSecond[i * 4]);
+    if (this->flagBinaryProtocol) {
+      this->AppendResultBinary(
+        BinaryFrame::opcodeSignOneMessage, batch.computationIds[i],
+        &batch.results[i * MACRO_size_of_signature], currentSize
+      );
+    } else {
+      std::string outputBinary((char*) &batch.results[i * MACRO_size_of_signature], currentSize);
+      output << "{\"id\":\"" << batch.computationIds[i] << "\", \"result\": \"" << Miscellaneous::toStringHex(outputBinary)
+      << "\", \"packetSize\":" << batch.packetSize << "}\n";
+    }
+    logServer << "Computation " << batch.computationIds[i] << " completed." << Logger::endL;
   }
-  cl_mem& resultSignatures = kernelSign->getOutput(0)->theMemory;
-  cl_int ret = clEnqueueReadBuffer(
-    this->theGPU->commandQueue,
-    resultSignatures,
-    CL_TRUE,
-    0,
-    kernelSign->computationIds.size() * MACRO_size_of_signature,
-    this->thePipe.bufferOutputGPU,
-    0,
-    NULL,
-    NULL
-  );
-  if (ret != CL_SUCCESS) {
-    logServer << "Failed to read buffer. " << Logger::endL;
-    return false;
-  }
-  cl_mem& resultSignatureSizes = kernelSign->getOutput(1)->theMemory;
-  ret = clEnqueueReadBuffer(
-    this->theGPU->commandQueue,
-    resultSignatureSizes,
-    CL_TRUE,
-    0,
-    kernelSign->computationIds.size() * 4,
-    this->thePipe.bufferOutputGPU_second,
-    0,
-    NULL,
-    NULL
-  );
-  if (ret != CL_SUCCESS) {
-    logServer << "Failed to read buffer. " << Logger::endL;
-    return false;
+  return true;
+}
+
+bool Server::ProcessResultsVerifySignatures(InFlightBatch& batch, std::stringstream& output) {
+  if (batch.computationIds.size() == 0) {
+    return true;
+  }
+  for (unsigned i = 0; i < batch.computationIds.size(); i ++) {
+    //1 = valid, 0 = invalid, negative values = public key or signature failed to parse.
+    if (this->flagBinaryProtocol) {
+      this->AppendResultBinary(BinaryFrame::opcodeVerifySignature, batch.computationIds[i], &batch.results[i], 1);
+    } else {
+      int verificationResult = (signed char) batch.results[i];
+      output << "{\"id\":\"" << batch.computationIds[i] << "\", \"result\": \"" << verificationResult
+      << "\", \"packetSize\":" << batch.packetSize << "}\n";
+    }
+    logServer << "Computation " << batch.computationIds[i] << " completed." << Logger::endL;
   }
+  return true;
+}
 
-  for (unsigned i = 0; i < kernelSign->computationIds.size(); i ++) {
-    unsigned currentSize = memoryPool_read_uint(&this->thePipe.bufferOutputGPU_second[i * 4]);
-    std::string outputBinary((char*) &this->thePipe.bufferOutputGPU[i * MACRO_size_of_signature], currentSize);
-    output << "{\"id\":\"" << kernelSign->computationIds[i] << "\", \"result\": \"" << Miscellaneous::toStringHex(outputBinary)
-    << "\", \"packetSize\":" << this->packetNumberOfComputations << "}\n";
-    logServer << "Computation " << kernelSign->computationIds[i] << " completed." << Logger::endL;
+bool Server::ProcessResultsGeneratePublicKeys(InFlightBatch& batch, std::stringstream& output) {
+  if (batch.computationIds.size() == 0) {
+    return true;
+  }
+  for (unsigned i = 0; i < batch.computationIds.size(); i ++) {
+    //Size 0 means the secret key was invalid.
+    unsigned currentSize = memoryPool_read_uint(&batch.resultsSecond[i * 4]);
+    if (this->flagBinaryProtocol) {
+      this->AppendResultBinary(
+        BinaryFrame::opcodeGeneratePublicKey, batch.computationIds[i],
+        &batch.results[i * MACRO_size_of_signature], currentSize
+      );
+    } else {
+      std::string outputBinary((char*) &batch.results[i * MACRO_size_of_signature], currentSize);
+      output << "{\"id\":\"" << batch.computationIds[i] << "\", \"result\": \"" << Miscellaneous::toStringHex(outputBinary)
+      << "\", \"packetSize\":" << batch.packetSize << "}\n";
+    }
+    logServer << "Computation " << batch.computationIds[i] << " completed." << Logger::endL;
   }
-  kernelSign->computationIds.clear();
   return true;
 }
 
+std::shared_ptr<ClientConnection> Server::getConnection(unsigned int connectionId) {
+  std::lock_guard<std::mutex> lock(this->connectionsLock);
+  std::unordered_map<unsigned int, std::shared_ptr<ClientConnection> >::iterator found = this->connections.find(connectionId);
+  if (found == this->connections.end()) {
+    return nullptr;
+  }
+  return found->second;
+}
+
+void Server::AppendFrameBinary(
+  unsigned char opcode, unsigned char status, const std::string& id, const unsigned char* result, unsigned int resultSize
+) {
+  unsigned int connectionId = 0;
+  unsigned int requestId = 0;
+  if (!BinaryFrame::parseComputationId(id, connectionId, requestId)) {
+    logServer << "Bad computation id: " << id << ". " << Logger::endL;
+    return;
+  }
+  std::string& output = this->outputBinary[connectionId];
+  unsigned char header[BinaryFrame::headerSize];
+  BinaryFrame::writeHeader(header, opcode, status, requestId, resultSize);
+  output.append((char*) header, BinaryFrame::headerSize);
+  if (resultSize > 0) {
+    output.append((const char*) result, resultSize);
+  }
+}
+
+void Server::AppendResultBinary(
+  unsigned char opcode, const std::string& id, const unsigned char* result, unsigned int resultSize
+) {
+  this->AppendFrameBinary(opcode, BinaryFrame::statusOK, id, result, resultSize);
+}
+
+void Server::AppendErrorBinary(MessageFromNode& failedMessage) {
+  this->AppendFrameBinary(
+    BinaryFrame::opcodeFromCommand(failedMessage.command), BinaryFrame::statusError, failedMessage.id, nullptr, 0
+  );
+}
+
+//Hands the results of the current packet to the writer thread.
 bool Server::WriteResults(std::stringstream& output) {
-  logServer << "Writing computation packet ..." << Logger::endL;
-  int numWrittenBytes = write(this->thePipe.fileDescriptorOutputData, output.str().c_str(), output.str().size());
-  logServer << "Computation output written." << Logger::endL;
-  if (numWrittenBytes < 0) {
-    logServer << "Error writing bytes. " << Logger::endL;
-    return false;
+  if (!this->flagBinaryProtocol) {
+    OutgoingResult packet;
+    packet.bytes = output.str();
+    if (packet.bytes.empty()) {
+      return true;
+    }
+    return this->outgoingResults.pushWait(packet, this->flagStop);
   }
-  if (numWrittenBytes < (signed) output.str().size()) {
-    logServer << "Did not manage to write all bytes. " << Logger::endL;
-    return false;
+  //Binary results were collected per connection by AppendResultBinary.
+  for (
+    std::unordered_map<unsigned int, std::string>::iterator current = this->outputBinary.begin();
+    current != this->outputBinary.end();
+    current ++
+  ) {
+    OutgoingResult packet;
+    packet.connectionId = current->first;
+    packet.bytes = std::move(current->second);
+    if (!this->outgoingResults.pushWait(packet, this->flagStop)) {
+      return false;
+    }
   }
+  this->outputBinary.clear();
   return true;
 }
 
-bool Server::ProcessResults() {
+bool Server::AnswerStatistics(MessageFromNode& theMessage) {
+  if (!theMessage.flagBusy) {
+    this->numberOfRequestsInFlight --;
+  }
+  std::string statistics = this->ToJSONStatistics();
   std::stringstream output;
-  if (!this->ProcessResultsSha256(output)) {
-    return false;
+  if (this->flagBinaryProtocol) {
+    this->AppendFrameBinary(
+      BinaryFrame::opcodeStats, BinaryFrame::statusOK, theMessage.id,
+      (const unsigned char*) statistics.data(), statistics.size()
+    );
+  } else {
+    output << "{\"id\":\"" << theMessage.id << "\", \"result\": " << statistics << "}\n";
   }
-  if (!this->ProcessResultSignMessages(output)) {
-    return false;
+  return this->WriteResults(output);
+}
+
+/* Format: {"devices":[{"device":0,"name":"...","kernels":{"sha256GPU":{...}, ...}}, ...]},
+ * one entry per kernel with at least one profiled command, see KernelStatistics::toJSON.
+ * Comparing the totalSeconds of transfer and execute tells whether a kernel is transfer or compute bound.
+ */
+std::string Server::ToJSONStatistics() {
+  std::stringstream out;
+  out << "{\"devices\":[";
+  for (unsigned i = 0; i < this->devices.theGPUs.size(); i ++) {
+    GPU& current = *this->devices.theGPUs[i];
+    out << (i == 0 ? "" : ",") << "{\"device\":" << i << ",\"name\":\"" << current.getId() << "\",\"kernels\":{";
+    bool flagFirst = true;
+    for (
+      std::unordered_map<std::string, std::shared_ptr<GPUKernel> >::iterator kernel = current.theKernels.begin();
+      kernel != current.theKernels.end();
+      kernel ++
+    ) {
+      KernelStatistics statistics = kernel->second->getStatistics();
+      if (statistics.queueWait.count == 0) {
+        continue;
+      }
+      out << (flagFirst ? "" : ",") << "\"" << kernel->first << "\":";
+      statistics.toJSON(out);
+      flagFirst = false;
+    }
+    out << "}}";
   }
-  if (!this->ProcessResultsTestBuffer(output)){
-    return false;
+  out << "]}";
+  return out.str();
+}
+
+//Logs nothing while no kernel runs.
+void Server::LogStatisticsPeriodically() {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (std::chrono::duration<double>(now - this->timeStatisticsLogged).count() < Server::statisticsLogIntervalInSeconds) {
+    return;
+  }
+  this->timeStatisticsLogged = now;
+  unsigned long long launches = 0;
+  std::vector<std::string> lines;
+  for (unsigned i = 0; i < this->devices.theGPUs.size(); i ++) {
+    GPU& current = *this->devices.theGPUs[i];
+    for (
+      std::unordered_map<std::string, std::shared_ptr<GPUKernel> >::iterator kernel = current.theKernels.begin();
+      kernel != current.theKernels.end();
+      kernel ++
+    ) {
+      KernelStatistics statistics = kernel->second->getStatistics();
+      if (statistics.numberOfLaunches == 0) {
+        continue;
+      }
+      launches += statistics.numberOfLaunches;
+      std::stringstream line;
+      line << "Device " << i << ", " << kernel->first << ": " << statistics.toStringSummary();
+      lines.push_back(line.str());
+    }
+  }
+  if (launches == this->launchesLogged) {
+    return;
+  }
+  this->launchesLogged = launches;
+  for (unsigned i = 0; i < lines.size(); i ++) {
+    logServer << lines[i] << Logger::endL;
+  }
+}
+
+/* Hands the results of each batch to the writer thread as soon as
+ * the batch's read-back completes, in completion order,
+ * so that cheap operations are not held up by slow ones launched earlier.
+ * Does not wait for batches still running.
+ */
+bool Server::ProcessCompletedBatches() {
+  std::list<std::shared_ptr<InFlightBatch> >::iterator current = this->batchesInFlight.begin();
+  while (current != this->batchesInFlight.end()) {
+    InFlightBatch& batch = **current;
+    //Set by the completion callback registered in EnqueueReadBack.
+    cl_int status = batch.completionStatus.load();
+    if (status < 0) {
+      if (!this->FailBatch(batch, status)) {
+        return false;
+      }
+      current = this->batchesInFlight.erase(current);
+      continue;
+    }
+    if (status != CL_COMPLETE) {
+      current ++;
+      continue;
+    }
+    if (batch.deviceIndex == this->CPUDeviceIndex()) {
+      batch.results = batch.data.data();
+      batch.resultsSecond = batch.dataSecond.data();
+      batch.resultsSize = batch.data.size();
+    }
+    std::stringstream output;
+    if (!this->ProcessResultsOfKernel(batch, output)) {
+      return false;
+    }
+    if (
+      batch.deviceIndex != this->CPUDeviceIndex() &&
+      !this->devices.theGPUs[batch.deviceIndex]->getKernel(batch.kernelName)->releaseReadBacks(batch.slot)
+    ) {
+      return false;
+    }
+    if (!this->WriteResults(output)) {
+      return false;
+    }
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < batch.timesReceived.size(); i ++) {
+      std::chrono::duration<double> latency = now - batch.timesReceived[i];
+      this->scheduler.recordLatency(batch.command, latency.count());
+    }
+    this->scheduler.adapt(batch.command, batch.flagFull);
+    this->devices.recordBatch(
+      batch.deviceIndex,
+      batch.kernelName,
+      batch.computationIds.size(),
+      batch.predictedSeconds,
+      batch.timeLaunched,
+      batch.timeCompleted
+    );
+    this->numberOfRequestsInFlight -= batch.computationIds.size();
+    current = this->batchesInFlight.erase(current);
   }
+  //Binary errors of requests that were never launched.
+  std::stringstream noResults;
+  return this->WriteResults(noResults);
+}
+
+bool Server::FailBatch(InFlightBatch& batch, cl_int status) {
+  logServer << Logger::colorRed << "Reading the results of " << batch.kernelName << " on backend " << batch.deviceIndex
+  << " failed with status: " << status << ". Failing its " << batch.computationIds.size() << " request(s). "
+  << Logger::colorNormal << Logger::endL;
+  std::stringstream output;
+  for (unsigned i = 0; i < batch.computationIds.size(); i ++) {
+    if (this->flagBinaryProtocol) {
+      this->AppendFrameBinary(
+        BinaryFrame::opcodeFromCommand(batch.command), BinaryFrame::statusError, batch.computationIds[i], nullptr, 0
+      );
+    } else {
+      output << "{\"id\":\"" << batch.computationIds[i] << "\", \"error\": \"" << batch.kernelName
+      << " failed with status " << status << "\"}\n";
+    }
+  }
+  if (batch.deviceIndex != this->CPUDeviceIndex()) {
+    //A failed unmap is logged; the slot is reused all the same.
+    this->devices.theGPUs[batch.deviceIndex]->getKernel(batch.kernelName)->releaseReadBacks(batch.slot);
+  }
+  //No measurement: only the charge of the batch is released.
+  this->devices.recordBatch(
+    batch.deviceIndex, batch.kernelName, 0, batch.predictedSeconds, batch.timeLaunched, batch.timeCompleted
+  );
+  this->numberOfRequestsInFlight -= batch.computationIds.size();
   return this->WriteResults(output);
 }
+
+bool Server::ProcessResultsOfKernel(InFlightBatch& batch, std::stringstream& output) {
+  const std::string& kernelName = batch.kernelName;
+  if (kernelName == GPU::kernelSHA256) {
+    return this->ProcessResultsSha256(batch, output);
+  }
+  if (kernelName == GPU::kernelSign) {
+    return this->ProcessResultSignMessages(batch, output);
+  }
+  if (kernelName == GPU::kernelTestBuffer) {
+    return this->ProcessResultsTestBuffer(batch, output);
+  }
+  if (kernelName == GPU::kernelVerifySignature) {
+    return this->ProcessResultsVerifySignatures(batch, output);
+  }
+  if (kernelName == GPU::kernelGeneratePublicKey) {
+    return this->ProcessResultsGeneratePublicKeys(batch, output);
+  }
+  logServer << "No result processing for kernel " << kernelName << ". " << Logger::endL;
+  return false;
+}
@@ -2,7 +2,15 @@
 #define SERVER_H_header
 #include <memory>
 #include <queue>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include "gpu.h"
+#include "queues.h"
+#include "cpu_backend.h"
 
 class MessageFromNode {
 public:
@@ -10,6 +18,8 @@ public:
   int length;
   std::string id;
   std::string command;
+  std::chrono::steady_clock::time_point timeReceived; //<- set by the ingest thread
+  bool flagBusy; //<- read past the high-water mark: answered with BinaryFrame::statusBusy
   void reset();
   std::string toString();
   MessageFromNode() {
@@ -17,6 +27,158 @@ public:
   }
 };
 
+//Optional binary protocol, used in place of the metadata/data/output socket triple
+//when Server::flagBinaryProtocol is set.
+//Any number of clients may connect; each client uses a single connection.
+//Requests and results travel on that connection as frames:
+//a BinaryFrame::headerSize-byte header followed by the raw payload.
+//Header layout (integers are big-endian, as written by memoryPool_write_uint):
+//byte 0: opcode,
+//byte 1: status (results only, 0 = ok, 1 = rejected, 2 = busy: resend later),
+//bytes 2-3: reserved, zero,
+//bytes 4-7: request id, echoed back in the result,
+//bytes 8-11: payload length.
+//A stats request (opcodeStats) has an empty payload; its result is the JSON of Server::ToJSONStatistics.
+class BinaryFrame {
+public:
+  static const unsigned int headerSize = 12;
+  static const unsigned char statusOK = 0;
+  static const unsigned char statusError = 1; //<- request rejected, empty payload
+  static const unsigned char statusBusy = 2; //<- server overloaded, request not run, empty payload
+  static const unsigned char opcodeSHA256 = 1;
+  static const unsigned char opcodeSignOneMessage = 2;
+  static const unsigned char opcodeTestBuffer = 3;
+  static const unsigned char opcodeVerifySignature = 4;
+  static const unsigned char opcodeGeneratePublicKey = 5;
+  static const unsigned char opcodeStats = 6;
+  //Returns the empty string for unknown opcodes.
+  static std::string commandFromOpcode(unsigned char opcode);
+  //Returns 0 for unknown commands.
+  static unsigned char opcodeFromCommand(const std::string& command);
+  //Number of whole frames at the start of frames.
+  static unsigned int countFrames(const std::string& frames);
+  //Computation ids of binary requests have the form connectionId:requestId.
+  static std::string computationId(unsigned int connectionId, unsigned int requestId);
+  static bool parseComputationId(const std::string& input, unsigned int& outputConnectionId, unsigned int& outputRequestId);
+  static void writeHeader(
+    unsigned char* output, unsigned char opcode, unsigned char status, unsigned int requestId, unsigned int payloadLength
+  );
+};
+
+//One binary protocol client.
+//Read by the ingest thread (Server::RunOnceEventLoop),
+//written by the writer thread (Server::RunWriter).
+class ClientConnection {
+public:
+  static const int readBufferSize = 1000000;
+  int fileDescriptor;
+  unsigned int id;
+  std::vector<char> readBuffer;
+  std::string incompleteFrame; //<- ingest thread only
+  std::string pendingOutput; //<- writer thread only
+  //Set by the ingest thread once the client closed its side of the connection:
+  //the connection is then kept for the results of its requests, see Server::CloseIfAnswered.
+  std::atomic<bool> flagReadClosed;
+  //Frames read by the ingest thread minus frames of results handed to the writer thread.
+  std::atomic<unsigned int> numberOfUnansweredRequests;
+  bool ReadAvailable(std::deque<MessageFromNode>& output, unsigned int maximumPayloadLength);
+  bool WritePending();
+  ClientConnection(int inputFileDescriptor, unsigned int inputId);
+  ~ClientConnection();
+};
+
+//Collects requests per command until the command's batch is full
+//or its oldest request has waited maximumWait.
+//The size of a full batch adapts to keep the p99 latency,
+//measured from ingest to results handed to the writer, under latencyTargetInSeconds.
+//Used by the dispatch thread only.
+class BatchScheduler {
+public:
+  class CommandBatches {
+  public:
+    std::deque<MessageFromNode> pending;
+    unsigned int batchSize;
+    std::vector<double> recentLatencies; //<- ring buffer of the last latencySamples latencies, in seconds
+    unsigned int nextLatencyIndex;
+    bool flagOnHold; //<- the command's kernels are still warming up: its requests wait
+    CommandBatches();
+  };
+  static const unsigned int latencySamples = 1024;
+  static const unsigned int minimumLatencySamples = 32;
+  std::unordered_map<std::string, CommandBatches> commands;
+  unsigned int numberOfPending;
+  //Configuration.
+  unsigned int initialBatchSize;
+  unsigned int minimumBatchSize;
+  unsigned int maximumBatchSize;
+  std::chrono::microseconds maximumWait;
+  double latencyTargetInSeconds;
+
+  void add(MessageFromNode& message);
+  bool empty();
+  bool isReady(CommandBatches& batches, std::chrono::steady_clock::time_point now, bool flagFlushAll);
+  bool hasReady(std::chrono::steady_clock::time_point now, bool flagFlushAll);
+  void takeReady(
+    std::deque<MessageFromNode>& output,
+    std::vector<std::string>& outputFullCommands,
+    std::chrono::steady_clock::time_point now,
+    bool flagFlushAll
+  );
+  void returnToFront(std::deque<MessageFromNode>& messages);
+  void recordLatency(const std::string& command, double latencyInSeconds);
+  double percentile99(const std::string& command);
+  void adapt(const std::string& command, bool batchWasFull);
+  BatchScheduler();
+};
+
+//One launched batch of a kernel, from its launch until its results are handed to the writer thread.
+//Holds the host copy of the results, read without blocking right after the launches are enqueued.
+class InFlightBatch {
+public:
+  std::string kernelName;
+  unsigned int deviceIndex; //<- index of the device in Server::devices
+  unsigned int slot; //<- the kernel's buffer ring slot the batch occupies
+  std::vector<std::string> computationIds;
+  std::vector<std::chrono::steady_clock::time_point> timesReceived;
+  std::string command;
+  bool flagFull; //<- the scheduler released the batch because it reached its size
+  int packetSize;
+  std::vector<unsigned char> data;
+  std::vector<unsigned char> dataSecond; //<- result sizes or offsets, depending on the kernel
+  //The results: data and dataSecond on the CPU backend; for a batch of a device,
+  //the host memory its results were read back to, until they are processed, see GPUKernel::readBackAsync.
+  const unsigned char* results;
+  const unsigned char* resultsSecond;
+  size_t resultsSize;
+  //CL_COMPLETE once both data and dataSecond are filled, negative on failure;
+  //stored by an OpenCL completion callback.
+  std::atomic<cl_int> completionStatus;
+  std::chrono::steady_clock::time_point timeLaunched;
+  std::chrono::steady_clock::time_point timeCompleted; //<- written by the completion callback before completionStatus
+  double predictedSeconds; //<- charged to the backend at launch, see DeviceManager::charge
+  InFlightBatch() {
+    this->deviceIndex = 0;
+    this->slot = 0;
+    this->flagFull = false;
+    this->packetSize = 0;
+    this->results = nullptr;
+    this->resultsSecond = nullptr;
+    this->resultsSize = 0;
+    this->predictedSeconds = 0;
+    this->completionStatus = CL_QUEUED;
+  }
+};
+
+//A packet of results on its way to the writer thread.
+class OutgoingResult {
+public:
+  unsigned int connectionId; //<- binary protocol only
+  std::string bytes;
+  OutgoingResult() {
+    this->connectionId = 0;
+  }
+};
+
 class PipeBasic {
 public:
   int position;
@@ -49,8 +211,6 @@ public:
 
   PipeBasic* inputData;
   PipeBasic* inputMeta;
-  unsigned char* bufferOutputGPU;
-  unsigned char* bufferOutputGPU_second;
   std::string toStringPendingMessages();
   bool ReadNext();
   MessagePipeline();
@@ -60,11 +220,68 @@ public:
 class Server
 {
 public:
+  DeviceManager devices;
+  //Takes the share of each batch DeviceManager::split gives it, all of it when no OpenCL device is found.
+  //Addressed as the device with index CPUDeviceIndex().
+  CPUBackend cpu;
+  //Dispatch thread only: requests queued on the CPU for the current launch, by command.
+  std::unordered_map<std::string, std::shared_ptr<InFlightBatch> > batchesOnCPU;
+  std::unordered_map<std::string, std::shared_ptr<std::vector<std::string> > > requestsOnCPU;
+  //Dispatch thread only: the device the Queue* and Execute* functions work on, see SelectDevice.
   std::shared_ptr<GPU> theGPU;
+  unsigned int currentDevice;
   bool flagInitialized;
+  bool flagBinaryProtocol;
   int listeningSocketMetaData;
   int listeningSocketData;
   int listeningSocketOutputData;
+  int listeningSocketBinary;
+  int epollFileDescriptor;
+  unsigned int lastConnectionId;
+  //Shared by the ingest and writer threads, guarded by connectionsLock.
+  std::unordered_map<unsigned int, std::shared_ptr<ClientConnection> > connections;
+  std::mutex connectionsLock;
+
+  static const unsigned int queueCapacity = 65536;
+  //Ingest thread -> dispatch thread.
+  BoundedQueue<MessageFromNode> incomingMessages;
+  //Dispatch thread -> writer thread.
+  BoundedQueue<OutgoingResult> outgoingResults;
+  std::atomic<bool> flagStop;
+  //Requests pushed by the ingest thread whose results are not yet produced.
+  std::atomic<unsigned int> numberOfRequestsInFlight;
+  unsigned int highWaterMark;
+  unsigned int lowWaterMark;
+  bool flagIngestPaused; //<- ingest thread only
+  //Set by the Queue* functions when a request was refused only because the staging buffers are full.
+  bool flagBufferFull;
+  std::atomic<bool> flagDispatchFinished;
+  //Dispatch thread only.
+  BatchScheduler scheduler;
+  //Number of device buffer slots of each server kernel:
+  //a kernel launches its next batch while its previous one is still in flight.
+  static const unsigned int bufferRingDepth = 2;
+  //A summary of the kernel statistics is logged at most this often, when kernels ran in between.
+  static const unsigned int statisticsLogIntervalInSeconds = 60;
+  //Dispatch thread only, see LogStatisticsPeriodically.
+  std::chrono::steady_clock::time_point timeStatisticsLogged;
+  unsigned long long launchesLogged;
+  //Dispatch thread only: launched batches whose results are not yet handed to the writer thread, in launch order.
+  std::list<std::shared_ptr<InFlightBatch> > batchesInFlight;
+  //Dispatch thread only: receive times and command of the requests queued in each kernel, by kernel name.
+  std::unordered_map<std::string, std::vector<std::chrono::steady_clock::time_point> > timesQueued;
+  std::unordered_map<std::string, std::string> commandsQueued;
+  //Dispatch thread only: commands whose batches in the current packet were released for being full.
+  std::vector<std::string> commandsWithFullBatches;
+  //Dispatch thread only: binary results of the current packet, by connection id.
+  std::unordered_map<unsigned int, std::string> outputBinary;
+  //Writer thread only.
+  std::unordered_map<unsigned int, std::shared_ptr<ClientConnection> > connectionsWithPendingOutput;
+  //Builds the server kernels and computes the secp256k1 contexts while connections are accepted, see RunWarmUp.
+  std::thread warmUpThread;
+  //Set by the warm-up thread once a command's kernels and contexts are initialized, or failed to.
+  //Created in the constructor, never resized.
+  std::unordered_map<std::string, std::atomic<bool> > commandsWarm;
 
   int packetNumberOfComputations;
 
@@ -74,27 +291,111 @@ public:
   std::string portMetaData;
   std::string portData;
   std::string portOutputData;
+  std::string portBinary;
   std::string queueMetaData;
   Server();
   ~Server();
   bool Run();
   bool RunOnce();
+  bool WaitForBatches();
+  //Hands a request popped from incomingMessages to the scheduler, or answers it if it is a stats request.
+  bool ScheduleIncoming(MessageFromNode& message);
+  void RunIngest();
+  bool RunOnceIngest();
+  bool IngestShouldPause();
+  bool RunOnceEventLoop();
+  bool PushIngested();
+  void RunWriter();
+  void RunWarmUp();
+  bool WarmUpCommand(const std::string& command, GPU& theGPU);
+  void SelectDevice(unsigned int deviceIndex);
+  unsigned int CPUDeviceIndex();
+  void ReleaseWarmCommands(bool flagReleaseAll);
+  static std::string KernelOfCommand(const std::string& command);
+  bool Autotune();
+  bool AutotuneDevice();
+  bool AutotuneSamples(const std::string& command, std::vector<std::string>& output);
+  bool AutotuneBatch(
+    const std::string& command,
+    const std::vector<std::string>& samples,
+    unsigned int numberOfMessages,
+    std::vector<HostBuffer>& staged,
+    double& outputSeconds
+  );
+  bool ExecuteCommand(const std::string& command, cl_event& outputLaunchFinished);
+  bool WriteOneResult(OutgoingResult& result);
+  void WaitToWritePending();
+  bool initializeEventLoop();
+  bool setNonBlocking(int fileDescriptor);
+  bool AcceptConnections();
+  void CloseConnection(unsigned int connectionId);
+  //Closes a connection whose client stopped sending once every request it sent has its result.
+  void CloseIfAnswered(ClientConnection& connection);
+  std::shared_ptr<ClientConnection> getConnection(unsigned int connectionId);
   bool QueueCommand(MessageFromNode& theMessage);
+  void AddComputation(GPUKernel& kernel, MessageFromNode& theMessage);
   bool QueueSha256(MessageFromNode& theMessage);
   bool QueueTestBuffer(MessageFromNode& theMessage);
   bool QueueSignOneMessage(MessageFromNode& theMessage);
+  bool QueueVerifySignature(MessageFromNode& theMessage);
+  bool QueueGeneratePublicKey(MessageFromNode& theMessage);
+  bool QueueOnCPU(MessageFromNode& theMessage);
+  //Checks of the request payloads, shared by the device and CPU paths.
+  static bool CheckSignOneMessage(const MessageFromNode& theMessage);
+  static bool CheckVerifySignature(
+    const MessageFromNode& theMessage, unsigned int& outputSignatureSize, unsigned int& outputPublicKeySize
+  );
+  static bool CheckGeneratePublicKey(const MessageFromNode& theMessage);
 
+  void SplitAcrossDevices(std::deque<MessageFromNode>& batch, std::vector<unsigned int>& outputDeviceOfMessage);
+  bool QueueOnCurrentDevice(
+    std::deque<MessageFromNode>& batch,
+    const std::vector<unsigned int>& deviceOfMessage,
+    std::deque<MessageFromNode>& spillOver
+  );
   bool ExecuteQueued();
-  bool ExecuteTestBuffers();
-  bool ExecuteSignMessages();
-  bool ExecuteSha256s();
+  bool ExecuteQueuedOnCPU();
+  //Each Execute* function enqueues its writes and launches without blocking;
+  //outputLaunchFinished completes with the last launch.
+  bool ExecuteTestBuffers(cl_event& outputLaunchFinished);
+  bool ExecuteSignMessages(cl_event& outputLaunchFinished);
+  bool ExecuteSha256s(cl_event& outputLaunchFinished);
+  bool ExecuteVerifySignatures(cl_event& outputLaunchFinished);
+  bool ExecuteGeneratePublicKeys(cl_event& outputLaunchFinished);
 
-  bool ProcessResults();
-  bool ProcessResultsSha256(std::stringstream& output);
-  bool ProcessResultsTestBuffer(std::stringstream& output);
-  bool ProcessResultSignMessages(std::stringstream& output);
+  bool EnqueueReadBack(
+    GPUKernel& kernel,
+    cl_event launchFinished,
+    int firstArgument,
+    unsigned int firstSize,
+    int secondArgument,
+    unsigned int secondSize
+  );
+  bool WaitForSlot(GPUKernel& kernel);
+  bool ProcessCompletedBatches();
+  //Answers every request of a batch that failed on its backend with an error; the other batches go on.
+  bool FailBatch(InFlightBatch& batch, cl_int status);
+  bool FinishBatchesInFlight();
+  bool ProcessResultsOfKernel(InFlightBatch& batch, std::stringstream& output);
+  bool ProcessResultsSha256(InFlightBatch& batch, std::stringstream& output);
+  bool ProcessResultsTestBuffer(InFlightBatch& batch, std::stringstream& output);
+  bool ProcessResultSignMessages(InFlightBatch& batch, std::stringstream& output);
+  bool ProcessResultsVerifySignatures(InFlightBatch& batch, std::stringstream& output);
+  bool ProcessResultsGeneratePublicKeys(InFlightBatch& batch, std::stringstream& output);
 
+  void AppendResultBinary(
+    unsigned char opcode, const std::string& id, const unsigned char* result, unsigned int resultSize
+  );
+  void AppendFrameBinary(
+    unsigned char opcode, unsigned char status, const std::string& id, const unsigned char* result, unsigned int resultSize
+  );
+  void AppendErrorBinary(MessageFromNode& failedMessage);
   bool WriteResults(std::stringstream& output);
+  //Profiling statistics of the server kernels of every device, see KernelStatistics.
+  std::string ToJSONStatistics();
+  //stats requests are answered by the dispatch thread as soon as they arrive, see ScheduleIncoming.
+  bool AnswerStatistics(MessageFromNode& theMessage);
+  void LogStatisticsPeriodically();
 
   bool initialize();
   bool initializePorts();
@@ -7,7 +7,13 @@
 #include <chrono>
 #include <assert.h>
 #include "secp256k1_interface.h"
+#include "server.h"
 #include <thread>
+#include <cmath>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 
 //Use CentralPU and GraphicsPU, CPU and GPU look too similar,
@@ -29,6 +35,8 @@ public:
   std::vector<std::string> outputSignatureStrings;
   std::vector<unsigned char> publicKeysBuffer;
   std::vector<unsigned char> publicKeysSizes;
+  std::vector<unsigned char> publicKeysCompressionFlags;
+  std::vector<unsigned char> publicKeysInversionScratch;
   std::vector<std::string> publicKeyStrings;
   std::vector<unsigned char> outputVerifications;
   std::vector<unsigned char> outputGeneratorContexts;
@@ -207,6 +215,88 @@ bool testMainPart1ComputeContexts(GPU& theGPU) {
   return true;
 }
 
+//Context files are used wherever they happen to be uploaded:
+//a copy of a context pool must work once relocated, even though the pointer stored in it was stale.
+bool testContextIsRelocatable() {
+  std::vector<unsigned char> originalPool(GPU::memoryGeneratorContext);
+  if (!CryptoEC256k1::computeGeneratorContext(originalPool.data())) {
+    return false;
+  }
+  unsigned char* original = originalPool.data();
+  std::vector<unsigned char> relocated(original, original + memoryPool_readPoolSize(original));
+  uint32_t positionContext = memoryPool_read_uint_fromOutput(0, original);
+  ((secp256k1_ecmult_gen_context*) &relocated[positionContext])->prec = NULL;
+  memoryPool_relocate_generatorContext(relocated.data());
+  unsigned char secretKey[32];
+  for (unsigned i = 0; i < 32; i ++) {
+    secretKey[i] = (unsigned char) (i + 1);
+  }
+  unsigned char expected[MACRO_size_of_signature];
+  unsigned char actual[MACRO_size_of_signature];
+  unsigned int expectedSize = 0;
+  unsigned int actualSize = 0;
+  CryptoEC256k1::generatePublicKey(expected, &expectedSize, secretKey, original);
+  CryptoEC256k1::generatePublicKey(actual, &actualSize, secretKey, relocated.data());
+  if (expectedSize == 0 || expectedSize != actualSize || !std::equal(expected, expected + expectedSize, actual)) {
+    logTestCentralPU << Logger::colorRed << "Public key from the relocated generator context differs. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  logTestCentralPU << "Relocated generator context gives the same public key. " << Logger::endL;
+  return true;
+}
+
+#ifdef MACRO_USE_PRECOMPUTED_TABLES
+//The compiled-in tables must give the same keys as computed contexts, and valid signatures.
+bool testPrecomputedTables() {
+  std::vector<unsigned char> computedGenerator(GPU::memoryGeneratorContext);
+  std::vector<unsigned char> precomputedGenerator(GPU::memoryGeneratorContext);
+  std::vector<unsigned char> precomputedMultiplication(GPU::memoryMultiplicationContext);
+  std::vector<unsigned char> signaturePool(GPU::memorySignature);
+  if (
+    !CryptoEC256k1::computeGeneratorContext(computedGenerator.data()) ||
+    !CryptoEC256k1::loadPrecomputedGeneratorContext(precomputedGenerator.data()) ||
+    !CryptoEC256k1::loadPrecomputedMultiplicationContext(precomputedMultiplication.data())
+  ) {
+    return false;
+  }
+  unsigned char secretKey[32];
+  unsigned char message[32];
+  unsigned char nonce[32];
+  for (unsigned i = 0; i < 32; i ++) {
+    secretKey[i] = (unsigned char) (i + 1);
+    message[i] = (unsigned char) (3 * i + 7);
+    nonce[i] = (unsigned char) (5 * i + 11);
+  }
+  unsigned char expected[MACRO_size_of_signature];
+  unsigned char publicKey[MACRO_size_of_signature];
+  unsigned char signature[MACRO_size_of_signature];
+  unsigned int expectedSize = 0;
+  unsigned int publicKeySize = 0;
+  unsigned int signatureSize = 0;
+  CryptoEC256k1::generatePublicKey(expected, &expectedSize, secretKey, computedGenerator.data());
+  CryptoEC256k1::generatePublicKey(publicKey, &publicKeySize, secretKey, precomputedGenerator.data());
+  if (expectedSize == 0 || expectedSize != publicKeySize || !std::equal(expected, expected + expectedSize, publicKey)) {
+    logTestCentralPU << Logger::colorRed << "Public key from the precomputed generator table differs. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  CryptoEC256k1::signMessage(signature, &signatureSize, nonce, secretKey, message, precomputedGenerator.data(), 0);
+  unsigned char result = 0;
+  CryptoEC256k1::verifySignature(
+    &result, signaturePool.data(), signature, signatureSize, publicKey, publicKeySize, message,
+    precomputedMultiplication.data()
+  );
+  if (result != 1) {
+    logTestCentralPU << Logger::colorRed << "Signature made and verified with the precomputed tables does not verify: "
+    << (int) (signed char) result << ". " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  logTestCentralPU << "Precomputed tables give the same public key and a valid signature. " << Logger::endL;
+  return true;
+}
+#endif
+
 void PublicKey::reset() {
   for (int i = 0; i < this->maxSerializationSize; i ++) {
     this->serialization[i] = 0;
@@ -431,6 +521,14 @@ bool testGPU(GPU& inputGPU) {
   if (!testMainPart1ComputeContexts(inputGPU)) {
     return false;
   }
+  if (!testContextIsRelocatable()) {
+    return false;
+  }
+#ifdef MACRO_USE_PRECOMPUTED_TABLES
+  if (!testPrecomputedTables()) {
+    return false;
+  }
+#endif
   if (!testMainPart2Signatures(inputGPU))
     return false;
   testSignatures theSignatureTest;
@@ -452,7 +550,545 @@ bool testGPU(GPU& inputGPU) {
   return true;
 }
 
+void waitForCPUBatch(InFlightBatch& batch) {
+  while (batch.completionStatus.load() != CL_COMPLETE) {
+    std::this_thread::yield();
+  }
+}
+
+//The server's CPU backend against the one-message functions of CryptoEC256k1.
+//Needs no OpenCL device.
+bool testCPUBackend() {
+  testSignatures inputs;
+  inputs.initialize();
+  CPUBackend backend;
+  if (!backend.initialize(0)) {
+    return false;
+  }
+  unsigned int numberOfMessages = 100;
+  std::shared_ptr<std::vector<std::string> > signRequests = std::make_shared<std::vector<std::string> >();
+  std::shared_ptr<std::vector<std::string> > keyRequests = std::make_shared<std::vector<std::string> >();
+  for (unsigned i = 0; i < numberOfMessages; i ++) {
+    std::string nonce((char*) &inputs.nonces[i * 32], 32);
+    std::string secretKey((char*) &inputs.secretKeys[i * 32], 32);
+    std::string message((char*) &inputs.messages[i * 32], 32);
+    signRequests->push_back(nonce + secretKey + message);
+    keyRequests->push_back(secretKey);
+  }
+  std::shared_ptr<InFlightBatch> signatures = std::make_shared<InFlightBatch>();
+  std::shared_ptr<InFlightBatch> publicKeys = std::make_shared<InFlightBatch>();
+  backend.execute("signOneMessage", signRequests, signatures);
+  backend.execute("generatePublicKey", keyRequests, publicKeys);
+  waitForCPUBatch(*signatures);
+  waitForCPUBatch(*publicKeys);
+  std::shared_ptr<std::vector<std::string> > verifyRequests = std::make_shared<std::vector<std::string> >();
+  for (unsigned i = 0; i < numberOfMessages; i ++) {
+    unsigned char expected[MACRO_size_of_signature];
+    unsigned int expectedSize = 0;
+    CryptoEC256k1::signMessage(
+      expected, &expectedSize, &inputs.nonces[i * 32], &inputs.secretKeys[i * 32], &inputs.messages[i * 32],
+      CryptoEC256k1::bufferGeneratorContext, 0
+    );
+    std::string signature(
+      (char*) &signatures->data[i * MACRO_size_of_signature], memoryPool_read_uint(&signatures->dataSecond[i * 4])
+    );
+    if (signature != std::string((char*) expected, expectedSize)) {
+      logTestCentralPU << Logger::colorRed << "CPU backend: wrong signature of message " << i << ". "
+      << Logger::colorNormal << Logger::endL;
+      return false;
+    }
+    CryptoEC256k1::generatePublicKey(
+      expected, &expectedSize, &inputs.secretKeys[i * 32], CryptoEC256k1::bufferGeneratorContext
+    );
+    std::string publicKey(
+      (char*) &publicKeys->data[i * MACRO_size_of_signature], memoryPool_read_uint(&publicKeys->dataSecond[i * 4])
+    );
+    if (publicKey != std::string((char*) expected, expectedSize)) {
+      logTestCentralPU << Logger::colorRed << "CPU backend: wrong public key " << i << ". "
+      << Logger::colorNormal << Logger::endL;
+      return false;
+    }
+    std::string message((char*) &inputs.messages[i * 32], 32);
+    if (i % 10 == 0) {
+      //Tampered with: must fail to verify.
+      message[0] ^= 1;
+    }
+    verifyRequests->push_back(
+      std::string(1, (char) signature.size()) + signature + std::string(1, (char) publicKey.size()) + publicKey + message
+    );
+  }
+  std::shared_ptr<InFlightBatch> verifications = std::make_shared<InFlightBatch>();
+  backend.execute("verifySignature", verifyRequests, verifications);
+  waitForCPUBatch(*verifications);
+  for (unsigned i = 0; i < numberOfMessages; i ++) {
+    unsigned char expected = i % 10 == 0 ? 0 : 1;
+    if (verifications->data[i] != expected) {
+      logTestCentralPU << Logger::colorRed << "CPU backend: verification of message " << i << " returned "
+      << (int) (signed char) verifications->data[i] << ", expected " << (int) expected << ". "
+      << Logger::colorNormal << Logger::endL;
+      return false;
+    }
+  }
+  logTestCentralPU << Logger::colorGreen << "CPU backend: " << numberOfMessages
+  << " signatures, public keys and verifications match. " << Logger::colorNormal << Logger::endL;
+  return true;
+}
+
+bool testBinaryFrames() {
+  unsigned char header[BinaryFrame::headerSize];
+  BinaryFrame::writeHeader(header, BinaryFrame::opcodeSignOneMessage, BinaryFrame::statusBusy, 4000000000u, 77);
+  unsigned int connectionId = 0, requestId = 0;
+  if (
+    header[0] != BinaryFrame::opcodeSignOneMessage || header[1] != BinaryFrame::statusBusy ||
+    header[2] != 0 || header[3] != 0 ||
+    memoryPool_read_uint(&header[4]) != 4000000000u || memoryPool_read_uint(&header[8]) != 77 ||
+    !BinaryFrame::parseComputationId(BinaryFrame::computationId(5, 4000000000u), connectionId, requestId) ||
+    connectionId != 5 || requestId != 4000000000u || BinaryFrame::parseComputationId("5", connectionId, requestId)
+  ) {
+    logTestCentralPU << Logger::colorRed << "Binary frame header or computation id does not round trip. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  BinaryFrame::writeHeader(header, BinaryFrame::opcodeSHA256, 0, 1, 3);
+  std::string first = std::string((char*) header, BinaryFrame::headerSize) + "abc";
+  BinaryFrame::writeHeader(header, BinaryFrame::opcodeStats, 0, 2, 0);
+  std::string second((char*) header, BinaryFrame::headerSize);
+  if (BinaryFrame::countFrames(first + second + first.substr(0, 13)) != 2) {
+    logTestCentralPU << Logger::colorRed << "Wrong count of whole frames. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //A frame split across reads is converted once its last byte arrives.
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+    logTestCentralPU << Logger::colorRed << "No socket pair: " << strerror(errno) << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  fcntl(sockets[0], F_SETFL, fcntl(sockets[0], F_GETFL, 0) | O_NONBLOCK);
+  ClientConnection connection(sockets[0], 7);
+  std::deque<MessageFromNode> messages;
+  std::string stream = first + second;
+  size_t cuts[] = {5, 14, stream.size()};
+  size_t written = 0;
+  unsigned int expectedCounts[] = {0, 0, 2};
+  for (unsigned i = 0; i < 3; i ++) {
+    if (write(sockets[1], &stream[written], cuts[i] - written) != (ssize_t) (cuts[i] - written)) {
+      close(sockets[1]);
+      return false;
+    }
+    written = cuts[i];
+    if (!connection.ReadAvailable(messages, 100) || messages.size() != expectedCounts[i]) {
+      logTestCentralPU << Logger::colorRed << "After " << written << " bytes: " << messages.size()
+      << " message(s), expected " << expectedCounts[i] << ". " << Logger::colorNormal << Logger::endL;
+      close(sockets[1]);
+      return false;
+    }
+  }
+  close(sockets[1]);
+  if (
+    messages[0].command != "SHA256" || messages[0].id != "7:1" || messages[0].theMessage != "abc" ||
+    messages[1].command != "stats" || messages[1].id != "7:2" || connection.numberOfUnansweredRequests.load() != 2 ||
+    !connection.ReadAvailable(messages, 100) || !connection.flagReadClosed.load()
+  ) {
+    logTestCentralPU << Logger::colorRed << "Wrong messages from split frames. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //An oversized payload and an unknown opcode drop the connection.
+  unsigned char badOpcodes[] = {BinaryFrame::opcodeSHA256, 99};
+  unsigned int badLengths[] = {101, 0};
+  for (unsigned i = 0; i < 2; i ++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+      return false;
+    }
+    fcntl(sockets[0], F_SETFL, fcntl(sockets[0], F_GETFL, 0) | O_NONBLOCK);
+    ClientConnection bad(sockets[0], 8);
+    BinaryFrame::writeHeader(header, badOpcodes[i], 0, 1, badLengths[i]);
+    bool sent = write(sockets[1], header, BinaryFrame::headerSize) == (ssize_t) BinaryFrame::headerSize;
+    close(sockets[1]);
+    std::deque<MessageFromNode> rejected;
+    if (!sent || bad.ReadAvailable(rejected, 100) || !rejected.empty()) {
+      logTestCentralPU << Logger::colorRed << "Accepted a frame with opcode " << (int) badOpcodes[i]
+      << " and payload length " << badLengths[i] << ". " << Logger::colorNormal << Logger::endL;
+      return false;
+    }
+  }
+  logTestCentralPU << Logger::colorGreen << "Binary frames as expected. " << Logger::colorNormal << Logger::endL;
+  return true;
+}
+
+bool testBoundedQueue() {
+  BoundedQueue<int> queue(3);
+  std::atomic<bool> flagStop(true);
+  int value = 0;
+  if (queue.pop(value) || queue.popWait(value, flagStop) || queue.size() != 0) {
+    logTestCentralPU << Logger::colorRed << "Popped from an empty queue. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //The counters pass the capacity many times over: the slots wrap around.
+  int nextIn = 0, nextOut = 0;
+  for (unsigned round = 0; round < 10; round ++) {
+    while (queue.size() < queue.capacity()) {
+      int input = nextIn ++;
+      if (!queue.push(input)) {
+        return false;
+      }
+    }
+    int extra = - 1;
+    if (queue.push(extra) || queue.pushWait(extra, flagStop)) {
+      logTestCentralPU << Logger::colorRed << "Pushed into a full queue. " << Logger::colorNormal << Logger::endL;
+      return false;
+    }
+    for (unsigned i = 0; i < round % 3 + 1; i ++) {
+      if (!queue.pop(value) || value != nextOut ++) {
+        logTestCentralPU << Logger::colorRed << "Popped " << value << ", expected " << nextOut - 1 << ". "
+        << Logger::colorNormal << Logger::endL;
+        return false;
+      }
+    }
+  }
+  while (queue.popWait(value, flagStop)) {
+    if (value != nextOut ++) {
+      logTestCentralPU << Logger::colorRed << "Drained " << value << ", expected " << nextOut - 1 << ". "
+      << Logger::colorNormal << Logger::endL;
+      return false;
+    }
+  }
+  if (nextOut != nextIn || queue.size() != 0) {
+    logTestCentralPU << Logger::colorRed << "Lost elements: pushed " << nextIn << ", popped " << nextOut << ". "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  logTestCentralPU << Logger::colorGreen << "Bounded queue as expected. " << Logger::colorNormal << Logger::endL;
+  return true;
+}
+
+std::string testIdsOf(const std::deque<MessageFromNode>& messages) {
+  std::string result;
+  for (unsigned i = 0; i < messages.size(); i ++) {
+    result += messages[i].id;
+  }
+  return result;
+}
+
+bool testBatchScheduler() {
+  BatchScheduler scheduler;
+  scheduler.initialBatchSize = 4;
+  scheduler.minimumBatchSize = 2;
+  scheduler.maximumBatchSize = 8;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point deadline = start + scheduler.maximumWait;
+  std::string commands[] = {"SHA256", "SHA256", "SHA256", "SHA256", "SHA256", "SHA256", "signOneMessage"};
+  for (unsigned i = 0; i < sizeof(commands) / sizeof(commands[0]); i ++) {
+    MessageFromNode message;
+    message.command = commands[i];
+    message.id = std::to_string(i);
+    message.timeReceived = start;
+    scheduler.add(message);
+  }
+  //Ready by size: at most batchSize of the 6 hashes; the lone signature waits for its deadline.
+  std::deque<MessageFromNode> bySize;
+  std::vector<std::string> fullCommands;
+  scheduler.takeReady(bySize, fullCommands, start, false);
+  if (
+    testIdsOf(bySize) != "0123" || fullCommands != std::vector<std::string>({"SHA256"}) ||
+    scheduler.numberOfPending != 3 || scheduler.hasReady(start, false)
+  ) {
+    logTestCentralPU << Logger::colorRed << "Batch ready by size: took " << testIdsOf(bySize) << ", expected 0123. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //Ready by deadline: everything left, and no batch counts as full.
+  std::deque<MessageFromNode> byDeadline;
+  fullCommands.clear();
+  scheduler.takeReady(byDeadline, fullCommands, deadline, false);
+  if (byDeadline.size() != 3 || !fullCommands.empty() || !scheduler.empty()) {
+    logTestCentralPU << Logger::colorRed << "Batches ready by deadline: took " << testIdsOf(byDeadline)
+    << ", expected 3 messages. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //Messages not launched go back at the head of their queues, in order.
+  MessageFromNode later;
+  later.command = "SHA256";
+  later.id = "7";
+  later.timeReceived = deadline;
+  scheduler.add(later);
+  scheduler.returnToFront(byDeadline);
+  if (testIdsOf(scheduler.commands["SHA256"].pending) != "457" || scheduler.numberOfPending != 4) {
+    logTestCentralPU << Logger::colorRed << "Returned to front: " << testIdsOf(scheduler.commands["SHA256"].pending)
+    << ", expected 457. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //Commands on hold keep their requests, even when everything is flushed.
+  scheduler.commands["SHA256"].flagOnHold = true;
+  scheduler.commands["signOneMessage"].flagOnHold = true;
+  if (scheduler.hasReady(deadline, true)) {
+    logTestCentralPU << Logger::colorRed << "Requests on hold are ready. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  scheduler.commands["SHA256"].flagOnHold = false;
+  std::deque<MessageFromNode> flushed;
+  scheduler.takeReady(flushed, fullCommands, start, true);
+  if (testIdsOf(flushed) != "457" || scheduler.commands["signOneMessage"].pending.size() != 1) {
+    logTestCentralPU << Logger::colorRed << "Flushed " << testIdsOf(flushed) << ", expected 457 and the signature held. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //Adapt: no change before minimumLatencySamples, shrink on a missed target, grow on full batches with room to spare.
+  for (unsigned i = 0; i < BatchScheduler::minimumLatencySamples; i ++) {
+    scheduler.recordLatency("SHA256", scheduler.latencyTargetInSeconds * 2);
+    scheduler.recordLatency("signOneMessage", scheduler.latencyTargetInSeconds / 2);
+    if (i == 0) {
+      scheduler.adapt("SHA256", true);
+    }
+  }
+  unsigned int unmeasured = scheduler.commands["SHA256"].batchSize;
+  scheduler.adapt("SHA256", true);
+  unsigned int shrunk = scheduler.commands["SHA256"].batchSize;
+  scheduler.adapt("SHA256", true);
+  scheduler.adapt("SHA256", true);
+  unsigned int atMinimum = scheduler.commands["SHA256"].batchSize;
+  scheduler.adapt("signOneMessage", false);
+  unsigned int notFull = scheduler.commands["signOneMessage"].batchSize;
+  for (unsigned i = 0; i < 10; i ++) {
+    scheduler.adapt("signOneMessage", true);
+  }
+  unsigned int grown = scheduler.commands["signOneMessage"].batchSize;
+  if (unmeasured != 4 || shrunk != 3 || atMinimum != 2 || notFull != 4 || grown != 8) {
+    logTestCentralPU << Logger::colorRed << "Adapted batch sizes: " << unmeasured << ", " << shrunk << ", "
+    << atMinimum << ", " << notFull << ", " << grown << ", expected 4, 3, 2, 4, 8. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  logTestCentralPU << Logger::colorGreen << "Batch scheduler as expected. " << Logger::colorNormal << Logger::endL;
+  return true;
+}
+
+bool testCostModel() {
+  CostModel model;
+  if (model.predict(10) != 0) {
+    logTestCentralPU << Logger::colorRed << "An unmeasured cost model predicts: " << model.predict(10) << ". "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  model.record(10, 0.012);
+  model.record(20, 0.022);
+  model.record(40, 0.042);
+  if (
+    std::abs(model.fixedSeconds - 0.002) > 1e-9 ||
+    std::abs(model.secondsPerMessage - 0.001) > 1e-9 ||
+    std::abs(model.predict(30) - 0.032) > 1e-9 ||
+    model.predict(0) != 0
+  ) {
+    logTestCentralPU << Logger::colorRed << "Cost model fit: fixed " << model.fixedSeconds << " s, "
+    << model.secondsPerMessage << " s per message, expected 0.002 and 0.001. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  CostModel proportional;
+  proportional.record(10, 0.02);
+  proportional.record(10, 0.02);
+  if (proportional.fixedSeconds != 0 || std::abs(proportional.secondsPerMessage - 0.002) > 1e-9) {
+    logTestCentralPU << Logger::colorRed << "Cost model of a single batch size: fixed " << proportional.fixedSeconds
+    << " s, " << proportional.secondsPerMessage << " s per message, expected 0 and 0.002. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  logTestCentralPU << Logger::colorGreen << "Cost model fit as expected. " << Logger::colorNormal << Logger::endL;
+  return true;
+}
+
+bool testSplit() {
+  //No devices: both backends are past theGPUs and serve every kernel.
+  DeviceManager devices;
+  std::string kernelName = GPU::kernelSign;
+  std::vector<CostModel>& models = devices.costs[kernelName];
+  models.resize(2);
+  //Backend 0: 0.01 s per launch and 0.001 s per message; backend 1: no launch cost and 0.002 s per message.
+  models[0].record(10, 0.02);
+  models[0].record(20, 0.03);
+  models[1].record(10, 0.02);
+  models[1].record(20, 0.04);
+  std::vector<unsigned int> counts;
+  devices.split(kernelName, 100, 2, counts);
+  double finish0 = devices.costs[kernelName][0].predict(counts[0]);
+  double finish1 = devices.costs[kernelName][1].predict(counts[1]);
+  if (counts.size() != 2 || counts[0] + counts[1] != 100 || std::abs(finish0 - finish1) > 0.002 + 1e-9) {
+    logTestCentralPU << Logger::colorRed << "Split of 100 messages: " << counts[0] << " finishing at " << finish0
+    << " s and " << counts[1] << " finishing at " << finish1 << " s. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  std::vector<unsigned int> small;
+  devices.split(kernelName, 4, 2, small);
+  if (small[0] != 0 || small[1] != 4) {
+    logTestCentralPU << Logger::colorRed << "Split of 4 messages: " << small[0] << " and " << small[1]
+    << ", expected all on the backend with no launch cost. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //A plan charges nothing; a launched batch is charged and released exactly, however the model changed in between.
+  if (devices.outstandingSeconds[0] != 0 || devices.outstandingSeconds[1] != 0) {
+    logTestCentralPU << Logger::colorRed << "Splitting charged the backends. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  double predicted = devices.charge(0, kernelName, counts[0]);
+  std::vector<unsigned int> busy;
+  devices.split(kernelName, 100, 2, busy);
+  if (busy[0] >= counts[0]) {
+    logTestCentralPU << Logger::colorRed << "A busy backend got " << busy[0] << " messages, as many as when free. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  devices.costs[kernelName][0].record(50, 1);
+  std::chrono::steady_clock::time_point launched = std::chrono::steady_clock::now();
+  devices.recordBatch(0, kernelName, counts[0], predicted, launched, launched + std::chrono::milliseconds(70));
+  if (std::abs(devices.outstandingSeconds[0]) > 1e-12) {
+    logTestCentralPU << Logger::colorRed << "Outstanding seconds after the batch completed: "
+    << devices.outstandingSeconds[0] << ". " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  logTestCentralPU << Logger::colorGreen << "Split as expected. " << Logger::colorNormal << Logger::endL;
+  return true;
+}
+
+bool testPartition() {
+  DeviceManager devices;
+  if (
+    !devices.parsePartition("4:secp256k1_opencl_sign,0") ||
+    devices.partitionComputeUnits != std::vector<unsigned int>({4, 0}) ||
+    devices.partitionKernels.size() != 2 ||
+    devices.partitionKernels[0] != std::vector<std::string>({GPU::kernelSign}) ||
+    !devices.partitionKernels[1].empty()
+  ) {
+    logTestCentralPU << Logger::colorRed << "Failed to read the partition 4:secp256k1_opencl_sign,0. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  if (!devices.parsePartition("l2") || devices.partitionAffinityDomain != CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE) {
+    logTestCentralPU << Logger::colorRed << "Failed to read the partition l2. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  std::string badPartitions[] = {
+    "", "0,0", "x:secp256k1_opencl_sign,0", "4:secp256k1_opencl_sing,0", "4:secp256k1_opencl_sign,4:sha256GPU"
+  };
+  for (unsigned i = 0; i < sizeof(badPartitions) / sizeof(badPartitions[0]); i ++) {
+    if (devices.parsePartition(badPartitions[i]) || !devices.partitionComputeUnits.empty()) {
+      logTestCentralPU << Logger::colorRed << "Accepted the bad partition: " << badPartitions[i] << ". "
+      << Logger::colorNormal << Logger::endL;
+      return false;
+    }
+  }
+  //The sub-devices DeviceManager::initialize makes of the first partition above.
+  std::shared_ptr<GPU> signing = std::make_shared<GPU>();
+  std::shared_ptr<GPU> rest = std::make_shared<GPU>();
+  signing->kernelsServed.push_back(GPU::kernelSign);
+  rest->kernelsNotServed.push_back(GPU::kernelSign);
+  if (
+    !signing->servesKernel(GPU::kernelSign) || signing->servesKernel(GPU::kernelSHA256) ||
+    rest->servesKernel(GPU::kernelSign) || !rest->servesKernel(GPU::kernelSHA256)
+  ) {
+    logTestCentralPU << Logger::colorRed << "Sub-devices serve the wrong kernels. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  devices.theGPUs.push_back(signing);
+  devices.theGPUs.push_back(rest);
+  std::vector<unsigned int> signatures, hashes, withCPU;
+  devices.split(GPU::kernelSign, 10, 2, signatures);
+  devices.split(GPU::kernelSHA256, 10, 2, hashes);
+  devices.split(GPU::kernelSign, 10, 3, withCPU);
+  if (
+    signatures != std::vector<unsigned int>({10, 0}) ||
+    hashes != std::vector<unsigned int>({0, 10}) ||
+    withCPU != std::vector<unsigned int>({5, 0, 5})
+  ) {
+    logTestCentralPU << Logger::colorRed << "Split ignores the routing rules. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  logTestCentralPU << Logger::colorGreen << "Partition and routing as expected. " << Logger::colorNormal << Logger::endL;
+  return true;
+}
+
+bool testKernelStatistics() {
+  //Bucket i holds durations up to 2^i microseconds, the last one all longer ones.
+  DurationHistogram histogram;
+  double seconds[] = {0, 0.5e-6, 1.5e-6, 3e-6, 1e-3, 1e6};
+  unsigned int expectedBuckets[] = {0, 0, 1, 2, 10, DurationHistogram::numberOfBuckets - 1};
+  for (unsigned i = 0; i < sizeof(seconds) / sizeof(seconds[0]); i ++) {
+    DurationHistogram single;
+    single.add(seconds[i]);
+    if (single.buckets[expectedBuckets[i]] != 1) {
+      logTestCentralPU << Logger::colorRed << "Duration of " << seconds[i] << " s not in bucket " << expectedBuckets[i]
+      << ". " << Logger::colorNormal << Logger::endL;
+      return false;
+    }
+  }
+  for (unsigned i = 0; i < 99; i ++) {
+    histogram.add(1.5e-6);
+  }
+  histogram.add(1e-3);
+  if (
+    histogram.count != 100 || histogram.maximumSeconds != 1e-3 ||
+    histogram.percentile(0.5) != 2e-6 || histogram.percentile(0.99) != 1e-3 ||
+    DurationHistogram().percentile(0.5) != 0
+  ) {
+    logTestCentralPU << Logger::colorRed << "Percentiles of 99 durations of 1.5 us and one of 1 ms: p50 "
+    << histogram.percentile(0.5) << " s, p99 " << histogram.percentile(0.99) << " s, expected 2e-06 and 0.001. "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  KernelStatistics statistics;
+  if (statistics.bound() != "idle") {
+    logTestCentralPU << Logger::colorRed << "No command, yet bound: " << statistics.bound() << ". "
+    << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //Nanoseconds: queued at 1000, behind a command that ended at 5500, started at 7000.
+  statistics.record(KernelStatistics::commandLaunch, 1000, 1200, 5500, 7000, 10000, 0);
+  if (
+    statistics.bound() != "compute" ||
+    statistics.dependencyWait.buckets[3] != 1 || statistics.queueWait.buckets[1] != 1
+  ) {
+    logTestCentralPU << Logger::colorRed << "A launch waiting 4.5 us for its dependency and 1.5 us for the device: "
+    << "bound " << statistics.bound() << ", dependency wait " << statistics.dependencyWait.totalSeconds
+    << " s, queue wait " << statistics.queueWait.totalSeconds << " s. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  //No known dependency: all of the wait is queue wait.
+  statistics.record(KernelStatistics::commandRead, 1000, 1200, 0, 7000, 20000, 64);
+  if (
+    statistics.bound() != "transfer" || statistics.bytesRead != 64 ||
+    statistics.dependencyWait.buckets[0] != 1 || statistics.queueWait.buckets[3] != 1
+  ) {
+    logTestCentralPU << Logger::colorRed << "A read with no dependency: bound " << statistics.bound()
+    << ", dependency wait " << statistics.dependencyWait.totalSeconds << " s, queue wait "
+    << statistics.queueWait.totalSeconds << " s. " << Logger::colorNormal << Logger::endL;
+    return false;
+  }
+  logTestCentralPU << Logger::colorGreen << "Kernel statistics as expected. " << Logger::colorNormal << Logger::endL;
+  return true;
+}
+
 int testMain() {
+  if (!testKernelStatistics()) {
+    return - 1;
+  }
+  if (!testPartition()) {
+    return - 1;
+  }
+  if (!testBinaryFrames()) {
+    return - 1;
+  }
+  if (!testBoundedQueue()) {
+    return - 1;
+  }
+  if (!testBatchScheduler()) {
+    return - 1;
+  }
+  if (!testCostModel()) {
+    return - 1;
+  }
+  if (!testSplit()) {
+    return - 1;
+  }
+  if (!testCPUBackend()) {
+    return - 1;
+  }
   GPU theGPU;
   GPU theOpenCLCPU;
   //theOpenCLCPU.theDesiredDeviceType = CL_DEVICE_TYPE_CPU;
@@ -532,26 +1168,8 @@ bool testSignatures::testSHA256NoOutput(GPU& theGPU) {
   }
   int numKernels = 2048;
   int totalSHAs = numKernels * 256 * 256;
-  for (int i = 0; i < numKernels; i++) {
-    if (!theKernel->writeMessageIndex(i)) {
-      theTestLogger << "Bad write" << Logger::endL;
-      assert(false);
-    }
-    cl_int ret = clEnqueueNDRangeKernel(
-      theGPU.commandQueue,
-      theKernel->kernel,
-      3,
-      NULL,
-      theKernel->global_item_size,
-      theKernel->local_item_size,
-      0,
-      NULL,
-      NULL
-    );
-    if (ret != CL_SUCCESS) {
-      theTestLogger << "Failed to enqueue kernel. Return code: " << ret << ". " << Logger::endL;
-      return false;
-    }
+  if (!theKernel->enqueueBatch(0, numKernels, 0)) {
+    return false;
   }
   theTestLogger << "Enqueued: " << numKernels << " kernels, waiting ... " << Logger::endL;
   if (!theGPU.finish()) {
@@ -592,6 +1210,8 @@ bool testSignatures::testSHA256NoOutput(GPU& theGPU) {
   theTestLogger << "Computed " << totalSHAs
   << " sha256s in " << elapsed_seconds.count() << " second(s). " << Logger::endL;
   theTestLogger << "Speed: " << (totalSHAs / elapsed_seconds.count()) << " double hashes per second. " << Logger::endL;
+  //Device time alone, from the profiling timestamps, next to the wall clock above.
+  theTestLogger << "Device profile: " << theKernel->getStatistics().toStringSummary() << Logger::endL;
   return true;
 }
 
@@ -624,37 +1244,13 @@ bool testerSHA256::testSHA256(GPU& theGPU) {
   int numPasses = 10;
   cl_mem& result = theKernel->getOutput(0)->theMemory;
   for (int i = 0; i < numPasses; i++) {
-    for (largeTestCounter = 0; largeTestCounter < this->totalToCompute; largeTestCounter ++) {
-      grandTotal ++;
-      if (!theKernel->writeMessageIndex(largeTestCounter)) {
-        theTestLogger << "Bad write" << Logger::endL;
-        assert(false);
-      }
-      //theKernel->writeToBuffer(0, &theLength, sizeof(uint));
-      //std::cout << "DEBUG: Setting arguments ... " << std::endl;
-      //std::cout << "DEBUG: arguments set, enqueueing kernel... " << std::endl;
-      cl_int ret = clEnqueueNDRangeKernel(
-        theGPU.commandQueue,
-        theKernel->kernel,
-        3,
-        NULL,
-        theKernel->global_item_size,
-        theKernel->local_item_size,
-        0,
-        NULL,
-        NULL
-      );
-      if (ret != CL_SUCCESS) {
-        theTestLogger << "Failed to enqueue kernel. Return code: " << ret << ". " << Logger::endL;
-        return false;
-      }
-      //std::cout << "DEBUG: kernel enqueued, proceeding to read buffer. " << std::endl;
-      if (largeTestCounter % 500 == 0) {
-        auto timeCurrent = std::chrono::system_clock::now();
-        std::chrono::duration<double> elapsed_seconds = timeCurrent - timeStart;
-        std::cout << "Scheduled grand total: " << grandTotal << " sha256s in " << elapsed_seconds.count() << " second(s). " << std::endl;
-      }
+    if (!theKernel->enqueueBatch(0, this->totalToCompute, 0)) {
+      return false;
     }
+    grandTotal += this->totalToCompute;
+    auto timeCurrent = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = timeCurrent - timeStart;
+    std::cout << "Scheduled grand total: " << grandTotal << " sha256s in " << elapsed_seconds.count() << " second(s). " << std::endl;
     //theTestLogger << "Total to extract: " << 32 * theSHA256Test.totalToCompute << Logger::endL;
     if (!theGPU.finish()) {
       return false;
@@ -724,21 +1320,19 @@ bool ThreadPool::joinAll() {
   this->theThreads.clear();
   auto timeCurrent = std::chrono::system_clock::now();
   std::chrono::duration<double> elapsed_seconds = timeCurrent - timeStart;
-  logServer << "Done in " << elapsed_seconds.count() << " second(s). ";
+  logServer << "Done in " << elapsed_seconds.count() << " second(s). " << Logger::endL;
   return true;
 }
 
 void startOneSHA256Thread(testerSHA256* theTester, uint32_t messageIndex) {
   //logTestCPPThreads << "DEBUG: firing up thread with messageIndex: " << messageIndex << " and tester: "
   //<< (long) theTester << ". " << Logger::endL;
-  std::vector<unsigned char> bytes = GPU::getUintBytesBigEndian(messageIndex);
-
-  sha256GPU(
+  sha256GPU_one_message(
     &theTester->outputBuffer[0],
     &theTester->messageStartsUChar[0],
     &theTester->messageLengthsUChar[0],
     &theTester->inputBuffer[0],
-    bytes[0], bytes[1], bytes[2], bytes[3]
+    messageIndex
   );
 }
 
@@ -824,7 +1418,13 @@ void testSignatures::initialize() {
   ////////////////////
   this->publicKeysBuffer.resize(this->numMessagesPerPipeline * MACRO_size_of_signature);
   this->publicKeysSizes.resize(this->numMessagesPerPipeline * 4);
+  this->publicKeysInversionScratch.resize(this->numMessagesPerPipeline * 2 * sizeof(secp256k1_fe));
   this->publicKeyStrings.resize(this->numMessagesPerPipeline);
+  //Alternate between uncompressed and compressed public keys.
+  this->publicKeysCompressionFlags.resize(this->numMessagesPerPipeline);
+  for (unsigned i = 0; i < this->numMessagesPerPipeline; i ++) {
+    this->publicKeysCompressionFlags[i] = i % 2;
+  }
   ////////////////////
   this->outputVerifications.resize(this->numMessagesPerPipeline);
   ///////////////////
@@ -878,35 +1478,10 @@ bool testSignatures::testSign(GPU& theGPU) {
   kernelSign->writeToBuffer(2, this->nonces);
   kernelSign->writeToBuffer(3, this->secretKeys);
   kernelSign->writeToBuffer(4, this->messages);
-  for (counterTest = 0; counterTest < this->numMessagesPerPipeline; counterTest ++) {
-    kernelSign->writeMessageIndex(counterTest);
-    //theKernel->writeToBuffer(0, &theLength, sizeof(uint));
-    //std::cout << "DEBUG: Setting arguments ... " << std::endl;
-    //std::cout << "DEBUG: arguments set, enqueueing kernel... " << std::endl;
-    cl_int ret = clEnqueueNDRangeKernel(
-      theGPU.commandQueue,
-      kernelSign->kernel,
-      1,
-      NULL,
-      kernelSign->global_item_size,
-      kernelSign->local_item_size,
-      0,
-      NULL,
-      NULL
-    );
-    if (ret != CL_SUCCESS) {
-      testLogger << "Failed to enqueue kernel. Return code: " << ret << ". " << Logger::endL;
-      return false;
-    }
-    //std::cout << "DEBUG: kernel enqueued, proceeding to read buffer. " << std::endl;
-    if (counterTest % 100 == 0) {
-      auto timeCurrent = std::chrono::system_clock::now();
-      std::chrono::duration<double> elapsed_seconds = timeCurrent - timeStart;
-      std::cout << "Scheduled " << counterTest << " 32-byte messages in " << elapsed_seconds.count() << " second(s),"
-      << " current speed: "
-      << ((counterTest + 1) / elapsed_seconds.count()) << " signature(s) per second." << std::endl;
-    }
+  if (!kernelSign->enqueueBatch(0, this->numMessagesPerPipeline, 0)) {
+    return false;
   }
+  counterTest = this->numMessagesPerPipeline;
   if (!theGPU.finish()) {
     return false;
   }
@@ -948,6 +1523,7 @@ bool testSignatures::testSign(GPU& theGPU) {
   testLogger << "Signed " << counterTest << " 32-byte messages in " << elapsed_seconds.count() << " second(s). " << Logger::endL;
   testLogger << "Speed: "
   << (this->numMessagesPerPipeline / elapsed_seconds.count()) << " signature(s) per second." << Logger::endL;
+  testLogger << "Device profile: " << kernelSign->getStatistics().toStringSummary() << Logger::endL;
   readStringsFromBufferWithSizes(
     this->outputSignatures,
     this->outputSignatureSizes,
@@ -959,18 +1535,14 @@ bool testSignatures::testSign(GPU& theGPU) {
 }
 
 void startOneSignature(testSignatures* theTester, uint32_t messageIndex) {
-  std::vector<unsigned char> bytes = GPU::getUintBytesBigEndian(messageIndex);
-  secp256k1_opencl_sign(
+  secp256k1_opencl_sign_one_message(
     &theTester->outputSignatures[0],
     &theTester->outputSignatureSizes[0],
     &theTester->nonces[0],
     &theTester->secretKeys[0],
     &theTester->messages[0],
     CryptoEC256k1::bufferGeneratorContext,
-    bytes[0],
-    bytes[1],
-    bytes[2],
-    bytes[3]
+    messageIndex
   );
 }
 
@@ -1030,17 +1602,16 @@ bool testSignatures::testSignCPP() {
   return true;
 }
 
-void startPublicKeys(testSignatures* theTester, uint32_t messageIndex) {
-  std::vector<unsigned char> bytes = GPU::getUintBytesBigEndian(messageIndex);
-  secp256k1_opencl_generate_public_key(
+void startPublicKeys(testSignatures* theTester, uint32_t firstMessageIndex) {
+  secp256k1_opencl_generate_public_keys_range(
     &theTester->publicKeysBuffer[0],
     &theTester->publicKeysSizes[0],
+    &theTester->publicKeysInversionScratch[0],
     &theTester->secretKeys[0],
+    &theTester->publicKeysCompressionFlags[0],
     CryptoEC256k1::bufferGeneratorContext,
-    bytes[0],
-    bytes[1],
-    bytes[2],
-    bytes[3]
+    firstMessageIndex,
+    theTester->numMessagesPerPipeline - firstMessageIndex
   );
 }
 
@@ -1055,7 +1626,7 @@ bool testSignatures::testPublicKeysCPP() {
   if (!CryptoEC256k1::computeGeneratorContextDefaultBuffers()) {
     return false;
   }
-  for (counterTest = 0; counterTest < this->numMessagesPerPipeline; counterTest ++) {
+  for (counterTest = 0; counterTest < this->numMessagesPerPipeline; counterTest += MACRO_public_keys_per_work_item) {
     thePool.theThreads.push_back(std::make_shared<std::thread>(startPublicKeys, this, counterTest));
     if (thePool.theThreads.size() >= thePool.maximumNumberOfThreads) {
       //logTestCPPThreads << "DEBUG: About to join all: pool size: " << thePool.theThreads.size() << ". " << Logger::endL;
@@ -1098,8 +1669,7 @@ bool testSignatures::testPublicKeysCPP() {
 }
 
 void startVerification(testSignatures* theTester, uint32_t messageIndex) {
-  std::vector<unsigned char> bytes = GPU::getUintBytesBigEndian(messageIndex);
-  secp256k1_opencl_verify_signature(
+  secp256k1_opencl_verify_signature_one_message(
     &theTester->outputVerifications[0],
     &theTester->outputGeneratorContexts[0],
     &theTester->outputSignatures[0],
@@ -1108,22 +1678,15 @@ void startVerification(testSignatures* theTester, uint32_t messageIndex) {
     &theTester->publicKeysSizes[0],
     &theTester->messages[0],
     CryptoEC256k1::bufferMultiplicationContext,
-    bytes[0],
-    bytes[1],
-    bytes[2],
-    bytes[3]
+    messageIndex
   );
 }
 
 void startSHA256twiceFetchBest(testSignatures* theTester, uint32_t messageIndex){
-  std::vector<unsigned char> bytes = GPU::getUintBytesBigEndian(messageIndex);
-  sha256_twice_GPU_fetch_best(
+  sha256_twice_GPU_fetch_best_one_message(
     &theTester->outputSHAs[0],
     (char *) &theTester->secretKeys[0],
-    bytes[0],
-    bytes[1],
-    bytes[2],
-    bytes[3]
+    messageIndex
   );
 }
 
@@ -1276,36 +1839,12 @@ bool testSignatures::testPublicKeys(GPU& theGPU) {
   auto timeStart = std::chrono::system_clock::now();
   unsigned counterTest = - 1;
 
-  kernelPublicKeys->writeToBuffer(2, this->secretKeys);
-  for (counterTest = 0; counterTest < this->numMessagesPerPipeline; counterTest ++) {
-    kernelPublicKeys->writeMessageIndex(counterTest);
-    //theKernel->writeToBuffer(0, &theLength, sizeof(uint));
-    //std::cout << "DEBUG: Setting arguments ... " << std::endl;
-    //std::cout << "DEBUG: arguments set, enqueueing kernel... " << std::endl;
-    cl_int ret = clEnqueueNDRangeKernel(
-      theGPU.commandQueue,
-      kernelPublicKeys->kernel,
-      1,
-      NULL,
-      kernelPublicKeys->global_item_size,
-      kernelPublicKeys->local_item_size,
-      0,
-      NULL,
-      NULL
-    );
-    if (ret != CL_SUCCESS) {
-      theTestLogger << "Failed to enqueue kernel. Return code: " << ret << ". " << Logger::endL;
-      return false;
-    }
-    //std::cout << "DEBUG: kernel enqueued, proceeding to read buffer. " << std::endl;
-    if (counterTest % 100 == 0) {
-      auto timeCurrent = std::chrono::system_clock::now();
-      std::chrono::duration<double> elapsed_seconds = timeCurrent - timeStart;
-      std::cout << "Scheduled " << counterTest << " 32-byte messages in " << elapsed_seconds.count() << " second(s),"
-      << " current speed: "
-      << ((counterTest + 1) / elapsed_seconds.count()) << " public keys per second." << std::endl;
-    }
+  kernelPublicKeys->writeToBuffer(3, this->secretKeys);
+  kernelPublicKeys->writeToBuffer(4, this->publicKeysCompressionFlags);
+  if (!kernelPublicKeys->enqueueBatch(0, this->numMessagesPerPipeline, 0)) {
+    return false;
   }
+  counterTest = this->numMessagesPerPipeline;
   if (!theGPU.finish()) {
     return false;
   }
@@ -1361,6 +1900,12 @@ bool testSignatures::testPublicKeys(GPU& theGPU) {
       theTestLogger << "Public key: " << counterTest << " failed to be generated. " << Logger::endL;
       assert(false);
     }
+    unsigned expectedSize = this->publicKeysCompressionFlags[counterTest] ? 33 : 65;
+    if (this->publicKeyStrings[counterTest].size() != expectedSize) {
+      theTestLogger << "Public key: " << counterTest << " has size " << this->publicKeyStrings[counterTest].size()
+      << " instead of " << expectedSize << ". " << Logger::endL;
+      assert(false);
+    }
   }
   theTestLogger << this->toStringPublicKeys() << Logger::endL;
   return true;
@@ -1443,46 +1988,11 @@ bool testSignatures::testVerifySignatures(GPU& theGPU, bool tamperWithSignature)
   kernelVerify->writeToBuffer(4, this->publicKeysBuffer);
   kernelVerify->writeToBuffer(5, this->publicKeysSizes);
   kernelVerify->writeToBuffer(6, this->messages);
-  int numPipelined = 0;
-  for (counterTest = 0; counterTest < this->numMessagesPerPipeline; counterTest ++) {
-    kernelVerify->writeMessageIndex(counterTest);
-    //theKernel->writeToBuffer(0, &theLength, sizeof(uint));
-    //std::cout << "DEBUG: Setting arguments ... " << std::endl;
-    //std::cout << "DEBUG: arguments set, enqueueing kernel... " << std::endl;
-    cl_int ret = clEnqueueNDRangeKernel(
-      theGPU.commandQueue,
-      kernelVerify->kernel,
-      1,
-      NULL,
-      kernelVerify->global_item_size,
-      kernelVerify->local_item_size,
-      0,
-      NULL,
-      NULL
-    );
-    if (ret != CL_SUCCESS) {
-      theTestLogger << "Failed to enqueue kernel. Return code: " << ret << ". " << Logger::endL;
-      return false;
-    }
-    numPipelined ++;
-    if (numPipelined >= MACRO_max_num_SIGNATURES_IN_PARALLEL) {
-      if (!theGPU.finish()) {
-        theTestLogger << "Failed to finish current computation queue";
-        return false;
-      } else {
-        theTestLogger << "Finished " << numPipelined << " pipelined verifications. " << Logger::endL;
-      }
-      numPipelined = 0;
-    }
-    //std::cout << "DEBUG: kernel enqueued, proceeding to read buffer. " << std::endl;
-    if (counterTest % 100 == 0) {
-      auto timeCurrent = std::chrono::system_clock::now();
-      std::chrono::duration<double> elapsed_seconds = timeCurrent - timeStart;
-      std::cout << "Scheduled " << counterTest << " 32-byte verifications in " << elapsed_seconds.count() << " second(s),"
-      << " current speed: "
-      << ((counterTest + 1) / elapsed_seconds.count()) << " scheduled per second." << std::endl;
-    }
+  //Launches are capped at the number of signature memory pool slots.
+  if (!kernelVerify->enqueueBatch(0, this->numMessagesPerPipeline, MACRO_max_num_SIGNATURES_IN_PARALLEL)) {
+    return false;
   }
+  counterTest = this->numMessagesPerPipeline;
   if (!theGPU.finish()) {
     return false;
   }